@@ -37,6 +37,10 @@
 #include <libavdevice/avdevice.h>
 #endif
 
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 static int av_log_level_to_mp_level(int av_level)
 {
     if (av_level > AV_LOG_VERBOSE)
@@ -111,9 +115,37 @@ static void mp_msg_av_log_callback(void *ptr, int level, const char *fmt,
     mp_msg_va(type, mp_level, fmt, vl);
 }
 
+#ifdef HAVE_PTHREADS
+// Needed since codecs can be opened from several threads (e.g. by
+// avformat_find_stream_info() when prefetching the next file).
+static int mp_lock_manager(void **mutex, enum AVLockOp op)
+{
+    switch (op) {
+    case AV_LOCK_CREATE:
+        *mutex = malloc(sizeof(pthread_mutex_t));
+        if (!*mutex)
+            return 1;
+        return pthread_mutex_init(*mutex, NULL);
+    case AV_LOCK_OBTAIN:
+        return pthread_mutex_lock(*mutex);
+    case AV_LOCK_RELEASE:
+        return pthread_mutex_unlock(*mutex);
+    case AV_LOCK_DESTROY:
+        pthread_mutex_destroy(*mutex);
+        free(*mutex);
+        *mutex = NULL;
+        return 0;
+    }
+    return 1;
+}
+#endif
+
 void init_libav(void)
 {
     av_log_set_callback(mp_msg_av_log_callback);
+#ifdef HAVE_PTHREADS
+    av_lockmgr_register(mp_lock_manager);
+#endif
     avcodec_register_all();
     av_register_all();
     avformat_network_init();
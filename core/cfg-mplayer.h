@@ -331,7 +331,11 @@ const m_option_t common_opts[] = {
     OPT_FLOATRANGE("cache-seek-min", stream_cache_seek_min_percent, 0, 0, 99),
     OPT_CHOICE_OR_INT("cache-pause", stream_cache_pause, 0,
                       0, 40, ({"no", -1})),
+    OPT_INTRANGE("cache-connections", stream_cache_connections, 0, 1, 16),
+    OPT_STRING("cache-file", stream_cache_file, 0),
+    OPT_INTRANGE("cache-file-size", stream_cache_file_size, 0, 32, 0x7fffffff),
 #endif /* CONFIG_STREAM_CACHE */
+    OPT_MAKE_FLAGS("file-mmap", file_mmap, 0),
     {"cdrom-device", &cdrom_device, CONF_TYPE_STRING, 0, 0, 0, NULL},
 #ifdef CONFIG_DVDREAD
     {"dvd-device", &dvd_device,  CONF_TYPE_STRING, 0, 0, 0, NULL},
@@ -358,6 +362,7 @@ const m_option_t common_opts[] = {
     {"prefer-ipv4", &network_prefer_ipv4, CONF_TYPE_FLAG, 0, 0, 1, NULL},
     {"ipv4-only-proxy", &network_ipv4_only_proxy, CONF_TYPE_FLAG, 0, 0, 1, NULL},
     {"reuse-socket", &reuse_socket, CONF_TYPE_FLAG, 0, 0, 1, NULL},
+    OPT_INTRANGE("udp-jitter-buffer", udp_jitter_buffer, 0, 0, 10000),
 #ifdef HAVE_AF_INET6
     {"prefer-ipv6", &network_prefer_ipv4, CONF_TYPE_FLAG, 0, 1, 0, NULL},
 #endif /* HAVE_AF_INET6 */
@@ -414,6 +419,13 @@ const m_option_t common_opts[] = {
     OPT_STRING("audio-demuxer", audio_demuxer_name, 0),
     OPT_STRING("sub-demuxer", sub_demuxer_name, 0),
     OPT_MAKE_FLAGS("extbased", extension_parsing, 0),
+    OPT_MAKE_FLAGS("demuxer-thread", demuxer_thread, 0),
+    OPT_MAKE_FLAGS("demux-benchmark", demux_benchmark, 0),
+    OPT_FLOATRANGE("demuxer-readahead-secs", demuxer_readahead_secs, 0, 0, 600),
+    OPT_INTRANGE("demuxer-max-bytes", demuxer_max_bytes, 0, 0, 0x7fffffff),
+    OPT_MAKE_FLAGS("mkv-index-cache", mkv_index_cache, 0),
+    OPT_MAKE_FLAGS("mkv-index-scan", mkv_index_scan, 0),
+    OPT_MAKE_FLAGS("probe-cache", probe_cache, 0),
 
     {"mf", (void *) mfopts_conf, CONF_TYPE_SUBCONFIG, 0,0,0, NULL},
 #ifdef CONFIG_RADIO
@@ -486,6 +498,9 @@ const m_option_t common_opts[] = {
     OPT_MAKE_FLAGS("slices", vd_use_slices, 0),
     // use (probably completely broken) decoder direct rendering
     OPT_MAKE_FLAGS("dr1", vd_use_dr1, 0),
+    OPT_INTRANGE("video-decode-ahead", video_decode_ahead, 0, 0, 64),
+    OPT_INTRANGE("video-decode-ahead-bytes", video_decode_ahead_bytes, 0,
+                 1024 * 1024, 0x7fffffff),
     {"field-dominance", &field_dominance, CONF_TYPE_CHOICE, 0,
      M_CHOICES(({"auto", -1}, {"top", 0}, {"bottom", 1}))},
 
@@ -570,7 +585,9 @@ const m_option_t mplayer_opts[]={
                ({"auto", -1},
                 {"no", 0},
                 {"yes", 1})),
-    OPT_MAKE_FLAGS("gapless-audio", gapless_audio, 0),
+    OPT_CHOICE("gapless-audio", gapless_audio, 0,
+               ({"no", 0}, {"yes", 1}, {"", 1}, {"weak", -1})),
+    OPT_MAKE_FLAGS("prefetch-playlist", prefetch_playlist, 0),
     // override audio buffer size (used only by -ao oss/win32, obsolete)
     OPT_INT("abs", ao_buffersize, 0),
 
@@ -657,6 +674,7 @@ const m_option_t mplayer_opts[]={
                ({"no", 0},
                 {"yes", 1}, {"", 1},
                 {"hard", 2})),
+    OPT_MAKE_FLAGS("video-degrade", video_degrade, 0),
 
     OPT_FLAG_ON("untimed", untimed, 0),
 
@@ -677,6 +695,8 @@ const m_option_t mplayer_opts[]={
     {"}", NULL, CONF_TYPE_FLAG, CONF_NOCFG, 0, 0, NULL},
 
     OPT_MAKE_FLAGS("ordered-chapters", ordered_chapters, 0),
+    OPT_MAKE_FLAGS("ordered-chapters-index", ordered_chapters_index, 0),
+    OPT_FLOATRANGE("timeline-prefetch", timeline_prefetch, 0, 0, 600),
     OPT_INTRANGE("chapter-merge-threshold", chapter_merge_threshold, 0, 0, 10000),
 
     // a-v sync stuff:
@@ -687,6 +707,7 @@ const m_option_t mplayer_opts[]={
     OPT_CHOICE("hr-seek", hr_seek, 0,
                ({"no", -1}, {"absolute", 0}, {"always", 1}, {"yes", 1})),
     OPT_FLOATRANGE("hr-seek-demuxer-offset", hr_seek_demuxer_offset, 0, -9, 99),
+    OPT_MAKE_FLAGS("keyframe-scrub", keyframe_scrub, 0),
     OPT_FLAG_CONSTANTS("no-autosync", autosync, 0, 0, -1),
     OPT_INTRANGE("autosync", autosync, 0, 0, 10000),
 
@@ -217,7 +217,10 @@ static int mp_property_stream_pos(m_option_t *prop, int action, void *arg,
         return M_PROPERTY_UNAVAILABLE;
     switch (action) {
     case M_PROPERTY_GET:
-        *(int64_t *) arg = stream_tell(stream);
+        if (mpctx->demuxer && mpctx->demuxer->stream == stream)
+            *(int64_t *) arg = demux_get_pos(mpctx->demuxer);
+        else
+            *(int64_t *) arg = stream_tell(stream);
         return M_PROPERTY_OK;
     case M_PROPERTY_SET:
         stream_seek(stream, *(int64_t *) arg);
@@ -1049,6 +1052,15 @@ static int mp_property_framedrop(m_option_t *prop, int action,
     return mp_property_generic_option(prop, action, arg, mpctx);
 }
 
+/// Current --video-degrade level (RO)
+static int mp_property_video_degrade_level(m_option_t *prop, int action,
+                                           void *arg, MPContext *mpctx)
+{
+    if (!mpctx->sh_video)
+        return M_PROPERTY_UNAVAILABLE;
+    return m_property_int_ro(prop, action, arg, mpctx->degrade_level);
+}
+
 /// Color settings, try to use vf/vo then fall back on TV. (RW)
 static int mp_property_gamma(m_option_t *prop, int action, void *arg,
                              MPContext *mpctx)
@@ -1424,6 +1436,8 @@ static const m_option_t mp_properties[] = {
     M_OPTION_PROPERTY_CUSTOM("rootwin", mp_property_rootwin),
     M_OPTION_PROPERTY_CUSTOM("border", mp_property_border),
     M_OPTION_PROPERTY_CUSTOM("framedrop", mp_property_framedrop),
+    { "video-degrade-level", mp_property_video_degrade_level, CONF_TYPE_INT,
+      M_OPT_RANGE, VD_DEGRADE_NONE, VD_DEGRADE_LOWRES, NULL },
     M_OPTION_PROPERTY_CUSTOM_("gamma", mp_property_gamma,
                     .offset = offsetof(struct MPOpts, vo_gamma_gamma)),
     M_OPTION_PROPERTY_CUSTOM_("brightness", mp_property_gamma,
@@ -29,10 +29,15 @@ void set_default_mplayer_options(struct MPOpts *opts)
         .osd_duration = 1000,
         .loop_times = -1,
         .ordered_chapters = 1,
+        .ordered_chapters_index = 1,
+        .timeline_prefetch = 2.0,
         .chapter_merge_threshold = 100,
         .stream_cache_min_percent = 20.0,
         .stream_cache_seek_min_percent = 50.0,
         .stream_cache_pause = 10.0,
+        .stream_cache_connections = 1,
+        .udp_jitter_buffer = 50,
+        .stream_cache_file_size = 1024 * 1024,
         .chapterrange = {-1, -1},
         .edition_id = -1,
         .user_correct_pts = -1,
@@ -47,12 +52,17 @@ void set_default_mplayer_options(struct MPOpts *opts)
         .audio_display = 1,
         .sub_visibility = 1,
         .extension_parsing = 1,
+        .demuxer_readahead_secs = 5.0,
+        .demuxer_max_bytes = 128 * 1024 * 1024,
+        .mkv_index_cache = 1,
+        .mkv_index_scan = 1,
         .audio_output_channels = 2,
         .audio_output_format = -1,  // AF_FORMAT_UNKNOWN
         .playback_speed = 1.,
         .drc_level = 1.,
         .movie_aspect = -1.,
         .flip = -1,
+        .video_decode_ahead_bytes = 128 * 1024 * 1024,
         .sub_auto = 1,
 #ifdef CONFIG_ASS
         .ass_enabled = 1,
@@ -133,6 +133,8 @@ typedef struct MPContext {
     struct playlist *playlist;
     char *filename; // currently playing file
     struct mp_resolve_result *resolve_result;
+    // Next playlist entry being opened in the background (--prefetch-playlist)
+    struct playlist_prefetch *playlist_prefetch;
     enum stop_play_reason stop_play;
     unsigned int initialized_flags;  // which subsystems have been initialized
 
@@ -145,6 +147,13 @@ typedef struct MPContext {
     struct timeline_part *timeline;
     int num_timeline_parts;
     int timeline_part;
+    // Part whose source was already seeked by timeline_prefetch() (or -1),
+    // and the demux_seek() parameters used for it.
+    int timeline_prefetch_part;
+    double timeline_prefetch_pts;
+    int timeline_prefetch_flags;
+    // Seek of the next part's source in progress (see timeline_prefetch()).
+    struct timeline_prefetch *timeline_prefetch;
     // NOTE: even if num_chapters==0, chapters being not NULL signifies presence
     //       of chapter metadata
     struct chapter *chapters;
@@ -171,6 +180,9 @@ typedef struct MPContext {
 
     mixer_t mixer;
     struct ao *ao;
+    // Format requested when the AO was opened; the driver may have changed
+    // ao->samplerate etc. to what the device supports.
+    int ao_req_samplerate, ao_req_channels, ao_req_format;
     struct vo *video_out;
 
     /* We're starting playback from scratch or after a seek. Show first
@@ -228,6 +240,9 @@ typedef struct MPContext {
         // currently not set by commands, only used internally by seek()
         int direction; // -1 = backward, 0 = default, 1 = forward
     } seek;
+    // --keyframe-scrub: the seek to repeat with normal decoding once the user
+    // stops seeking. MPSEEK_NONE if not scrubbing.
+    struct seek_params scrub_seek;
 
     /* Heuristic for relative chapter seeks: keep track which chapter
      * the user wanted to go to, even if we aren't exactly within the
@@ -254,6 +269,14 @@ typedef struct MPContext {
     // playback rate. Used to avoid showing it multiple times.
     bool drop_message_shown;
 
+    // --video-degrade: current enum vd_degradation level, and the decoder
+    // statistics at the start of the current measurement interval.
+    int degrade_level;
+    double degrade_decode_time;
+    int degrade_decoded_packets;
+    // Number of consecutive intervals with enough headroom to step back up.
+    int degrade_headroom;
+
     struct screenshot_ctx *screenshot_ctx;
 
     char *track_layout_hash;
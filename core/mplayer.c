@@ -32,6 +32,10 @@
 #include "config.h"
 #include "talloc.h"
 
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #include "osdep/io.h"
 
 #if defined(__MINGW32__) || defined(__CYGWIN__)
@@ -487,6 +491,8 @@ static void cleanup_demux_stream(struct MPContext *mpctx, enum stream_type type)
     set_demux_field(mpctx, type, NULL);
 }
 
+static void wait_timeline_prefetch(struct MPContext *mpctx);
+
 // Switch the demuxers to current track selection. This is possibly important
 // for intialization: if something reads packets from the demuxer (like at least
 // reinit_audio_chain does, or when seeking), packets from the other streams
@@ -494,17 +500,23 @@ static void cleanup_demux_stream(struct MPContext *mpctx, enum stream_type type)
 // before the first initialization function is called.
 static void preselect_demux_streams(struct MPContext *mpctx)
 {
-    // Disable all streams, just to be sure no unwanted streams are selected.
-    for (int n = 0; n < mpctx->num_sources; n++) {
-        for (int type = 0; type < STREAM_TYPE_COUNT; type++)
-            demuxer_switch_track(mpctx->sources[n], type, NULL);
-    }
-
+    wait_timeline_prefetch(mpctx);
+    // Disable all other streams, just to be sure no unwanted streams are
+    // selected. Streams which stay selected are not switched off in between,
+    // which would make some demuxers drop their buffered packets.
     for (int type = 0; type < STREAM_TYPE_COUNT; type++) {
         struct track *track = mpctx->current_track[type];
-        if (track && track->stream)
-            demuxer_switch_track(track->stream->demuxer, type, track->stream);
+        struct sh_stream *stream = track ? track->stream : NULL;
+        for (int n = 0; n < mpctx->num_sources; n++) {
+            struct demuxer *d = mpctx->sources[n];
+            if (!stream || stream->demuxer != d)
+                demuxer_switch_track(d, type, NULL);
+        }
+        if (stream)
+            demuxer_switch_track(stream->demuxer, type, stream);
     }
+    // The prefetched timeline part might have lost its selected streams.
+    mpctx->timeline_prefetch_part = -1;
 }
 
 static void uninit_subs(struct demuxer *demuxer)
@@ -560,6 +572,7 @@ void uninit_player(struct MPContext *mpctx, unsigned int mask)
             mpctx->current_track[t] = NULL;
         assert(!mpctx->sh_video && !mpctx->sh_audio && !mpctx->sh_sub);
         mpctx->master_demuxer = NULL;
+        wait_timeline_prefetch(mpctx);
         for (int i = 0; i < mpctx->num_sources; i++) {
             uninit_subs(mpctx->sources[i]);
             struct demuxer *demuxer = mpctx->sources[i];
@@ -619,9 +632,12 @@ void uninit_player(struct MPContext *mpctx, unsigned int mask)
     }
 }
 
+static void discard_playlist_prefetch(struct MPContext *mpctx);
+
 static MP_NORETURN void exit_player(struct MPContext *mpctx,
                                     enum exit_reason how, int rc)
 {
+    discard_playlist_prefetch(mpctx);
     uninit_player(mpctx, INITIALIZED_ALL);
 
 #ifdef CONFIG_ENCODING
@@ -720,7 +736,10 @@ static bool parse_cfgfiles(struct MPContext *mpctx, m_config_t *conf)
 
 #define PROFILE_CFG_PROTOCOL "protocol."
 
-static void load_per_protocol_config(m_config_t *conf, const char * const file)
+// If load is false, only check whether there is a profile to load. The
+// other load_per_*_config() functions work the same way.
+static bool load_per_protocol_config(m_config_t *conf, const char * const file,
+                                     bool load)
 {
     char *str;
     char protocol[strlen(PROFILE_CFG_PROTOCOL) + strlen(file) + 1];
@@ -729,21 +748,23 @@ static void load_per_protocol_config(m_config_t *conf, const char * const file)
     /* does filename actually uses a protocol ? */
     str = strstr(file, "://");
     if (!str)
-        return;
+        return false;
 
     sprintf(protocol, "%s%s", PROFILE_CFG_PROTOCOL, file);
     protocol[strlen(PROFILE_CFG_PROTOCOL) + strlen(file) - strlen(str)] = '\0';
     p = m_config_get_profile(conf, protocol);
-    if (p) {
+    if (p && load) {
         mp_tmsg(MSGT_CPLAYER, MSGL_INFO,
                 "Loading protocol-related profile '%s'\n", protocol);
         m_config_set_profile(conf, p);
     }
+    return p != NULL;
 }
 
 #define PROFILE_CFG_EXTENSION "extension."
 
-static void load_per_extension_config(m_config_t *conf, const char * const file)
+static bool load_per_extension_config(m_config_t *conf, const char * const file,
+                                      bool load)
 {
     char *str;
     char extension[strlen(PROFILE_CFG_EXTENSION) + 8];
@@ -752,16 +773,17 @@ static void load_per_extension_config(m_config_t *conf, const char * const file)
     /* does filename actually have an extension ? */
     str = strrchr(file, '.');
     if (!str)
-        return;
+        return false;
 
     sprintf(extension, PROFILE_CFG_EXTENSION);
     strncat(extension, ++str, 7);
     p = m_config_get_profile(conf, extension);
-    if (p) {
+    if (p && load) {
         mp_tmsg(MSGT_CPLAYER, MSGL_INFO,
                 "Loading extension-related profile '%s'\n", extension);
         m_config_set_profile(conf, p);
     }
+    return p != NULL;
 }
 
 #define PROFILE_CFG_VO "vo."
@@ -782,28 +804,33 @@ static void load_per_output_config(m_config_t *conf, char *cfg, char *out)
 }
 
 /**
- * Tries to load a config file
+ * Tries to load a config file (only checks whether it exists if !load)
  * @return 0 if file was not found, 1 otherwise
  */
-static int try_load_config(m_config_t *conf, const char *file)
+static int try_load_config(m_config_t *conf, const char *file, bool load)
 {
     if (!mp_path_exists(file))
         return 0;
+    if (!load)
+        return 1;
     mp_tmsg(MSGT_CPLAYER, MSGL_INFO, "Loading config '%s'\n", file);
     m_config_parse_config_file(conf, file);
     return 1;
 }
 
-static void load_per_file_config(m_config_t *conf, const char * const file)
+static bool load_per_file_config(m_config_t *conf, const char * const file,
+                                 bool load)
 {
     char *confpath;
     char cfg[MP_PATH_MAX];
     const char *name;
+    bool found = false;
 
     if (strlen(file) > MP_PATH_MAX - 14) {
-        mp_msg(MSGT_CPLAYER, MSGL_WARN, "Filename is too long, "
-               "can not load file or directory specific config files\n");
-        return;
+        if (load)
+            mp_msg(MSGT_CPLAYER, MSGL_WARN, "Filename is too long, "
+                   "can not load file or directory specific config files\n");
+        return false;
     }
     sprintf(cfg, "%s.conf", file);
 
@@ -812,17 +839,18 @@ static void load_per_file_config(m_config_t *conf, const char * const file)
         char dircfg[MP_PATH_MAX];
         strcpy(dircfg, cfg);
         strcpy(dircfg + (name - cfg), "mpv.conf");
-        try_load_config(conf, dircfg);
+        found |= try_load_config(conf, dircfg, load);
 
-        if (try_load_config(conf, cfg))
-            return;
+        if (try_load_config(conf, cfg, load))
+            return true;
     }
 
     if ((confpath = mp_find_user_config_file(name)) != NULL) {
-        try_load_config(conf, confpath);
+        found |= try_load_config(conf, confpath, load);
 
         talloc_free(confpath);
     }
+    return found;
 }
 
 static void load_per_file_options(m_config_t *conf,
@@ -1600,6 +1628,31 @@ void reinit_audio_chain(struct MPContext *mpctx)
         mpctx->initialized_flags |= INITIALIZED_ACODEC;
     }
 
+    // With --gapless-audio=weak, keep the AO only if this file would open it
+    // with the same format. Compare with the requested format, not with the
+    // one the driver picked, which the file would never ask for.
+    if (opts->gapless_audio < 0 && (mpctx->initialized_flags & INITIALIZED_AO)
+        && mpctx->ao->initialized)
+    {
+        ao = mpctx->ao;
+        int samplerate = force_srate, channels = 0;
+        int format = opts->audio_output_format;
+        if (init_audio_filters(mpctx->sh_audio, mpctx->sh_audio->samplerate,
+                               &samplerate, &channels, &format) &&
+            (samplerate != mpctx->ao_req_samplerate ||
+             channels != mpctx->ao_req_channels ||
+             format != mpctx->ao_req_format))
+        {
+            mp_msg(MSGT_CPLAYER, MSGL_V, "Audio format changed, reopening "
+                   "audio output.\n");
+            // Let the old audio finish playing.
+            enum stop_play_reason orig_stop_play = mpctx->stop_play;
+            mpctx->stop_play = AT_END_OF_FILE;
+            uninit_player(mpctx, INITIALIZED_AO);
+            mpctx->stop_play = orig_stop_play;
+        }
+    }
+
     if (!(mpctx->initialized_flags & INITIALIZED_AO)) {
         mpctx->initialized_flags |= INITIALIZED_AO;
         mpctx->ao = ao_create(opts, mpctx->input);
@@ -1621,6 +1674,9 @@ void reinit_audio_chain(struct MPContext *mpctx)
     if (!ao->initialized) {
         ao->buffersize = opts->ao_buffersize;
         ao->encode_lavc_ctx = mpctx->encode_lavc_ctx;
+        mpctx->ao_req_samplerate = ao->samplerate;
+        mpctx->ao_req_channels = ao->channels;
+        mpctx->ao_req_format = ao->format;
         ao_init(ao, opts->audio_driver_list);
         if (!ao->initialized) {
             mp_tmsg(MSGT_CPLAYER, MSGL_ERR,
@@ -1910,6 +1966,59 @@ static int check_framedrop(struct MPContext *mpctx, double frame_time)
     return 0;
 }
 
+// Number of packets over which --video-degrade averages the decoding time.
+#define DEGRADE_INTERVAL 30
+
+// --video-degrade: compare the time the decoder takes per frame with the
+// frame duration, and make the decoder skip work while it can't keep up.
+// Quality is restored only after a few intervals with plenty of headroom,
+// since decoding gets slower again at the better quality level.
+static void update_video_degradation(struct MPContext *mpctx)
+{
+    struct MPOpts *opts = &mpctx->opts;
+    struct sh_video *sh_video = mpctx->sh_video;
+    double frame_time = sh_video->frametime / opts->playback_speed;
+    double time;
+    int packets;
+
+    if (!opts->video_degrade || frame_time <= 0 ||
+        !get_video_decode_time(sh_video, &time, &packets))
+        return;
+    // Decoding after seeks (and while paused) isn't representative.
+    if (mpctx->restart_playback || mpctx->paused) {
+        mpctx->degrade_decode_time = time;
+        mpctx->degrade_decoded_packets = packets;
+        return;
+    }
+    int num = packets - mpctx->degrade_decoded_packets;
+    if (num < DEGRADE_INTERVAL)
+        return;
+    double load = (time - mpctx->degrade_decode_time) / num / frame_time;
+    mpctx->degrade_decode_time = time;
+    mpctx->degrade_decoded_packets = packets;
+
+    int level = mpctx->degrade_level;
+    if (load > 0.8) {
+        level++;
+        mpctx->degrade_headroom = 0;
+    } else if (load < 0.5 && level > VD_DEGRADE_NONE) {
+        if (++mpctx->degrade_headroom >= 3) {
+            level--;
+            mpctx->degrade_headroom = 0;
+        }
+    } else {
+        mpctx->degrade_headroom = 0;
+    }
+    if (level == mpctx->degrade_level)
+        return;
+    level = set_video_degradation(sh_video, level);
+    if (level != mpctx->degrade_level) {
+        mp_msg(MSGT_CPLAYER, MSGL_V, "Decoding takes %.0f%% of the frame "
+               "time, setting degradation level %d.\n", load * 100, level);
+        mpctx->degrade_level = level;
+    }
+}
+
 static float timing_sleep(struct MPContext *mpctx, float time_frame)
 {
     // assume kernel HZ=100 for softsleep, works with larger HZ but with
@@ -2422,6 +2531,8 @@ int reinit_video_chain(struct MPContext *mpctx)
     sh_video->next_frame_time = 0;
     mpctx->restart_playback = true;
     mpctx->delay = 0;
+    mpctx->degrade_level = VD_DEGRADE_NONE;
+    mpctx->degrade_headroom = 0;
 
     // ========== Init display (sh_video->disp_w*sh_video->disp_h/out_fmt) ============
 
@@ -2470,6 +2581,7 @@ static double update_video_nocorrect_pts(struct MPContext *mpctx)
         void *decoded_frame;
         decoded_frame = decode_video(sh_video, sh_video->ds->current, packet,
                                      in_size, framedrop_type, sh_video->pts);
+        update_video_degradation(mpctx);
         if (decoded_frame) {
             filter_video(sh_video, decoded_frame, sh_video->pts);
         }
@@ -2554,6 +2666,7 @@ static double update_video(struct MPContext *mpctx)
                              check_framedrop(mpctx, sh_video->frametime);
         void *decoded_frame = decode_video(sh_video, pkt, buf, in_size,
                                            framedrop_type, pts);
+        update_video_degradation(mpctx);
         if (decoded_frame) {
             determine_frame_pts(mpctx);
             filter_video(sh_video, decoded_frame, sh_video->pts);
@@ -2711,14 +2824,32 @@ static void seek_reset(struct MPContext *mpctx, bool reset_ao, bool reset_ac)
 #endif
 }
 
+// Select the streams of the given source which correspond to the tracks
+// coming from the timeline.
+static void timeline_select_tracks(struct MPContext *mpctx,
+                                   struct demuxer *source)
+{
+    for (int n = 0; n < mpctx->num_tracks; n++) {
+        struct track *track = mpctx->tracks[n];
+        if (track->under_timeline) {
+            track->demuxer = source;
+            track->stream = demuxer_stream_by_demuxer_id(track->demuxer,
+                                                         track->type,
+                                                         track->demuxer_id);
+        }
+    }
+}
+
 static bool timeline_set_part(struct MPContext *mpctx, int i, bool force)
 {
     struct timeline_part *p = mpctx->timeline + mpctx->timeline_part;
     struct timeline_part *n = mpctx->timeline + i;
+    wait_timeline_prefetch(mpctx);
     mpctx->timeline_part = i;
     mpctx->video_offset = n->start - n->source_start;
     if (n->source == p->source && !force)
         return false;
+    bool prefetched = mpctx->timeline_prefetch_part == i;
     enum stop_play_reason orig_stop_play = mpctx->stop_play;
     if (!mpctx->sh_video && mpctx->stop_play == KEEP_PLAYING)
         mpctx->stop_play = AT_END_OF_FILE;  // let audio uninit drain data
@@ -2730,16 +2861,11 @@ static bool timeline_set_part(struct MPContext *mpctx, int i, bool force)
 
     // While another timeline was active, the selection of active tracks might
     // have been changed - possibly we need to update this source.
-    for (int n = 0; n < mpctx->num_tracks; n++) {
-        struct track *track = mpctx->tracks[n];
-        if (track->under_timeline) {
-            track->demuxer = mpctx->demuxer;
-            track->stream = demuxer_stream_by_demuxer_id(track->demuxer,
-                                                         track->type,
-                                                         track->demuxer_id);
-        }
-    }
+    timeline_select_tracks(mpctx, mpctx->demuxer);
     preselect_demux_streams(mpctx);
+    // timeline_prefetch() selected the same streams, so they were kept.
+    if (prefetched)
+        mpctx->timeline_prefetch_part = i;
 
     return true;
 }
@@ -2762,6 +2888,140 @@ static double timeline_set_from_time(struct MPContext *mpctx, double pts,
 }
 
 
+static bool is_hr_seek(struct MPContext *mpctx, struct seek_params seek)
+{
+    struct MPOpts *opts = &mpctx->opts;
+    bool hr_seek = mpctx->demuxer->accurate_seek && opts->correct_pts;
+    hr_seek &= seek.exact >= 0 && seek.type != MPSEEK_FACTOR;
+    hr_seek &= opts->hr_seek == 0 && seek.type == MPSEEK_ABSOLUTE
+               || opts->hr_seek > 0 || seek.exact > 0;
+    return hr_seek;
+}
+
+static int get_demux_seek_flags(struct seek_params seek, bool hr_seek)
+{
+    int demuxer_style = 0;
+    switch (seek.type) {
+    case MPSEEK_FACTOR:
+        demuxer_style |= SEEK_FACTOR; // fallthrough
+    case MPSEEK_ABSOLUTE:
+        demuxer_style |= SEEK_ABSOLUTE;
+    }
+    if (hr_seek || seek.direction < 0)
+        demuxer_style |= SEEK_BACKWARD;
+    else if (seek.direction > 0)
+        demuxer_style |= SEEK_FORWARD;
+    return demuxer_style;
+}
+
+#ifdef HAVE_PTHREADS
+
+struct timeline_prefetch {
+    pthread_t thread;
+    struct demuxer *source;
+    struct sh_stream *streams[STREAM_TYPE_COUNT];
+    double pts, audio_delay;
+    int flags;
+    bool ok;
+};
+
+static void *timeline_prefetch_thread(void *arg)
+{
+    struct timeline_prefetch *p = arg;
+    struct demuxer *d = p->source;
+    for (int type = 0; type < STREAM_TYPE_COUNT; type++)
+        demuxer_switch_track(d, type, p->streams[type]);
+    p->ok = demux_seek(d, p->pts, p->audio_delay, p->flags);
+    if (p->ok) {
+        struct demux_stream *ds = d->video->sh ? d->video : d->audio;
+        if (ds->sh && !ds->packs)
+            demux_fill_buffer(d, ds);
+    }
+    return NULL;
+}
+
+/* Seek the source of the next timeline part to the start of the part before
+ * playback reaches it, and read its first packets, so that switching to it
+ * doesn't need to wait for the seek and for I/O. Done with the same
+ * parameters as the seek at the end of the current part, which then skips
+ * the demuxer seek. The seek runs on a separate thread, so that slow I/O
+ * doesn't stall playback of the current part; wait_timeline_prefetch() must
+ * be called before the main thread accesses the sources again.
+ */
+static void timeline_prefetch(struct MPContext *mpctx, double end)
+{
+    struct MPOpts *opts = &mpctx->opts;
+    int i = mpctx->timeline_part + 1;
+    if (opts->timeline_prefetch <= 0 || i >= mpctx->num_timeline_parts ||
+        mpctx->timeline_prefetch_part == i || mpctx->timeline_prefetch)
+        return;
+    struct timeline_part *n = mpctx->timeline + i;
+    // A source which is still being played can't be seeked away.
+    if (n->source == mpctx->demuxer || !n->source->seekable)
+        return;
+    double now = get_current_time(mpctx);
+    if (now == MP_NOPTS_VALUE || end - now > opts->timeline_prefetch)
+        return;
+
+    struct seek_params seek = {
+        .type = MPSEEK_ABSOLUTE,
+        .amount = n->start,
+    };
+    bool hr_seek = is_hr_seek(mpctx, seek);
+    struct timeline_prefetch *p = talloc_ptrtype(NULL, p);
+    *p = (struct timeline_prefetch) {
+        .source = n->source,
+        .pts = n->source_start,
+        .audio_delay = audio_delay,
+        .flags = get_demux_seek_flags(seek, hr_seek),
+    };
+    if (hr_seek)
+        p->pts -= opts->hr_seek_demuxer_offset;
+    // Select the streams the part switch will select.
+    for (int type = 0; type < STREAM_TYPE_COUNT; type++) {
+        struct track *track = mpctx->current_track[type];
+        if (track && track->under_timeline) {
+            p->streams[type] = demuxer_stream_by_demuxer_id(n->source, type,
+                                                        track->demuxer_id);
+        }
+    }
+
+    mp_msg(MSGT_CPLAYER, MSGL_V, "Prefetching timeline part %d.\n", i);
+    if (pthread_create(&p->thread, NULL, timeline_prefetch_thread, p)) {
+        talloc_free(p);
+        return;
+    }
+    mpctx->timeline_prefetch = p;
+    // Assume success; wait_timeline_prefetch() resets this if the seek failed.
+    mpctx->timeline_prefetch_part = i;
+    mpctx->timeline_prefetch_pts = p->pts;
+    mpctx->timeline_prefetch_flags = p->flags;
+}
+
+static void wait_timeline_prefetch(struct MPContext *mpctx)
+{
+    struct timeline_prefetch *p = mpctx->timeline_prefetch;
+    if (!p)
+        return;
+    pthread_join(p->thread, NULL);
+    if (!p->ok)
+        mpctx->timeline_prefetch_part = -1;
+    talloc_free(p);
+    mpctx->timeline_prefetch = NULL;
+}
+
+#else /* HAVE_PTHREADS */
+
+static void timeline_prefetch(struct MPContext *mpctx, double end)
+{
+}
+
+static void wait_timeline_prefetch(struct MPContext *mpctx)
+{
+}
+
+#endif /* HAVE_PTHREADS */
+
 // return -1 if seek failed (non-seekable stream?), 0 otherwise
 static int seek(MPContext *mpctx, struct seek_params seek,
                 bool timeline_fallthrough)
@@ -2773,10 +3033,7 @@ static int seek(MPContext *mpctx, struct seek_params seek,
 
     if (mpctx->stop_play == AT_END_OF_FILE)
         mpctx->stop_play = KEEP_PLAYING;
-    bool hr_seek = mpctx->demuxer->accurate_seek && opts->correct_pts;
-    hr_seek &= seek.exact >= 0 && seek.type != MPSEEK_FACTOR;
-    hr_seek &= opts->hr_seek == 0 && seek.type == MPSEEK_ABSOLUTE
-               || opts->hr_seek > 0 || seek.exact > 0;
+    bool hr_seek = is_hr_seek(mpctx, seek);
     if (seek.type == MPSEEK_FACTOR
         || seek.type == MPSEEK_ABSOLUTE
         && seek.amount < mpctx->last_chapter_pts
@@ -2817,22 +3074,20 @@ static int seek(MPContext *mpctx, struct seek_params seek,
         reinit_subs(mpctx);
     }
 
-    int demuxer_style = 0;
-    switch (seek.type) {
-    case MPSEEK_FACTOR:
-        demuxer_style |= SEEK_FACTOR; // fallthrough
-    case MPSEEK_ABSOLUTE:
-        demuxer_style |= SEEK_ABSOLUTE;
-    }
-    if (hr_seek || seek.direction < 0)
-        demuxer_style |= SEEK_BACKWARD;
-    else if (seek.direction > 0)
-        demuxer_style |= SEEK_FORWARD;
+    int demuxer_style = get_demux_seek_flags(seek, hr_seek);
 
     if (hr_seek)
         demuxer_amount -= opts->hr_seek_demuxer_offset;
-    int seekresult = demux_seek(mpctx->demuxer, demuxer_amount, audio_delay,
+    int seekresult = 1;
+    // The new part's source might already be at the right position.
+    if (!(need_reset && mpctx->timeline_prefetch_part == mpctx->timeline_part &&
+          mpctx->timeline_prefetch_pts == demuxer_amount &&
+          mpctx->timeline_prefetch_flags == demuxer_style))
+    {
+        seekresult = demux_seek(mpctx->demuxer, demuxer_amount, audio_delay,
                                 demuxer_style);
+    }
+    mpctx->timeline_prefetch_part = -1;
     if (seekresult == 0) {
         if (need_reset) {
             reinit_audio_chain(mpctx);
@@ -2882,6 +3137,14 @@ static int seek(MPContext *mpctx, struct seek_params seek,
         mpctx->hrseek_pts = seek.amount;
     }
 
+    // Any seek not done by execute_queued_seek() (which sets this again)
+    // makes a pending --keyframe-scrub re-seek stale.
+    if (mpctx->scrub_seek.type) {
+        mpctx->scrub_seek = (struct seek_params){ 0 };
+        if (mpctx->sh_video)
+            set_video_keyframes_only(mpctx->sh_video, false);
+    }
+
     mpctx->start_timestamp = GetTimerMS();
 
     return 0;
@@ -2922,6 +3185,70 @@ void queue_seek(struct MPContext *mpctx, enum seek_type type, double amount,
     abort();
 }
 
+/* --keyframe-scrub: a seek that arrives while the previous one is still in
+ * progress (or shortly after it) is done as a keyframe seek, and the decoder
+ * skips everything but keyframes, so that a frame near the target can be
+ * shown right away. Once no new seek has arrived for SCRUB_SETTLE_MS, the
+ * last seek is repeated with normal decoding, precisely if it would have
+ * been a precise seek.
+ */
+#define SCRUB_SETTLE_MS 300
+// How long a new seek waits for the keyframe of a scrubbing seek to show up.
+#define SCRUB_HOLD_MS 100
+
+static void execute_queued_seek(struct MPContext *mpctx)
+{
+    struct MPOpts *opts = &mpctx->opts;
+    struct seek_params sp = mpctx->seek;
+
+    mpctx->seek = (struct seek_params){ 0 };
+    bool scrub = opts->keyframe_scrub && mpctx->sh_video &&
+                 (mpctx->scrub_seek.type || mpctx->restart_playback ||
+                  GetTimerMS() - mpctx->start_timestamp < SCRUB_SETTLE_MS);
+    if (!scrub) {
+        seek(mpctx, sp, false);
+        return;
+    }
+
+    struct seek_params target = sp;
+    if (sp.type == MPSEEK_RELATIVE) {
+        target.type = MPSEEK_ABSOLUTE;
+        target.amount += get_current_time(mpctx);
+        target.direction = sp.amount > 0 ? 1 : -1;
+    }
+    target.exact = is_hr_seek(mpctx, sp) ? 1 : -1;
+
+    sp.exact = -1;
+    if (seek(mpctx, sp, false) < 0)
+        return;
+    // After seek(), which might have reinitialized the decoder.
+    set_video_keyframes_only(mpctx->sh_video, true);
+    mpctx->scrub_seek = target;
+}
+
+static void finish_scrubbing(struct MPContext *mpctx)
+{
+    if (!mpctx->scrub_seek.type || mpctx->restart_playback ||
+        GetTimerMS() - mpctx->start_timestamp < SCRUB_SETTLE_MS)
+        return;
+    struct seek_params sp = mpctx->scrub_seek;
+    mpctx->scrub_seek = (struct seek_params){ 0 };
+    if (!mpctx->sh_video)
+        return;
+    set_video_keyframes_only(mpctx->sh_video, false);
+    // Not a precise seek: stay at the keyframe being shown. Seeking is still
+    // needed, because the frames following it can't be decoded.
+    if (sp.exact < 0 && mpctx->video_pts != MP_NOPTS_VALUE) {
+        sp = (struct seek_params){
+            .type = MPSEEK_ABSOLUTE,
+            .amount = mpctx->video_pts,
+            .exact = -1,
+            .direction = -1,
+        };
+    }
+    seek(mpctx, sp, false);
+}
+
 double get_time_length(struct MPContext *mpctx)
 {
     struct demuxer *demuxer = mpctx->demuxer;
@@ -2987,8 +3314,7 @@ int get_percent_pos(struct MPContext *mpctx)
         ;
     else {
         int len = (demuxer->movi_end - demuxer->movi_start) / 100;
-        int64_t pos = demuxer->filepos > 0 ?
-                      demuxer->filepos : stream_tell(demuxer->stream);
+        int64_t pos = demux_get_pos(demuxer);
         if (len > 0)
             ans = (pos - demuxer->movi_start) / len;
         else
@@ -3150,9 +3476,193 @@ static double get_wakeup_period(struct MPContext *mpctx)
         if (mpctx->video_out->wakeup_period > 0)
             sleeptime = FFMIN(sleeptime, mpctx->video_out->wakeup_period);
 
+    // Check whether scrubbing has stopped (see finish_scrubbing())
+    if (mpctx->scrub_seek.type)
+        sleeptime = FFMIN(sleeptime, 0.05);
+
     return sleeptime;
 }
 
+#ifdef HAVE_PTHREADS
+/* With --prefetch-playlist, the next playlist entry is opened on a separate
+ * thread while the last seconds of the current file are played, so that it
+ * can start without waiting for I/O and probing. Only the stream and the
+ * demuxer are opened this way; everything else is set up as usual.
+ */
+struct playlist_prefetch {
+    pthread_t thread;
+    bool thread_running;
+    // Only options that can't be changed during playback are read through
+    // this; the others are copied when the thread is started.
+    struct MPOpts *opts;
+    int audio_id, video_id, sub_id;
+    int cache_size;
+    struct playlist_entry *entry;
+    char *filename;
+    struct stream *stream;
+    struct demuxer *demuxer;
+    int file_format;
+};
+
+// Start prefetching when the current file has less than this many seconds
+// left.
+#define PLAYLIST_PREFETCH_SECS 10
+
+static bool stream_wants_cache(int cache_size, struct stream *stream)
+{
+    return cache_size > 0 || (cache_size < 0 && stream->cache_size);
+}
+
+static void *playlist_prefetch_thread(void *arg)
+{
+    struct playlist_prefetch *p = arg;
+    struct MPOpts *opts = p->opts;
+    p->stream = open_stream(p->filename, opts, &p->file_format);
+    if (!p->stream)
+        return NULL;
+    p->stream->start_pos += seek_to_byte;
+    // The cache has to be enabled before the demuxer is opened, but that
+    // can't be done on this thread (it polls for user input).
+    if (stream_wants_cache(p->cache_size, p->stream) ||
+        p->file_format == DEMUXER_TYPE_PLAYLIST)
+        return NULL;
+    p->demuxer = demux_open(opts, p->stream, p->file_format, p->audio_id,
+                            p->video_id, p->sub_id, p->filename);
+    return NULL;
+}
+
+// Whether the entry gets any file-local options when it's played.
+static bool has_file_local_config(struct MPContext *mpctx,
+                                  struct playlist_entry *e)
+{
+    return e->num_params ||
+           load_per_protocol_config(mpctx->mconfig, e->filename, false) ||
+           load_per_extension_config(mpctx->mconfig, e->filename, false) ||
+           load_per_file_config(mpctx->mconfig, e->filename, false);
+}
+
+static void start_playlist_prefetch(struct MPContext *mpctx)
+{
+    struct MPOpts *opts = &mpctx->opts;
+    if (!opts->prefetch_playlist || mpctx->playlist_prefetch)
+        return;
+    // With --loop, the current file is played again by seeking back, and the
+    // next entry is only opened once the loop count runs out (loop_times is
+    // -1 during the last repetition), or if the file can't be seeked.
+    if (opts->loop_times >= 0 && mpctx->demuxer->seekable)
+        return;
+    struct playlist_entry *next = playlist_get_next(mpctx->playlist, +1);
+    // Network streams might call back into the input code while connecting.
+    if (!next || strstr(next->filename, "://") || !strcmp(next->filename, "-"))
+        return;
+    double len = get_time_length(mpctx);
+    if (len <= 0 || len - get_current_time(mpctx) > PLAYLIST_PREFETCH_SECS)
+        return;
+
+    struct playlist_prefetch *p = talloc_zero(NULL, struct playlist_prefetch);
+    *p = (struct playlist_prefetch) {
+        .opts = opts,
+        .audio_id = opts->audio_id,
+        .video_id = opts->video_id,
+        .sub_id = opts->sub_id,
+        .cache_size = opts->stream_cache_size,
+        .entry = next,
+        .filename = talloc_strdup(p, next->filename),
+        .file_format = DEMUXER_TYPE_UNKNOWN,
+    };
+    mpctx->playlist_prefetch = p;
+    // The thread uses the current file's options. Don't start it if they're
+    // different from what the next file will be opened with (per-file
+    // options, config files and profiles). p stays set without a stream, so
+    // that this isn't checked again.
+    if (has_file_local_config(mpctx, mpctx->playlist->current) ||
+        has_file_local_config(mpctx, next))
+    {
+        mp_msg(MSGT_CPLAYER, MSGL_V, "Not prefetching %s (file-local "
+               "options).\n", p->filename);
+        return;
+    }
+    mp_msg(MSGT_CPLAYER, MSGL_V, "Prefetching %s.\n", p->filename);
+    if (pthread_create(&p->thread, NULL, playlist_prefetch_thread, p)) {
+        mp_msg(MSGT_CPLAYER, MSGL_ERR, "Starting prefetch thread failed.\n");
+        return;
+    }
+    p->thread_running = true;
+}
+
+// Wait until the prefetch thread is done. Must be called before the file
+// local options are restored, since the thread reads options.
+static void wait_playlist_prefetch(struct MPContext *mpctx)
+{
+    struct playlist_prefetch *p = mpctx->playlist_prefetch;
+    if (p && p->thread_running) {
+        pthread_join(p->thread, NULL);
+        p->thread_running = false;
+    }
+}
+
+static void discard_playlist_prefetch(struct MPContext *mpctx)
+{
+    struct playlist_prefetch *p = mpctx->playlist_prefetch;
+    if (!p)
+        return;
+    wait_playlist_prefetch(mpctx);
+    if (p->demuxer)
+        free_demuxer(p->demuxer);
+    if (p->stream)
+        free_stream(p->stream);
+    talloc_free(p);
+    mpctx->playlist_prefetch = NULL;
+}
+
+// If the current entry was prefetched, set mpctx->stream and
+// mpctx->file_format, and return the demuxer (which can be NULL if only the
+// stream was opened). Otherwise discard the prefetched entry.
+static bool use_playlist_prefetch(struct MPContext *mpctx,
+                                  struct demuxer **demuxer)
+{
+    struct playlist_prefetch *p = mpctx->playlist_prefetch;
+    *demuxer = NULL;
+    if (!p)
+        return false;
+    wait_playlist_prefetch(mpctx);
+    struct MPOpts *opts = &mpctx->opts;
+    if (p->entry != mpctx->playlist->current ||
+        strcmp(p->filename, mpctx->filename) != 0 || !p->stream ||
+        (p->demuxer && stream_wants_cache(opts->stream_cache_size, p->stream)))
+    {
+        discard_playlist_prefetch(mpctx);
+        return false;
+    }
+    mp_msg(MSGT_CPLAYER, MSGL_V, "Using prefetched %s.\n", p->filename);
+    mpctx->stream = p->stream;
+    mpctx->file_format = p->file_format;
+    *demuxer = p->demuxer;
+    talloc_free(p);
+    mpctx->playlist_prefetch = NULL;
+    return true;
+}
+#else
+static void start_playlist_prefetch(struct MPContext *mpctx)
+{
+}
+
+static void wait_playlist_prefetch(struct MPContext *mpctx)
+{
+}
+
+static void discard_playlist_prefetch(struct MPContext *mpctx)
+{
+}
+
+static bool use_playlist_prefetch(struct MPContext *mpctx,
+                                  struct demuxer **demuxer)
+{
+    *demuxer = NULL;
+    return false;
+}
+#endif
+
 static void run_playloop(struct MPContext *mpctx)
 {
     struct MPOpts *opts = &mpctx->opts;
@@ -3180,8 +3690,12 @@ static void run_playloop(struct MPContext *mpctx)
             endpts = end;
             end_is_chapter = true;
         }
+        if (!mpctx->paused)
+            timeline_prefetch(mpctx, end);
     }
 
+    start_playlist_prefetch(mpctx);
+
     if (opts->chapterrange[1] > 0) {
         int cur_chapter = get_current_chapter(mpctx);
         if (cur_chapter != -1 && cur_chapter + 1 > opts->chapterrange[1])
@@ -3482,9 +3996,13 @@ static void run_playloop(struct MPContext *mpctx)
          * If the user seeks continuously (keeps arrow key down)
          * try to finish showing a frame from one location before doing
          * another seek (which could lead to unchanging display). */
+        unsigned int hold_seek = 300;
+        // With --keyframe-scrub, a new seek cancels a slow seek in progress.
+        if (opts->keyframe_scrub)
+            hold_seek = mpctx->scrub_seek.type ? SCRUB_HOLD_MS : 0;
         if (mpctx->seek.type && cmd->id != MP_CMD_SEEK
             || mpctx->restart_playback && cmd->id == MP_CMD_SEEK
-            && GetTimerMS() - mpctx->start_timestamp < 300)
+            && GetTimerMS() - mpctx->start_timestamp < hold_seek)
             break;
         cmd = mp_input_get_cmd(mpctx->input, 0, 0);
         run_command(mpctx, cmd);
@@ -3537,10 +4055,10 @@ static void run_playloop(struct MPContext *mpctx)
         }
     }
 
-    if (mpctx->seek.type) {
-        seek(mpctx, mpctx->seek, false);
-        mpctx->seek = (struct seek_params){ 0 };
-    }
+    if (mpctx->seek.type)
+        execute_queued_seek(mpctx);
+    else
+        finish_scrubbing(mpctx);
 }
 
 
@@ -3830,6 +4348,126 @@ static void idle_loop(struct MPContext *mpctx)
     }
 }
 
+// --demux-benchmark: read all packets of the selected demuxer streams without
+// decoding them, and print throughput statistics.
+static void run_demux_benchmark(struct MPContext *mpctx)
+{
+    struct demuxer *demuxers[STREAM_TYPE_COUNT];
+    struct demux_stream *streams[STREAM_TYPE_COUNT];
+    uint64_t packets[STREAM_TYPE_COUNT] = {0};
+    uint64_t bytes[STREAM_TYPE_COUNT] = {0};
+    uint64_t read_calls = 0, read_bytes = 0, read_time = 0;
+    bool mapped = false;
+    int num_demuxers = 0, num_streams = 0;
+
+    for (int type = 0; type < STREAM_TYPE_COUNT; type++) {
+        struct track *track = mpctx->current_track[type];
+        streams[type] = NULL;
+        if (!track || !track->stream)
+            continue;
+        struct demuxer *demuxer = track->stream->demuxer;
+        streams[type] = demuxer->ds[type];
+        num_streams++;
+        bool found = false;
+        for (int n = 0; n < num_demuxers; n++)
+            found |= demuxers[n] == demuxer;
+        if (!found)
+            demuxers[num_demuxers++] = demuxer;
+    }
+    if (!num_streams) {
+        mp_tmsg(MSGT_CPLAYER, MSGL_ERR, "No streams selected.\n");
+        return;
+    }
+
+    // Don't count what was read while opening the file.
+    for (int n = 0; n < num_demuxers; n++) {
+        struct stream *s = demuxers[n]->stream;
+        read_calls -= s->read_calls;
+        read_bytes -= s->read_bytes;
+        read_time -= s->read_time;
+        mapped |= s->mapped_data && !s->cache_data;
+    }
+    struct demux_pool_stats pool_start, pool_end;
+    demux_get_pool_stats(&pool_start);
+    unsigned int start_time = GetTimerMS();
+
+    bool reading = true;
+    for (int round = 0; reading && !mpctx->stop_play; round++) {
+        reading = false;
+        for (int type = 0; type < STREAM_TYPE_COUNT; type++) {
+            struct demux_stream *ds = streams[type];
+            if (!ds)
+                continue;
+            // Also drain what was queued while reading for other streams.
+            do {
+                if (!ds_fill_buffer(ds))
+                    break;
+                packets[type]++;
+                bytes[type] += ds->current->len;
+                reading = true;
+            } while (ds->packs);
+        }
+        // Allow quitting, but don't let input handling affect the result.
+        if (round % 256 == 0) {
+            mp_cmd_t *cmd = mp_input_get_cmd(mpctx->input, 0, false);
+            if (cmd) {
+                if (cmd->id == MP_CMD_QUIT || cmd->id == MP_CMD_STOP ||
+                    cmd->id == MP_CMD_PLAYLIST_NEXT)
+                    run_command(mpctx, cmd);
+                mp_cmd_free(cmd);
+            }
+        }
+    }
+
+    double secs = FFMAX((GetTimerMS() - start_time) / 1000.0, 0.001);
+    demux_get_pool_stats(&pool_end);
+    for (int n = 0; n < num_demuxers; n++) {
+        struct stream *s = demuxers[n]->stream;
+        read_calls += s->read_calls;
+        read_bytes += s->read_bytes;
+        read_time += s->read_time;
+    }
+
+    static const char *const names[] = {
+        [STREAM_VIDEO] = "video", [STREAM_AUDIO] = "audio", [STREAM_SUB] = "sub",
+    };
+    uint64_t total_packets = 0, total_bytes = 0;
+    mp_msg(MSGT_CPLAYER, MSGL_INFO, "\nDemuxer benchmark:\n");
+    for (int type = 0; type < STREAM_TYPE_COUNT; type++) {
+        if (!streams[type])
+            continue;
+        mp_msg(MSGT_CPLAYER, MSGL_INFO, "  %-5s: %"PRIu64" packets, %"PRIu64
+               " bytes (%.1f packets/s, %.1f KiB/s, demuxer %s)\n",
+               names[type], packets[type], bytes[type], packets[type] / secs,
+               bytes[type] / 1024.0 / secs,
+               streams[type]->demuxer->desc->name);
+        total_packets += packets[type];
+        total_bytes += bytes[type];
+    }
+    mp_msg(MSGT_CPLAYER, MSGL_INFO, "  total: %"PRIu64" packets, %"PRIu64
+           " bytes in %.3f s (%.1f packets/s, %.1f KiB/s)\n", total_packets,
+           total_bytes, secs, total_packets / secs, total_bytes / 1024.0 / secs);
+    mp_msg(MSGT_CPLAYER, MSGL_INFO, "  alloc: %"PRIu64" packets (%"PRIu64
+           " malloc), %"PRIu64" buffers (%"PRIu64" malloc)\n",
+           pool_end.packets - pool_start.packets,
+           pool_end.packet_mallocs - pool_start.packet_mallocs,
+           pool_end.buffers - pool_start.buffers,
+           pool_end.buffer_mallocs - pool_start.buffer_mallocs);
+    double stream_secs = FFMIN(read_time / 1e6, secs);
+    if (mapped) {
+        // The I/O happens in page faults while the demuxer accesses the data.
+        mp_msg(MSGT_CPLAYER, MSGL_INFO, "  stream: %"PRIu64" reads, %"PRIu64
+               " bytes, memory mapped (I/O time is included in the demuxer "
+               "time, use --no-file-mmap to measure it)\n", read_calls,
+               read_bytes);
+    } else {
+        mp_msg(MSGT_CPLAYER, MSGL_INFO, "  stream: %"PRIu64" reads, %"PRIu64
+               " bytes, %.3f s (%.1f%%); demuxer: %.3f s (%.1f%%)\n",
+               read_calls, read_bytes, stream_secs, stream_secs / secs * 100,
+               secs - stream_secs, (secs - stream_secs) / secs * 100);
+    }
+}
+
 // Start playing the current playlist entry.
 // Handle initialization and deinitialization.
 static void play_current_file(struct MPContext *mpctx)
@@ -3854,9 +4492,9 @@ static void play_current_file(struct MPContext *mpctx)
 
     m_config_enter_file_local(mpctx->mconfig);
 
-    load_per_protocol_config(mpctx->mconfig, mpctx->filename);
-    load_per_extension_config(mpctx->mconfig, mpctx->filename);
-    load_per_file_config(mpctx->mconfig, mpctx->filename);
+    load_per_protocol_config(mpctx->mconfig, mpctx->filename, true);
+    load_per_extension_config(mpctx->mconfig, mpctx->filename, true);
+    load_per_file_config(mpctx->mconfig, mpctx->filename, true);
 
     if (opts->video_driver_list)
         load_per_output_config(mpctx->mconfig, PROFILE_CFG_VO,
@@ -3908,11 +4546,16 @@ static void play_current_file(struct MPContext *mpctx)
     assert(mpctx->sh_video == NULL);
     assert(mpctx->sh_sub == NULL);
 
-    char *stream_filename = mpctx->filename;
-    mpctx->resolve_result = resolve_url(stream_filename, opts);
-    if (mpctx->resolve_result)
-        stream_filename = mpctx->resolve_result->url;
-    mpctx->stream = open_stream(stream_filename, opts, &mpctx->file_format);
+    struct demuxer *prefetched_demuxer;
+    bool prefetched = use_playlist_prefetch(mpctx, &prefetched_demuxer);
+    if (!prefetched) {
+        char *stream_filename = mpctx->filename;
+        mpctx->resolve_result = resolve_url(stream_filename, opts);
+        if (mpctx->resolve_result)
+            stream_filename = mpctx->resolve_result->url;
+        mpctx->stream = open_stream(stream_filename, opts,
+                                    &mpctx->file_format);
+    }
     if (!mpctx->stream) { // error...
         demux_was_interrupted(mpctx);
         goto terminate_playback;
@@ -3941,7 +4584,8 @@ static void play_current_file(struct MPContext *mpctx)
         goto terminate_playback;
 #endif
     }
-    mpctx->stream->start_pos += seek_to_byte;
+    if (!prefetched)
+        mpctx->stream->start_pos += seek_to_byte;
 
     // CACHE2: initial prefill: 20%  later: 5%  (should be set by -cacheopts)
 #ifdef CONFIG_DVBIN
@@ -3957,9 +4601,12 @@ goto_enable_cache: ;
 
     //============ Open DEMUXERS --- DETECT file type =======================
 
-    mpctx->demuxer = demux_open(opts, mpctx->stream, mpctx->file_format,
-                                opts->audio_id, opts->video_id, opts->sub_id,
-                                mpctx->filename);
+    mpctx->demuxer = prefetched_demuxer;
+    if (!mpctx->demuxer) {
+        mpctx->demuxer = demux_open(opts, mpctx->stream, mpctx->file_format,
+                                    opts->audio_id, opts->video_id,
+                                    opts->sub_id, mpctx->filename);
+    }
     mpctx->master_demuxer = mpctx->demuxer;
 
     if (!mpctx->demuxer) {
@@ -3992,6 +4639,7 @@ goto_enable_cache: ;
     add_demuxer_tracks(mpctx, mpctx->demuxer);
 
     mpctx->timeline_part = 0;
+    mpctx->timeline_prefetch_part = -1;
     if (mpctx->timeline)
         timeline_set_part(mpctx, mpctx->timeline_part, true);
 
@@ -4019,6 +4667,13 @@ goto_enable_cache: ;
 
     preselect_demux_streams(mpctx);
 
+    if (opts->demux_benchmark) {
+        run_demux_benchmark(mpctx);
+        if (!mpctx->stop_play)
+            mpctx->stop_play = AT_END_OF_FILE;
+        goto terminate_playback;
+    }
+
 #ifdef CONFIG_ENCODING
     if (mpctx->encode_lavc_ctx && mpctx->current_track[STREAM_VIDEO])
         encode_lavc_expect_stream(mpctx->encode_lavc_ctx, AVMEDIA_TYPE_VIDEO);
@@ -4140,6 +4795,7 @@ goto_enable_cache: ;
     }
 
     mpctx->seek = (struct seek_params){ 0 };
+    mpctx->scrub_seek = (struct seek_params){ 0 };
     get_relative_time(mpctx); // reset current delta
     // Make sure VO knows current pause state
     if (mpctx->sh_video)
@@ -4168,6 +4824,8 @@ terminate_playback:  // don't jump here after ao/vo/getch initialization!
 
     mp_msg(MSGT_CPLAYER, MSGL_INFO, "\n");
 
+    wait_playlist_prefetch(mpctx);
+
     // xxx handle this as INITIALIZED_CONFIG?
     m_config_leave_file_local(mpctx->mconfig);
 
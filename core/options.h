@@ -15,6 +15,7 @@ typedef struct MPOpts {
     int mixer_init_mute;
     float softvol_max;
     int gapless_audio;
+    int prefetch_playlist;
     int ao_buffersize;
     int screen_size_x;
     int screen_size_y;
@@ -48,6 +49,8 @@ typedef struct MPOpts {
     int untimed;
     int loop_times;
     int ordered_chapters;
+    int ordered_chapters_index;
+    float timeline_prefetch;
     int chapter_merge_threshold;
     int quiet;
     int noconfig;
@@ -56,6 +59,11 @@ typedef struct MPOpts {
     float stream_cache_min_percent;
     float stream_cache_seek_min_percent;
     int stream_cache_pause;
+    int stream_cache_connections;
+    int udp_jitter_buffer;
+    char *stream_cache_file;
+    int stream_cache_file_size;
+    int file_mmap;
     int chapterrange[2];
     int edition_id;
     int correct_pts;
@@ -63,10 +71,12 @@ typedef struct MPOpts {
     int user_pts_assoc_mode;
     int initial_audio_sync;
     int hr_seek;
+    int keyframe_scrub;
     float hr_seek_demuxer_offset;
     int autosync;
     int softsleep;
     int frame_dropping;
+    int video_degrade;
     int term_osd;
     char *term_osd_esc;
     char *playing_msg;
@@ -96,6 +106,13 @@ typedef struct MPOpts {
     char *audio_demuxer_name;
     char *sub_demuxer_name;
     int extension_parsing;
+    int demuxer_thread;
+    int demux_benchmark;
+    float demuxer_readahead_secs;
+    int demuxer_max_bytes;
+    int mkv_index_cache;
+    int mkv_index_scan;
+    int probe_cache;
 
     struct image_writer_opts *screenshot_image_opts;
     char *screenshot_template;
@@ -110,6 +127,8 @@ typedef struct MPOpts {
     int flip;
     int vd_use_slices;
     int vd_use_dr1;
+    int video_decode_ahead;
+    int video_decode_ahead_bytes;
     char **sub_name;
     char **sub_paths;
     int sub_auto;
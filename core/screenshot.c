@@ -237,7 +237,7 @@ static char *gen_fname(screenshot_ctx *ctx, const char *file_ext)
 static struct mp_image *add_subs(struct MPContext *mpctx,
                                  struct mp_image *image)
 {
-    if (!(image->flags & MP_IMGFLAG_ALLOCATED)) {
+    if (!mp_image_is_writeable(image)) {
         struct mp_image *new_image = alloc_mpi(image->w, image->h,
                                                image->imgfmt);
         copy_mpi(new_image, image);
@@ -26,7 +26,14 @@
 #include <unistd.h>
 #include <libavutil/common.h>
 
+#include "config.h"
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #include "osdep/io.h"
+#include "osdep/numcores.h"
 
 #include "talloc.h"
 
@@ -158,13 +165,256 @@ static int enable_cache(struct MPContext *mpctx, struct stream **stream,
     return 1;
 }
 
+/* Index of the segment UIDs found in previous scans, so that opening a file
+ * again doesn't need to scan its directory. Stored as lines of the form
+ * "<UID as 32 hex digits> <absolute path>" in ~/.mpv/segment-index. Entries
+ * are only hints: a file found this way is still opened with the wanted UIDs,
+ * and the directory is scanned as usual if that fails.
+ */
+#define SEGMENT_INDEX_FILE "segment-index"
+#define MAX_SEGMENT_INDEX_ENTRIES 10000
+
+struct segment_index_entry {
+    unsigned char uid[16];
+    char *path;
+};
+
+struct segment_index {
+    struct segment_index_entry *entries;
+    int num_entries;
+    bool modified;
+};
+
+static struct segment_index *load_segment_index(void)
+{
+    struct segment_index *index = talloc_zero(NULL, struct segment_index);
+    char *file = mp_find_user_config_file(SEGMENT_INDEX_FILE);
+    FILE *f = file ? fopen(file, "r") : NULL;
+    talloc_free(file);
+    if (!f)
+        return index;
+    char line[4096 + 40];
+    while (fgets(line, sizeof(line), f)) {
+        struct bstr rest = bstr_strip_linebreaks(bstr0(line));
+        struct bstr hex = bstr_split(rest, " ", &rest);
+        struct segment_index_entry e;
+        if (hex.len != 32 || !bstr_eatstart0(&rest, " ") || !rest.len)
+            continue;
+        for (int i = 0; i < 16; i++) {
+            char c[3] = {hex.start[i * 2], hex.start[i * 2 + 1], 0};
+            e.uid[i] = strtol(c, NULL, 16);
+        }
+        e.path = bstrdup0(index, rest);
+        MP_TARRAY_APPEND(index, index->entries, index->num_entries, e);
+    }
+    fclose(f);
+    return index;
+}
+
+static void save_segment_index(struct segment_index *index)
+{
+    if (!index->modified)
+        return;
+    char *file = mp_find_user_config_file(SEGMENT_INDEX_FILE);
+    if (!file)
+        return;
+    char *tmp = talloc_asprintf(NULL, "%s.tmp", file);
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        goto out;
+    int start = FFMAX(index->num_entries - MAX_SEGMENT_INDEX_ENTRIES, 0);
+    for (int n = start; n < index->num_entries; n++) {
+        struct segment_index_entry *e = &index->entries[n];
+        for (int i = 0; i < 16; i++)
+            fprintf(f, "%02x", e->uid[i]);
+        fprintf(f, " %s\n", e->path);
+    }
+    bool ok = !ferror(f);
+    if (fclose(f) != 0)
+        ok = false;
+    if (!ok || rename(tmp, file) != 0) {
+        mp_msg(MSGT_CPLAYER, MSGL_WARN, "Can't write segment index %s.\n",
+               file);
+        unlink(tmp);
+    }
+ out:
+    talloc_free(tmp);
+    talloc_free(file);
+}
+
+static char *segment_index_lookup(struct segment_index *index,
+                                  unsigned char uid[16])
+{
+    // Search backwards: newer entries are appended at the end.
+    for (int n = index->num_entries - 1; n >= 0; n--) {
+        if (!memcmp(index->entries[n].uid, uid, 16))
+            return index->entries[n].path;
+    }
+    return NULL;
+}
+
+static void segment_index_add(struct segment_index *index,
+                              unsigned char uid[16], const char *filename)
+{
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd)))
+        return;
+    char *path = mp_path_join(index, bstr0(cwd), bstr0(filename));
+    char *old = segment_index_lookup(index, uid);
+    if (old && !strcmp(old, path)) {
+        talloc_free(path);
+        return;
+    }
+    // Drop the outdated entries for this UID.
+    int num = 0;
+    for (int n = 0; n < index->num_entries; n++) {
+        if (memcmp(index->entries[n].uid, uid, 16))
+            index->entries[num++] = index->entries[n];
+    }
+    index->num_entries = num;
+    struct segment_index_entry e = {.path = path};
+    memcpy(e.uid, uid, 16);
+    MP_TARRAY_APPEND(index, index->entries, index->num_entries, e);
+    index->modified = true;
+}
+
+// Maximum number of files opened in parallel when scanning for sources.
+#define MAX_SCAN_THREADS 8
+
+struct source_scan {
+#ifdef HAVE_PTHREADS
+    pthread_mutex_t lock;
+#endif
+    struct MPContext *mpctx;
+    char **filenames;
+    int num_filenames;
+    int next;                   // next entry in filenames to check
+    struct demuxer **sources;
+    int *source_file;           // index into filenames of sources[i], or -1
+    int num_sources;
+    int num_left;
+    unsigned char (*uid_map)[16];
+};
+
+static void scan_lock(struct source_scan *scan)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&scan->lock);
+#endif
+}
+
+static void scan_unlock(struct source_scan *scan)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&scan->lock);
+#endif
+}
+
+static void *source_scan_thread(void *arg)
+{
+    struct source_scan *scan = arg;
+    while (1) {
+        scan_lock(scan);
+        int n = scan->next++;
+        bool done = n >= scan->num_filenames || !scan->num_left;
+        scan_unlock(scan);
+        if (done)
+            break;
+        char *filename = scan->filenames[n];
+        mp_msg(MSGT_CPLAYER, MSGL_INFO, "Checking file %s\n", filename);
+        int format = 0;
+        struct stream *s = open_stream(filename, &scan->mpctx->opts, &format);
+        if (!s)
+            continue;
+        struct demuxer *d = open_demuxer(s, scan->mpctx, filename,
+                                         scan->uid_map);
+        if (!d) {
+            free_stream(s);
+            continue;
+        }
+        if (d->file_format == DEMUXER_TYPE_MATROSKA) {
+            scan_lock(scan);
+            for (int i = 1; i < scan->num_sources; i++) {
+                if (memcmp(scan->uid_map[i], d->matroska_data.segment_uid, 16))
+                    continue;
+                // Several files with the same UID: prefer the one that the
+                // serial scan in filename order would have found.
+                if (scan->sources[i] && scan->source_file[i] < n)
+                    continue;
+                struct demuxer *old = scan->sources[i];
+                scan->sources[i] = d;
+                scan->source_file[i] = n;
+                if (!old)
+                    scan->num_left--;
+                d = old;
+                break;
+            }
+            scan_unlock(scan);
+        }
+        if (d) {
+            s = d->stream;
+            free_demuxer(d);
+            free_stream(s);
+        }
+    }
+    return NULL;
+}
+
+// Open the given files in parallel, and put the ones matching the missing
+// entries of uid_map into sources. Returns the number of sources found.
+static int scan_sources(struct MPContext *mpctx, struct demuxer **sources,
+                        int num_sources, unsigned char uid_map[][16],
+                        char **filenames, int num_filenames, int num_left)
+{
+    struct source_scan scan = {
+        .mpctx = mpctx,
+        .filenames = filenames,
+        .num_filenames = num_filenames,
+        .sources = sources,
+        .source_file = talloc_array(NULL, int, num_sources),
+        .num_sources = num_sources,
+        .num_left = num_left,
+        .uid_map = uid_map,
+    };
+    // Sources found before the scan (e.g. through the segment index) are
+    // never replaced.
+    for (int i = 0; i < num_sources; i++)
+        scan.source_file[i] = -1;
+    int started = 0;
+#ifdef HAVE_PTHREADS
+    pthread_mutex_init(&scan.lock, NULL);
+    int num_threads = FFMIN(FFMAX(default_thread_count(), 1),
+                            FFMIN(num_filenames, MAX_SCAN_THREADS));
+    pthread_t threads[MAX_SCAN_THREADS];
+    for (int n = 0; n < num_threads; n++) {
+        if (pthread_create(&threads[started], NULL, source_scan_thread, &scan))
+            break;
+        started++;
+    }
+#endif
+    // If no thread could be created, scan on this thread.
+    if (!started)
+        source_scan_thread(&scan);
+#ifdef HAVE_PTHREADS
+    for (int n = 0; n < started; n++)
+        pthread_join(threads[n], NULL);
+    pthread_mutex_destroy(&scan.lock);
+#endif
+    talloc_free(scan.source_file);
+    return num_left - scan.num_left;
+}
+
 static int find_ordered_chapter_sources(struct MPContext *mpctx,
                                         struct demuxer **sources,
                                         int num_sources,
                                         unsigned char uid_map[][16])
 {
+    struct MPOpts *opts = &mpctx->opts;
     int num_filenames = 0;
     char **filenames = NULL;
+    struct segment_index *index = NULL;
+    int num_left = num_sources - 1;
+    bool search = false;
     if (num_sources > 1) {
         mp_msg(MSGT_CPLAYER, MSGL_INFO, "This file references data from "
                "other sources.\n");
@@ -172,50 +422,67 @@ static int find_ordered_chapter_sources(struct MPContext *mpctx,
             mp_msg(MSGT_CPLAYER, MSGL_WARN, "Playback source is not a "
                    "normal disk file. Will not search for related files.\n");
         } else {
-            mp_msg(MSGT_CPLAYER, MSGL_INFO, "Will scan other files in the "
-                   "same directory to find referenced sources.\n");
-            filenames = find_files(mpctx->demuxer->filename, ".mkv");
-            num_filenames = MP_TALLOC_ELEMS(filenames);
+            search = true;
+            if (opts->ordered_chapters_index)
+                index = load_segment_index();
         }
     }
 
-    int num_left = num_sources - 1;
-    for (int i = 0; i < num_filenames && num_left > 0; i++) {
-        mp_msg(MSGT_CPLAYER, MSGL_INFO, "Checking file %s\n", filenames[i]);
+    // Sources found with the index don't need a directory scan.
+    bool *found = talloc_zero_array(NULL, bool, num_sources);
+    for (int i = 1; i < num_sources && index; i++) {
+        char *filename = segment_index_lookup(index, uid_map[i]);
+        if (!filename)
+            continue;
         int format = 0;
-        struct stream *s = open_stream(filenames[i], &mpctx->opts, &format);
+        struct stream *s = open_stream(filename, opts, &format);
         if (!s)
             continue;
-        struct demuxer *d = open_demuxer(s, mpctx, filenames[i], uid_map);
-
+        struct demuxer *d = open_demuxer(s, mpctx, filename, uid_map);
         if (!d) {
             free_stream(s);
             continue;
         }
-        if (d->file_format == DEMUXER_TYPE_MATROSKA) {
-            for (int i = 1; i < num_sources; i++) {
-                if (sources[i])
-                    continue;
-                if (!memcmp(uid_map[i], d->matroska_data.segment_uid, 16)) {
-                    mp_msg(MSGT_CPLAYER, MSGL_INFO,"Match for source %d: %s\n",
-                           i, d->filename);
+        if (d->file_format != DEMUXER_TYPE_MATROSKA ||
+            memcmp(uid_map[i], d->matroska_data.segment_uid, 16))
+        {
+            free_demuxer(d);
+            free_stream(s);
+            continue;
+        }
+        sources[i] = d;
+        found[i] = true;
+        num_left--;
+    }
 
-                    if (enable_cache(mpctx, &s, &d, uid_map) < 0)
-                        continue;
+    if (search && num_left > 0) {
+        mp_msg(MSGT_CPLAYER, MSGL_INFO, "Will scan other files in the "
+               "same directory to find referenced sources.\n");
+        filenames = find_files(mpctx->demuxer->filename, ".mkv");
+        num_filenames = MP_TALLOC_ELEMS(filenames);
+        num_left -= scan_sources(mpctx, sources, num_sources, uid_map,
+                                 filenames, num_filenames, num_left);
+    }
 
-                    sources[i] = d;
-                    num_left--;
-                    goto match;
-                }
-            }
+    for (int i = 1; i < num_sources; i++) {
+        if (!sources[i])
+            continue;
+        mp_msg(MSGT_CPLAYER, MSGL_INFO, "Match for source %d: %s\n",
+               i, sources[i]->filename);
+        if (index && !found[i])
+            segment_index_add(index, uid_map[i], sources[i]->filename);
+        struct stream *s = sources[i]->stream;
+        if (enable_cache(mpctx, &s, &sources[i], uid_map) < 0) {
+            sources[i] = NULL;
+            num_left++;
         }
-        free_demuxer(d);
-        free_stream(s);
-        continue;
-    match:
-        ;
     }
+    talloc_free(found);
     talloc_free(filenames);
+    if (index)
+        save_segment_index(index);
+    talloc_free(index);
+
     if (num_left) {
         mp_msg(MSGT_CPLAYER, MSGL_ERR, "Failed to find ordered chapter part!\n"
                "There will be parts MISSING from the video!\n");
@@ -20,6 +20,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
@@ -28,6 +30,11 @@
 #include <sys/stat.h>
 
 #include "config.h"
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #include "core/options.h"
 #include "talloc.h"
 #include "core/mp_msg.h"
@@ -36,9 +43,11 @@
 #include "demux.h"
 #include "stheader.h"
 #include "mf.h"
+#include "probe_cache.h"
 
 #include "audio/format.h"
 
+#include "libavutil/common.h"
 #include "libavcodec/avcodec.h"
 #if MP_INPUT_BUFFER_PADDING_SIZE < FF_INPUT_BUFFER_PADDING_SIZE
 #error MP_INPUT_BUFFER_PADDING_SIZE is too small!
@@ -100,6 +109,153 @@ const demuxer_desc_t *const demuxer_list[] = {
     NULL
 };
 
+// Packets and their buffers are recycled through free lists, because
+// malloc()/free() for every packet is measurable at high packet rates. Buffers
+// (including the padding) are rounded up to power-of-2 size classes. Larger
+// buffers are not pooled. The pool is shared by all demuxers, and packets can
+// be freed from any thread.
+#define POOL_MIN_SHIFT 8            // smallest size class: 256 bytes
+#define POOL_CLASSES 13             // largest size class: 1 MiB
+#define POOL_MAX_BYTES (16 * 1024 * 1024) // max. unused buffer memory
+#define POOL_MAX_PACKETS 1024       // max. unused packet structs
+
+struct pool_buffer {
+    struct pool_buffer *next;
+};
+
+static struct packet_pool {
+#ifdef HAVE_PTHREADS
+    pthread_mutex_t lock;
+#endif
+    struct demux_packet *packets; // unused packet structs, linked with next
+    int num_packets;
+    struct pool_buffer *buffers[POOL_CLASSES]; // unused buffers per class
+    int64_t bytes;                // total size of the unused buffers
+    uint64_t hits, misses;        // buffer allocations from the pool or not
+    uint64_t packet_hits, packet_misses; // same for packet structs
+} pool = {
+#ifdef HAVE_PTHREADS
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+static void pool_lock(void)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&pool.lock);
+#endif
+}
+
+static void pool_unlock(void)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&pool.lock);
+#endif
+}
+
+// Return the smallest size class for size bytes, or -1 if it's too large.
+static int pool_size_class(size_t size)
+{
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        if (size <= ((size_t)1 << (POOL_MIN_SHIFT + c)))
+            return c;
+    }
+    return -1;
+}
+
+// Allocate a buffer with at least len + MP_INPUT_BUFFER_PADDING_SIZE bytes,
+// and zero the padding.
+static unsigned char *pool_alloc_buffer(size_t len, int *buffer_class)
+{
+    size_t size = len + MP_INPUT_BUFFER_PADDING_SIZE;
+    int c = pool_size_class(size);
+    unsigned char *buf = NULL;
+    pool_lock();
+    if (c >= 0 && pool.buffers[c]) {
+        struct pool_buffer *b = pool.buffers[c];
+        pool.buffers[c] = b->next;
+        pool.bytes -= (size_t)1 << (POOL_MIN_SHIFT + c);
+        buf = (unsigned char *)b;
+        pool.hits++;
+    } else {
+        pool.misses++;
+    }
+    pool_unlock();
+    if (!buf) {
+        buf = malloc(c >= 0 ? (size_t)1 << (POOL_MIN_SHIFT + c) : size);
+        if (!buf) {
+            mp_msg(MSGT_DEMUXER, MSGL_FATAL, "Memory allocation failure!\n");
+            abort();
+        }
+    }
+    memset(buf + len, 0, MP_INPUT_BUFFER_PADDING_SIZE);
+    *buffer_class = c;
+    return buf;
+}
+
+static void pool_free_buffer(unsigned char *buf, int buffer_class)
+{
+    if (buffer_class >= 0) {
+        size_t size = (size_t)1 << (POOL_MIN_SHIFT + buffer_class);
+        pool_lock();
+        if (pool.bytes + size <= POOL_MAX_BYTES) {
+            struct pool_buffer *b = (struct pool_buffer *)buf;
+            b->next = pool.buffers[buffer_class];
+            pool.buffers[buffer_class] = b;
+            pool.bytes += size;
+            buf = NULL;
+        }
+        pool_unlock();
+    }
+    free(buf);
+}
+
+static struct demux_packet *pool_alloc_packet(void)
+{
+    pool_lock();
+    struct demux_packet *dp = pool.packets;
+    if (dp) {
+        pool.packets = dp->next;
+        pool.num_packets--;
+        pool.packet_hits++;
+    } else {
+        pool.packet_misses++;
+    }
+    pool_unlock();
+    if (!dp)
+        dp = malloc(sizeof(struct demux_packet));
+    if (!dp) {
+        mp_msg(MSGT_DEMUXER, MSGL_FATAL, "Memory allocation failure!\n");
+        abort();
+    }
+    return dp;
+}
+
+static void pool_free_packet(struct demux_packet *dp)
+{
+    pool_lock();
+    if (pool.num_packets < POOL_MAX_PACKETS) {
+        dp->next = pool.packets;
+        pool.packets = dp;
+        pool.num_packets++;
+        dp = NULL;
+    }
+    pool_unlock();
+    free(dp);
+}
+
+void demux_get_pool_stats(struct demux_pool_stats *st)
+{
+    pool_lock();
+    *st = (struct demux_pool_stats){
+        .packets = pool.packet_hits + pool.packet_misses,
+        .packet_mallocs = pool.packet_misses,
+        .buffers = pool.hits + pool.misses,
+        .buffer_mallocs = pool.misses,
+    };
+    pool_unlock();
+}
+
 static struct demux_packet *create_packet(size_t len)
 {
     if (len > 1000000000) {
@@ -107,7 +263,7 @@ static struct demux_packet *create_packet(size_t len)
                "over 1 GB!\n");
         abort();
     }
-    struct demux_packet *dp = malloc(sizeof(struct demux_packet));
+    struct demux_packet *dp = pool_alloc_packet();
     dp->len = len;
     dp->next = NULL;
     dp->pts = MP_NOPTS_VALUE;
@@ -118,6 +274,7 @@ static struct demux_packet *create_packet(size_t len)
     dp->refcount = 1;
     dp->master = NULL;
     dp->buffer = NULL;
+    dp->buffer_class = -1;
     dp->avpacket = NULL;
     return dp;
 }
@@ -125,12 +282,7 @@ static struct demux_packet *create_packet(size_t len)
 struct demux_packet *new_demux_packet(size_t len)
 {
     struct demux_packet *dp = create_packet(len);
-    dp->buffer = malloc(len + MP_INPUT_BUFFER_PADDING_SIZE);
-    if (!dp->buffer) {
-        mp_msg(MSGT_DEMUXER, MSGL_FATAL, "Memory allocation failure!\n");
-        abort();
-    }
-    memset(dp->buffer + len, 0, 8);
+    dp->buffer = pool_alloc_buffer(len, &dp->buffer_class);
     return dp;
 }
 
@@ -149,18 +301,25 @@ void resize_demux_packet(struct demux_packet *dp, size_t len)
                "over 1 GB!\n");
         abort();
     }
-    dp->buffer = realloc(dp->buffer, len + MP_INPUT_BUFFER_PADDING_SIZE);
-    if (!dp->buffer) {
-        mp_msg(MSGT_DEMUXER, MSGL_FATAL, "Memory allocation failure!\n");
-        abort();
+    int c = dp->buffer_class;
+    if (c >= 0 && len + MP_INPUT_BUFFER_PADDING_SIZE <=
+                  ((size_t)1 << (POOL_MIN_SHIFT + c))) {
+        memset(dp->buffer + len, 0, MP_INPUT_BUFFER_PADDING_SIZE);
+    } else {
+        int new_class;
+        unsigned char *buf = pool_alloc_buffer(len, &new_class);
+        if (dp->buffer)
+            memcpy(buf, dp->buffer, FFMIN(len, dp->len));
+        pool_free_buffer(dp->buffer, dp->buffer_class);
+        dp->buffer = buf;
+        dp->buffer_class = new_class;
     }
-    memset(dp->buffer + len, 0, 8);
     dp->len = len;
 }
 
 struct demux_packet *clone_demux_packet(struct demux_packet *pack)
 {
-    struct demux_packet *dp = malloc(sizeof(struct demux_packet));
+    struct demux_packet *dp = pool_alloc_packet();
     while (pack->master)
         pack = pack->master;  // find the master
     memcpy(dp, pack, sizeof(struct demux_packet));
@@ -179,14 +338,14 @@ void free_demux_packet(struct demux_packet *dp)
             if (dp->avpacket)
                 talloc_free(dp->avpacket);
             else
-                free(dp->buffer);
-            free(dp);
+                pool_free_buffer(dp->buffer, dp->buffer_class);
+            pool_free_packet(dp);
         }
         return;
     }
     // dp is a clone:
     free_demux_packet(dp->master);
-    free(dp);
+    pool_free_packet(dp);
 }
 
 static void free_demuxer_stream(struct demux_stream *ds)
@@ -429,11 +588,337 @@ static void free_sh_video(sh_video_t *sh)
     talloc_free(sh);
 }
 
+/* With --demuxer-thread, fill_buffer() is called from a separate thread,
+ * which reads ahead into per-stream queues until --demuxer-readahead-secs
+ * of packets are buffered, or --demuxer-max-bytes are used. demux_fill_buffer()
+ * then moves packets from these queues to the demux_stream lists instead of
+ * reading itself. Anything else touching the demuxer (seeking, demux_control()
+ * etc.) pauses the thread with demux_thread_pause() first, so the demuxer
+ * implementations don't need to be thread-safe. Only demuxers whose
+ * fill_buffer() ignores its ds argument can be used this way.
+ */
+#ifdef HAVE_PTHREADS
+struct demux_queue {
+    struct demux_packet *first, *last;
+    int packs;
+    int64_t bytes;
+    double first_pts, last_pts;
+};
+
+struct demux_thread {
+    pthread_t thread;
+    bool thread_running;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    bool quit;
+    bool eof;            // fill_buffer() returned 0 (cleared by the reader)
+    bool filling;        // fill_buffer() is being called right now
+    bool reader_waiting; // demux_fill_buffer() waits for packets
+    int paused;          // nesting count of demux_thread_pause()
+    double max_secs;
+    int64_t max_bytes;
+    int packs;           // total over all queues
+    int64_t bytes;       // total over all queues
+    struct demux_queue queues[STREAM_TYPE_COUNT]; // indexed like demuxer->ds
+};
+
+static void queue_init(struct demux_queue *q)
+{
+    *q = (struct demux_queue){
+        .first_pts = MP_NOPTS_VALUE,
+        .last_pts = MP_NOPTS_VALUE,
+    };
+}
+
+static void queue_free(struct demux_queue *q)
+{
+    struct demux_packet *dp = q->first;
+    while (dp) {
+        struct demux_packet *dn = dp->next;
+        free_demux_packet(dp);
+        dp = dn;
+    }
+    queue_init(q);
+}
+
+static bool demux_thread_full(struct demux_thread *t)
+{
+    if (t->bytes >= t->max_bytes)
+        return true;
+    // A waiting reader is missing packets for a stream the other queues
+    // are ahead of, so only the byte limit applies.
+    if (t->reader_waiting)
+        return false;
+    for (int n = 0; n < STREAM_TYPE_COUNT; n++) {
+        struct demux_queue *q = &t->queues[n];
+        if (n != STREAM_SUB && q->first_pts != MP_NOPTS_VALUE &&
+            q->last_pts - q->first_pts >= t->max_secs)
+            return true;
+    }
+    return false;
+}
+
+static void *demux_thread_loop(void *arg)
+{
+    struct demuxer *demuxer = arg;
+    struct demux_thread *t = demuxer->thread;
+    pthread_mutex_lock(&t->lock);
+    while (!t->quit) {
+        if (t->paused || t->eof || demux_thread_full(t)) {
+            pthread_cond_wait(&t->wakeup, &t->lock);
+            continue;
+        }
+        t->filling = true;
+        pthread_mutex_unlock(&t->lock);
+        int res = demuxer->desc->fill_buffer(demuxer, NULL);
+        pthread_mutex_lock(&t->lock);
+        t->filling = false;
+        if (!res)
+            t->eof = true;
+        pthread_cond_broadcast(&t->wakeup);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+static void demux_thread_init(struct demuxer *demuxer)
+{
+    struct MPOpts *opts = demuxer->opts;
+    if (!opts->demuxer_thread)
+        return;
+    switch (demuxer->desc->type) {
+    case DEMUXER_TYPE_LAVF:
+    case DEMUXER_TYPE_MATROSKA:
+    case DEMUXER_TYPE_MPEG_TS:
+        break;
+    default:
+        mp_msg(MSGT_DEMUXER, MSGL_V, "Demuxer %s can't be run in a thread.\n",
+               demuxer->desc->name);
+        return;
+    }
+    struct demux_thread *t = talloc_zero(demuxer, struct demux_thread);
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->wakeup, NULL);
+    t->max_secs = opts->demuxer_readahead_secs;
+    t->max_bytes = opts->demuxer_max_bytes;
+    for (int n = 0; n < STREAM_TYPE_COUNT; n++)
+        queue_init(&t->queues[n]);
+    demuxer->thread = t;
+}
+
+static void demux_thread_uninit(struct demuxer *demuxer)
+{
+    struct demux_thread *t = demuxer->thread;
+    if (!t)
+        return;
+    if (t->thread_running) {
+        pthread_mutex_lock(&t->lock);
+        t->quit = true;
+        pthread_cond_broadcast(&t->wakeup);
+        pthread_mutex_unlock(&t->lock);
+        pthread_join(t->thread, NULL);
+    }
+    for (int n = 0; n < STREAM_TYPE_COUNT; n++)
+        queue_free(&t->queues[n]);
+    pthread_cond_destroy(&t->wakeup);
+    pthread_mutex_destroy(&t->lock);
+    demuxer->thread = NULL;
+    talloc_free(t);
+}
+
+// The thread is started on the first read, so that packets are only queued
+// for the streams selected by then.
+static bool demux_thread_start(struct demuxer *demuxer)
+{
+    struct demux_thread *t = demuxer->thread;
+    if (!t || t->paused)
+        return false;
+    if (!t->thread_running) {
+        // Hold the lock so that t->thread is set before the thread can
+        // call ds_add_packet().
+        pthread_mutex_lock(&t->lock);
+        if (pthread_create(&t->thread, NULL, demux_thread_loop, demuxer)) {
+            pthread_mutex_unlock(&t->lock);
+            mp_msg(MSGT_DEMUXER, MSGL_ERR, "Starting demuxer thread failed.\n");
+            demux_thread_uninit(demuxer);
+            return false;
+        }
+        t->thread_running = true;
+        pthread_mutex_unlock(&t->lock);
+        mp_msg(MSGT_DEMUXER, MSGL_V, "Demuxer thread started.\n");
+    }
+    return true;
+}
+
+// Wait until the thread is not inside the demuxer, and keep it out until
+// demux_thread_resume() is called. Can be nested.
+static void demux_thread_pause(struct demuxer *demuxer)
+{
+    struct demux_thread *t = demuxer->thread;
+    if (!t)
+        return;
+    pthread_mutex_lock(&t->lock);
+    t->paused++;
+    while (t->filling)
+        pthread_cond_wait(&t->wakeup, &t->lock);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void demux_thread_resume(struct demuxer *demuxer)
+{
+    struct demux_thread *t = demuxer->thread;
+    if (!t)
+        return;
+    pthread_mutex_lock(&t->lock);
+    assert(t->paused > 0);
+    t->paused--;
+    pthread_cond_broadcast(&t->wakeup);
+    pthread_mutex_unlock(&t->lock);
+}
+
+// Drop the queued packets of the given stream type, or of all if type < 0.
+static void demux_thread_flush(struct demuxer *demuxer, int type)
+{
+    struct demux_thread *t = demuxer->thread;
+    if (!t)
+        return;
+    pthread_mutex_lock(&t->lock);
+    for (int n = 0; n < STREAM_TYPE_COUNT; n++) {
+        struct demux_queue *q = &t->queues[n];
+        if (type >= 0 && n != type)
+            continue;
+        t->packs -= q->packs;
+        t->bytes -= q->bytes;
+        queue_free(q);
+    }
+    t->eof = false;
+    pthread_cond_broadcast(&t->wakeup);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static int ds_index(struct demux_stream *ds)
+{
+    for (int n = 0; n < STREAM_TYPE_COUNT; n++) {
+        if (ds->demuxer->ds[n] == ds)
+            return n;
+    }
+    abort();
+}
+
+// Called by ds_add_packet(). Return true if the packet was queued.
+static bool demux_thread_add(struct demux_stream *ds, struct demux_packet *dp)
+{
+    struct demux_thread *t = ds->demuxer->thread;
+    if (!t || !t->thread_running || !pthread_equal(pthread_self(), t->thread))
+        return false;
+    pthread_mutex_lock(&t->lock);
+    struct demux_queue *q = &t->queues[ds_index(ds)];
+    if (q->last)
+        q->last->next = dp;
+    else
+        q->first = dp;
+    q->last = dp;
+    q->packs++;
+    q->bytes += dp->len;
+    if (dp->pts != MP_NOPTS_VALUE) {
+        if (q->first_pts == MP_NOPTS_VALUE)
+            q->first_pts = dp->pts;
+        q->last_pts = dp->pts;
+    }
+    t->packs++;
+    t->bytes += dp->len;
+    pthread_cond_broadcast(&t->wakeup);
+    pthread_mutex_unlock(&t->lock);
+    return true;
+}
+
+// Move queued packets to the demux_stream lists: those for ds (or for all
+// streams if ds is NULL), and subtitles, which are only read passively.
+// Waits until there is something to move.
+// return value:
+//     0 = EOF, or the byte limit was reached without packets for ds
+//     1 = packets were added
+static int demux_thread_read(struct demuxer *demuxer, struct demux_stream *ds)
+{
+    struct demux_thread *t = demuxer->thread;
+    int want = ds ? ds_index(ds) : -1;
+    int moved = 0;
+    pthread_mutex_lock(&t->lock);
+    bool have = want >= 0 ? !!t->queues[want].first : t->packs > 0;
+    // Like the synchronous case, try again if we were at EOF before.
+    if (!have)
+        t->eof = false;
+    t->reader_waiting = true;
+    pthread_cond_broadcast(&t->wakeup);
+    while (!(want >= 0 ? !!t->queues[want].first : t->packs > 0)) {
+        if (t->eof)
+            break;
+        if (!t->filling && demux_thread_full(t)) {
+            mp_tmsg(MSGT_DEMUXER, MSGL_ERR, "\nToo many packets in the "
+                    "demuxer queue: (%d in %"PRId64" bytes).\n",
+                    t->packs, t->bytes);
+            break;
+        }
+        pthread_cond_wait(&t->wakeup, &t->lock);
+    }
+    t->reader_waiting = false;
+    for (int n = 0; n < STREAM_TYPE_COUNT; n++) {
+        struct demux_queue *q = &t->queues[n];
+        struct demux_stream *dst = demuxer->ds[n];
+        if (!q->first || (want >= 0 && n != want && n != STREAM_SUB))
+            continue;
+        if (dst->last)
+            dst->last->next = q->first;
+        else
+            dst->first = q->first;
+        dst->last = q->last;
+        dst->packs += q->packs;
+        dst->bytes += q->bytes;
+        moved += q->packs;
+        t->packs -= q->packs;
+        t->bytes -= q->bytes;
+        queue_init(q);
+    }
+    pthread_cond_broadcast(&t->wakeup);
+    pthread_mutex_unlock(&t->lock);
+    return moved > 0;
+}
+#else
+static void demux_thread_init(struct demuxer *demuxer)
+{
+}
+static bool demux_thread_start(struct demuxer *demuxer)
+{
+    return false;
+}
+static void demux_thread_uninit(struct demuxer *demuxer)
+{
+}
+static void demux_thread_pause(struct demuxer *demuxer)
+{
+}
+static void demux_thread_resume(struct demuxer *demuxer)
+{
+}
+static void demux_thread_flush(struct demuxer *demuxer, int type)
+{
+}
+static bool demux_thread_add(struct demux_stream *ds, struct demux_packet *dp)
+{
+    return false;
+}
+static int demux_thread_read(struct demuxer *demuxer, struct demux_stream *ds)
+{
+    return 0;
+}
+#endif
+
 void free_demuxer(demuxer_t *demuxer)
 {
     int i;
     mp_msg(MSGT_DEMUXER, MSGL_DBG2, "DEMUXER: freeing %s demuxer at %p\n",
            demuxer->desc->shortdesc, demuxer);
+    demux_thread_uninit(demuxer);
     if (demuxer->desc->close)
         demuxer->desc->close(demuxer);
     // free streams:
@@ -452,6 +937,11 @@ void free_demuxer(demuxer_t *demuxer)
     free_demuxer_stream(demuxer->sub);
     free(demuxer->filename);
     talloc_free(demuxer);
+    pool_lock();
+    mp_msg(MSGT_DEMUXER, MSGL_V, "Packet pool: %"PRIu64" hits, %"PRIu64
+           " misses, %"PRId64" KiB unused.\n", pool.hits, pool.misses,
+           pool.bytes / 1024);
+    pool_unlock();
 }
 
 
@@ -467,6 +957,9 @@ void ds_add_packet(demux_stream_t *ds, demux_packet_t *dp)
         return;
     }
 
+    if (demux_thread_add(ds, dp))
+        return;
+
     // append packet to DS stream:
     ++ds->packs;
     ds->bytes += dp->len;
@@ -607,6 +1100,8 @@ void ds_read_packet(demux_stream_t *ds, stream_t *stream, int len,
 int demux_fill_buffer(demuxer_t *demux, demux_stream_t *ds)
 {
     // Note: parameter 'ds' can be NULL!
+    if (demux_thread_start(demux))
+        return demux_thread_read(demux, ds);
     return demux->desc->fill_buffer(demux, ds);
 }
 
@@ -784,8 +1279,7 @@ void ds_free_packs(demux_stream_t *ds)
     }
     if (ds->asf_packet) {
         // free unfinished .asf fragments:
-        free(ds->asf_packet->buffer);
-        free(ds->asf_packet);
+        free_demux_packet(ds->asf_packet);
         ds->asf_packet = NULL;
     }
     ds->first = ds->last = NULL;
@@ -934,12 +1428,21 @@ static int get_demuxer_type_from_name(char *demuxer_name, int *force)
     return -1;
 }
 
+static const struct demuxer_desc *get_demuxer_desc_from_name(const char *name)
+{
+    for (int i = 0; demuxer_list[i]; i++)
+        if (strcmp(name, demuxer_list[i]->name) == 0)
+            return demuxer_list[i];
+    return NULL;
+}
+
 static struct demuxer *open_given_type(struct MPOpts *opts,
                                        const struct demuxer_desc *desc,
                                        struct stream *stream, bool force,
                                        int audio_id, int video_id, int sub_id,
                                        char *filename,
-                                       struct demuxer_params *params)
+                                       struct demuxer_params *params,
+                                       struct probe_cache_entry *cache)
 {
     struct demuxer *demuxer;
     int fformat;
@@ -947,6 +1450,7 @@ static struct demuxer *open_given_type(struct MPOpts *opts,
     demuxer = new_demuxer(opts, stream, desc->type, audio_id,
                           video_id, sub_id, filename);
     demuxer->params = params;
+    demuxer->probe_cache = cache;
     if (desc->check_file)
         fformat = desc->check_file(demuxer);
     else
@@ -979,6 +1483,13 @@ static struct demuxer *open_given_type(struct MPOpts *opts,
             opts->correct_pts =
                 demux_control(demuxer, DEMUXER_CTRL_CORRECT_PTS,
                             NULL) == DEMUXER_CTRL_OK;
+        demux_thread_init(demuxer);
+        if (cache && (!cache->demuxer ||
+                      strcmp(cache->demuxer, demuxer->desc->name) != 0))
+        {
+            cache->demuxer = talloc_strdup(cache, demuxer->desc->name);
+            cache->dirty = true;
+        }
         return demuxer;
     } else {
         // demux_mov can return playlist instead of mov
@@ -995,13 +1506,60 @@ static struct demuxer *open_given_type(struct MPOpts *opts,
             return NULL;
         }
         return open_given_type(opts, desc, stream, false, audio_id,
-                               video_id, sub_id, filename, params);
+                               video_id, sub_id, filename, params, cache);
     }
  fail:
     free_demuxer(demuxer);
     return NULL;
 }
 
+static struct demuxer *probe_demuxer(struct MPOpts *opts,
+                                     struct stream *stream, int audio_id,
+                                     int video_id, int sub_id, char *filename,
+                                     struct demuxer_params *params,
+                                     struct probe_cache_entry *cache)
+{
+    struct demuxer *demuxer = NULL;
+    const struct demuxer_desc *desc;
+
+    // Test demuxers with safe file checks
+    for (int i = 0; (desc = demuxer_list[i]); i++) {
+        if (desc->safe_check) {
+            demuxer = open_given_type(opts, desc, stream, false, audio_id,
+                                      video_id, sub_id, filename, params,
+                                      cache);
+            if (demuxer)
+                return demuxer;
+        }
+    }
+
+    // Ok. We're over the stable detectable fileformats, the next ones are
+    // a bit fuzzy. So by default (extension_parsing==1) try extension-based
+    // detection first:
+    if (filename && opts->extension_parsing == 1) {
+        desc = get_demuxer_desc_from_type(demuxer_type_by_filename(filename));
+        if (desc)
+            demuxer = open_given_type(opts, desc, stream, false, audio_id,
+                                      video_id, sub_id, filename, params,
+                                      cache);
+        if (demuxer)
+            return demuxer;
+    }
+
+    // Finally try detection for demuxers with unsafe checks
+    for (int i = 0; (desc = demuxer_list[i]); i++) {
+        if (!desc->safe_check && desc->check_file) {
+            demuxer = open_given_type(opts, desc, stream, false, audio_id,
+                                      video_id, sub_id, filename, params,
+                                      cache);
+            if (demuxer)
+                return demuxer;
+        }
+    }
+
+    return NULL;
+}
+
 struct demuxer *demux_open_withparams(struct MPOpts *opts,
                                       struct stream *stream, int file_format,
                                       char *force_format, int audio_id,
@@ -1044,42 +1602,41 @@ struct demuxer *demux_open_withparams(struct MPOpts *opts,
             // should only happen with obsolete -demuxer 99 numeric format
             return NULL;
         return open_given_type(opts, desc, stream, force, audio_id,
-                               video_id, sub_id, filename, params);
-    }
-
-    // Test demuxers with safe file checks
-    for (int i = 0; (desc = demuxer_list[i]); i++) {
-        if (desc->safe_check) {
-            demuxer = open_given_type(opts, desc, stream, false, audio_id,
-                                      video_id, sub_id, filename, params);
-            if (demuxer)
-                return demuxer;
-        }
+                               video_id, sub_id, filename, params, NULL);
     }
 
-    // Ok. We're over the stable detectable fileformats, the next ones are
-    // a bit fuzzy. So by default (extension_parsing==1) try extension-based
-    // detection first:
-    if (filename && opts->extension_parsing == 1) {
-        desc = get_demuxer_desc_from_type(demuxer_type_by_filename(filename));
+    struct probe_cache_entry *cache = NULL;
+    if (opts->probe_cache)
+        cache = probe_cache_load(NULL, stream);
+    if (cache) {
+        // The demuxer's own check is the validation of the cached result.
+        desc = get_demuxer_desc_from_name(cache->demuxer);
         if (desc)
             demuxer = open_given_type(opts, desc, stream, false, audio_id,
-                                      video_id, sub_id, filename, params);
-        if (demuxer)
-            return demuxer;
-    }
-
-    // Finally try detection for demuxers with unsafe checks
-    for (int i = 0; (desc = demuxer_list[i]); i++) {
-        if (!desc->safe_check && desc->check_file) {
-            demuxer = open_given_type(opts, desc, stream, false, audio_id,
-                                      video_id, sub_id, filename, params);
-            if (demuxer)
-                return demuxer;
+                                      video_id, sub_id, filename, params,
+                                      cache);
+        if (!demuxer) {
+            mp_msg(MSGT_DEMUXER, MSGL_WARN, "Cached demuxer %s doesn't work "
+                   "with this file anymore, probing it again.\n",
+                   cache->demuxer);
+            talloc_free(cache);
+            cache = NULL;
+            probe_cache_remove(stream);
+            stream_seek(stream, stream->start_pos);
         }
     }
-
-    return NULL;
+    if (!demuxer) {
+        if (opts->probe_cache)
+            cache = talloc_zero(NULL, struct probe_cache_entry);
+        demuxer = probe_demuxer(opts, stream, audio_id, video_id, sub_id,
+                                filename, params, cache);
+    }
+    if (demuxer && cache && cache->dirty)
+        probe_cache_save(stream, cache);
+    if (demuxer)
+        demuxer->probe_cache = NULL;
+    talloc_free(cache);
+    return demuxer;
 }
 
 struct demuxer *demux_open(struct MPOpts *opts, stream_t *vs, int file_format,
@@ -1092,13 +1649,16 @@ struct demuxer *demux_open(struct MPOpts *opts, stream_t *vs, int file_format,
 
 void demux_flush(demuxer_t *demuxer)
 {
+    demux_thread_pause(demuxer);
+    demux_thread_flush(demuxer, -1);
     ds_free_packs(demuxer->video);
     ds_free_packs(demuxer->audio);
     ds_free_packs(demuxer->sub);
+    demux_thread_resume(demuxer);
 }
 
-int demux_seek(demuxer_t *demuxer, float rel_seek_secs, float audio_delay,
-               int flags)
+static int demux_do_seek(demuxer_t *demuxer, float rel_seek_secs,
+                         float audio_delay, int flags)
 {
     if (!demuxer->seekable) {
         if (demuxer->file_format == DEMUXER_TYPE_AVI)
@@ -1160,6 +1720,32 @@ int demux_seek(demuxer_t *demuxer, float rel_seek_secs, float audio_delay,
     return 1;
 }
 
+int demux_seek(demuxer_t *demuxer, float rel_seek_secs, float audio_delay,
+               int flags)
+{
+    demux_thread_pause(demuxer);
+    int res = demux_do_seek(demuxer, rel_seek_secs, audio_delay, flags);
+    demux_thread_resume(demuxer);
+    return res;
+}
+
+// Return the file position of the packet the player read last. Unlike
+// demuxer->filepos or the stream position, this doesn't include data that
+// was read ahead (possibly by the demuxer thread).
+int64_t demux_get_pos(struct demuxer *demuxer)
+{
+    struct demux_stream *ds = demuxer->video->sh ? demuxer->video
+                                                 : demuxer->audio;
+    if (ds->sh && ds->pos > 0)
+        return ds->pos;
+    // The demuxer doesn't set packet positions, or nothing was read yet.
+    demux_thread_pause(demuxer);
+    int64_t pos = demuxer->filepos > 0 ? demuxer->filepos
+                                       : stream_tell(demuxer->stream);
+    demux_thread_resume(demuxer);
+    return pos;
+}
+
 int demux_info_add(demuxer_t *demuxer, const char *opt, const char *param)
 {
     return demux_info_add_bstr(demuxer, bstr0(opt), bstr0(param));
@@ -1231,11 +1817,15 @@ char *demux_info_get(demuxer_t *demuxer, const char *opt)
 
 int demux_control(demuxer_t *demuxer, int cmd, void *arg)
 {
+    int res = DEMUXER_CTRL_NOTIMPL;
 
-    if (demuxer->desc->control)
-        return demuxer->desc->control(demuxer, cmd, arg);
+    if (demuxer->desc->control) {
+        demux_thread_pause(demuxer);
+        res = demuxer->desc->control(demuxer, cmd, arg);
+        demux_thread_resume(demuxer);
+    }
 
-    return DEMUXER_CTRL_NOTIMPL;
+    return res;
 }
 
 struct sh_stream *demuxer_stream_by_demuxer_id(struct demuxer *d,
@@ -1253,6 +1843,7 @@ void demuxer_switch_track(struct demuxer *demuxer, enum stream_type type,
                           struct sh_stream *stream)
 {
     assert(!stream || stream->type == type);
+    demux_thread_pause(demuxer);
     int index = stream ? stream->tid : -2;
     if (type == STREAM_AUDIO) {
         if (demux_control(demuxer, DEMUXER_CTRL_SWITCH_AUDIO, &index)
@@ -1264,8 +1855,10 @@ void demuxer_switch_track(struct demuxer *demuxer, enum stream_type type,
             demuxer->video->id = index;
     } else if (type == STREAM_SUB) {
         int index2 = stream ? stream->stream_index : -2;
-        if (demuxer->ds[type]->id != index2)
+        if (demuxer->ds[type]->id != index2) {
+            demux_thread_flush(demuxer, type);
             ds_free_packs(demuxer->ds[type]);
+        }
         demuxer->ds[type]->id = index2;
     }
     int new_id = demuxer->ds[type]->id;
@@ -1278,6 +1871,7 @@ void demuxer_switch_track(struct demuxer *demuxer, enum stream_type type,
         }
     }
     demuxer->ds[type]->sh = new;
+    demux_thread_resume(demuxer);
 }
 
 int demuxer_add_attachment(demuxer_t *demuxer, struct bstr name,
@@ -1355,12 +1949,14 @@ int demuxer_seek_chapter(demuxer_t *demuxer, int chapter, double *seek_pts)
     int ris;
 
     if (!demuxer->num_chapters || !demuxer->chapters) {
+        demux_thread_pause(demuxer);
         demux_flush(demuxer);
 
         ris = stream_control(demuxer->stream, STREAM_CTRL_SEEK_TO_CHAPTER,
                              &chapter);
         if (ris != STREAM_UNSUPPORTED)
             demux_control(demuxer, DEMUXER_CTRL_RESYNC, NULL);
+        demux_thread_resume(demuxer);
 
         // exit status may be ok, but main() doesn't have to seek itself
         // (because e.g. dvds depend on sectors, not on pts)
@@ -1457,13 +2053,15 @@ int demuxer_set_angle(demuxer_t *demuxer, int angle)
     if ((angles < 1) || (angle > angles))
         return -1;
 
+    demux_thread_pause(demuxer);
     demux_flush(demuxer);
 
     ris = stream_control(demuxer->stream, STREAM_CTRL_SET_ANGLE, &angle);
+    if (ris != STREAM_UNSUPPORTED)
+        demux_control(demuxer, DEMUXER_CTRL_RESYNC, NULL);
+    demux_thread_resume(demuxer);
     if (ris == STREAM_UNSUPPORTED)
         return -1;
 
-    demux_control(demuxer, DEMUXER_CTRL_RESYNC, NULL);
-
     return angle;
 }
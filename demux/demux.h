@@ -270,6 +270,10 @@ typedef struct demuxer {
     char **info;  // metadata
     struct MPOpts *opts;
     struct demuxer_params *params;
+    // background reader (--demuxer-thread), NULL if not used
+    struct demux_thread *thread;
+    // --probe-cache entry, only set while opening (see probe_cache.h)
+    struct probe_cache_entry *probe_cache;
 } demuxer_t;
 
 typedef struct {
@@ -284,6 +288,14 @@ void resize_demux_packet(struct demux_packet *dp, size_t len);
 struct demux_packet *clone_demux_packet(struct demux_packet *pack);
 void free_demux_packet(struct demux_packet *dp);
 
+// Allocation counters of the packet pool (totals since program start).
+// Buffers allocated by libavformat (demux_lavf) are not included.
+struct demux_pool_stats {
+    uint64_t packets, packet_mallocs; // packet structs, not from the pool
+    uint64_t buffers, buffer_mallocs; // packet buffers, not from the pool
+};
+void demux_get_pool_stats(struct demux_pool_stats *st);
+
 #ifndef SIZE_MAX
 #define SIZE_MAX ((size_t)-1)
 #endif
@@ -366,6 +378,7 @@ struct demuxer *demux_open_withparams(struct MPOpts *opts,
 void demux_flush(struct demuxer *demuxer);
 int demux_seek(struct demuxer *demuxer, float rel_seek_secs, float audio_delay,
                int flags);
+int64_t demux_get_pos(struct demuxer *demuxer);
 
 // AVI demuxer params:
 extern int index_mode;  // -1=untouched  0=don't use index  1=use (generate) index
@@ -44,6 +44,7 @@
 #include "aviprint.h"
 #include "demux.h"
 #include "stheader.h"
+#include "probe_cache.h"
 #include "core/m_option.h"
 
 #include "mp_taglists.h"
@@ -68,7 +69,6 @@ typedef struct lavf_priv {
     AVInputFormat *avif;
     AVFormatContext *avfc;
     AVIOContext *pb;
-    uint8_t buffer[BIO_BUFFER_SIZE];
     int audio_streams;
     int video_streams;
     int sub_streams;
@@ -106,7 +106,7 @@ static int mp_read(void *opaque, uint8_t *buf, int size)
     struct stream *stream = demuxer->stream;
     int ret;
 
-    ret = stream_read(stream, buf, size);
+    ret = stream_read_direct(stream, buf, size);
 
     mp_msg(MSGT_HEADER, MSGL_DBG2,
            "%d=mp_read(%p, %p, %d), pos: %"PRId64", eof:%d\n",
@@ -224,6 +224,11 @@ static int lavf_check_file(demuxer_t *demuxer)
         format = avdevice_format;
     if (!format && demuxer->stream->mime_type)
         format = (char *)find_demuxer_from_mime_type(demuxer->stream->mime_type);
+    // The cached format is only a hint: the file might have been replaced.
+    struct probe_cache_entry *cache = demuxer->probe_cache;
+    AVInputFormat *cached_avif = NULL;
+    if (!format && cache && cache->lavf_format)
+        cached_avif = av_find_input_format(cache->lavf_format);
     if (format) {
         if (strcmp(format, "help") == 0) {
             list_formats();
@@ -267,6 +272,18 @@ static int lavf_check_file(demuxer_t *demuxer)
                    priv->avif->name, score, probe_data_size);
         }
 
+        if (cached_avif) {
+            // Checked against the first probe buffer only.
+            if (priv->avif == cached_avif && score >= min_probe) {
+                mp_msg(MSGT_DEMUX, MSGL_V, "Using cached lavf format %s.\n",
+                       cached_avif->name);
+            } else {
+                mp_msg(MSGT_DEMUX, MSGL_V, "Cached lavf format %s doesn't "
+                       "match, probing.\n", cached_avif->name);
+            }
+            cached_avif = NULL;
+        }
+
         if (priv->avif && score >= min_probe)
             break;
 
@@ -604,6 +621,35 @@ static void handle_stream(demuxer_t *demuxer, AVFormatContext *avfc, int i)
     }
 }
 
+/* Describe everything about the streams that is used by handle_stream() and
+ * the rest of the demuxer, so that if avformat_find_stream_info() doesn't
+ * change it for a file, it's known that it can be skipped for that file. */
+static char *get_stream_params(void *talloc_ctx, AVFormatContext *avfc)
+{
+    char *res = talloc_asprintf(talloc_ctx, "%d:%"PRId64":%"PRId64":%d",
+                                avfc->nb_streams, avfc->duration,
+                                avfc->start_time, avfc->bit_rate);
+    for (int i = 0; i < avfc->nb_streams; i++) {
+        AVStream *st = avfc->streams[i];
+        AVCodecContext *c = st->codec;
+        uint32_t crc = 0;
+        for (int n = 0; n < c->extradata_size; n++)
+            crc = crc * 31 + c->extradata[n];
+        res = talloc_asprintf_append(res,
+            ",%d:%d:%d:%x:%d:%d:%d:%d/%d:%d/%d:%d/%d:%d/%d:%d:%d:%d:%d:%d:%d:%d"
+            ":%d:%d:%x",
+            st->id, c->codec_type, c->codec_id, c->codec_tag, c->width,
+            c->height, c->pix_fmt, st->sample_aspect_ratio.num,
+            st->sample_aspect_ratio.den, c->sample_aspect_ratio.num,
+            c->sample_aspect_ratio.den, st->time_base.num, st->time_base.den,
+            st->r_frame_rate.num, st->r_frame_rate.den, c->ticks_per_frame,
+            c->sample_rate, c->channels, c->block_align, c->frame_size,
+            c->bits_per_coded_sample, c->bit_rate, st->disposition,
+            c->extradata_size, crc);
+    }
+    return res;
+}
+
 static demuxer_t *demux_open_lavf(demuxer_t *demuxer)
 {
     struct MPOpts *opts = demuxer->opts;
@@ -660,8 +706,19 @@ static demuxer_t *demux_open_lavf(demuxer_t *demuxer)
     if (!(priv->avif->flags & AVFMT_NOFILE) &&
         demuxer->stream->type != STREAMTYPE_AVDEVICE)
     {
-        priv->pb = avio_alloc_context(priv->buffer, BIO_BUFFER_SIZE, 0,
-                                      demuxer, mp_read, NULL, mp_seek);
+        // Streams which can do large reads get an AVIO buffer of the same
+        // size, so that refilling it bypasses the stream buffer.
+        struct stream *s = demuxer->stream;
+        int size = FFMAX(s->max_read_size, BIO_BUFFER_SIZE);
+        uint8_t *buffer = av_malloc(size);
+        if (!buffer)
+            return NULL;
+        priv->pb = avio_alloc_context(buffer, size, 0, demuxer, mp_read, NULL,
+                                      mp_seek);
+        if (!priv->pb) {
+            av_free(buffer);
+            return NULL;
+        }
         priv->pb->read_seek = mp_read_seek;
         priv->pb->seekable = demuxer->stream->end_pos
                  && (demuxer->stream->flags & MP_STREAM_SEEK) == MP_STREAM_SEEK
@@ -676,10 +733,36 @@ static demuxer_t *demux_open_lavf(demuxer_t *demuxer)
     }
 
     priv->avfc = avfc;
-    if (avformat_find_stream_info(avfc, NULL) < 0) {
-        mp_msg(MSGT_HEADER, MSGL_ERR,
-               "LAVF_header: av_find_stream_info() failed\n");
-        return NULL;
+
+    struct probe_cache_entry *cache = demuxer->probe_cache;
+    char *header_params = cache ? get_stream_params(priv, avfc) : NULL;
+    if (cache && cache->lavf_streams &&
+        strcmp(cache->lavf_streams, header_params) == 0)
+    {
+        mp_msg(MSGT_HEADER, MSGL_V, "LAVF: stream parameters match the probe "
+               "cache, skipping avformat_find_stream_info().\n");
+    } else {
+        if (avformat_find_stream_info(avfc, NULL) < 0) {
+            mp_msg(MSGT_HEADER, MSGL_ERR,
+                   "LAVF_header: av_find_stream_info() failed\n");
+            return NULL;
+        }
+        if (cache) {
+            // Only remember the parameters if analyzing the streams didn't
+            // add anything to what the header says.
+            char *params = get_stream_params(priv, avfc);
+            bool complete = strcmp(params, header_params) == 0;
+            if (!bstr_equals(bstr0(cache->lavf_streams),
+                             bstr0(complete ? params : NULL)))
+                cache->dirty = true;
+            talloc_free(cache->lavf_streams);
+            cache->lavf_streams = complete ? talloc_steal(cache, params) : NULL;
+        }
+    }
+    if (cache && !bstr_equals0(bstr0(cache->lavf_format), priv->avif->name)) {
+        talloc_free(cache->lavf_format);
+        cache->lavf_format = talloc_strdup(cache, priv->avif->name);
+        cache->dirty = true;
     }
     /* Add metadata. */
     while ((t = av_dict_get(avfc->metadata, "", t,
@@ -1079,6 +1162,8 @@ static void demux_close_lavf(demuxer_t *demuxer)
             av_freep(&priv->avfc->key);
             avformat_close_input(&priv->avfc);
         }
+        if (priv->pb)
+            av_freep(&priv->pb->buffer);
         av_freep(&priv->pb);
         talloc_free(priv);
         demuxer->priv = NULL;
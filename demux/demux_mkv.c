@@ -26,11 +26,16 @@
 #include <ctype.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include <libavutil/common.h>
 #include <libavutil/lzo.h>
 #include <libavutil/intreadwrite.h>
 #include <libavutil/avstring.h>
+#include <libavutil/md5.h>
 
 #include "config.h"
 
@@ -38,9 +43,16 @@
 #include <zlib.h>
 #endif
 
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "osdep/io.h"
 #include "talloc.h"
 #include "core/options.h"
 #include "core/bstr.h"
+#include "core/path.h"
+#include "core/mp_talloc.h"
 #include "stream/stream.h"
 #include "demux.h"
 #include "stheader.h"
@@ -156,8 +168,12 @@ typedef struct mkv_demuxer {
     uint64_t cluster_size;
     uint64_t blockgroup_size;
 
+    // flat array, allocated with MP_TARRAY_* (talloc child of mkv_demuxer)
     mkv_index_t *indexes;
     int num_indexes;
+    // Position of the Cues, if they are yet to be read (see load_cues())
+    int64_t cues_pos;
+    int64_t first_cluster;
 
     int64_t *parsed_pos;
     int num_parsed_pos;
@@ -167,11 +183,17 @@ typedef struct mkv_demuxer {
     bool parsed_chapters;
     bool parsed_attachments;
 
-    struct cluster_pos {
-        uint64_t filepos;
-        uint64_t timecode;
-    } *cluster_positions;
-    int num_cluster_pos;
+    /* Without Cues, indexes is made from the keyframes seen while demuxing
+     * or scanning the file. It covers the clusters before index_end then,
+     * and index_tc is the timecode of the last of them. Entries hold the
+     * first keyframe of each track per cluster. */
+    bool index_generated;
+    bool index_complete;        // indexed up to the end of the file
+    bool index_cluster;         // current cluster is being indexed
+    uint64_t index_end;
+    uint64_t index_tc;
+    uint64_t index_saved_end;   // index_end of the cache file
+    struct index_scan *index_scan;
 
     uint64_t skip_to_timecode;
     int v_skip_to_keyframe, a_skip_to_keyframe;
@@ -185,19 +207,6 @@ typedef struct mkv_demuxer {
 #define RAPROPERTIES4_SIZE 56
 #define RAPROPERTIES5_SIZE 70
 
-/**
- * \brief ensures there is space for at least one additional element
- * \param array array to grow
- * \param nelem current number of elements in array
- * \param elsize size of one array element
- */
-static void *grow_array(void *array, int nelem, size_t elsize)
-{
-    if (!(nelem & 31))
-        array = realloc(array, (nelem + 32) * elsize);
-    return array;
-}
-
 static bool is_parsed_header(struct mkv_demuxer *mkv_d, int64_t pos)
 {
     int low = 0;
@@ -231,23 +240,36 @@ static mkv_track_t *find_track_by_num(struct mkv_demuxer *d, int n, int type)
     return NULL;
 }
 
-static void add_cluster_position(mkv_demuxer_t *mkv_d, uint64_t filepos,
-                                 uint64_t timecode)
+// timecode is in nanoseconds, filepos is the start of the cluster.
+static void add_keyframe_index(mkv_demuxer_t *mkv_d, int tnum,
+                               uint64_t timecode, uint64_t filepos)
 {
-    if (mkv_d->indexes)
-        return;
-
-    int n = mkv_d->num_cluster_pos;
-    if (n > 0 && mkv_d->cluster_positions[n-1].filepos >= filepos)
-        return;
+    for (int i = mkv_d->num_indexes - 1; i >= 0; i--) {
+        if (mkv_d->indexes[i].filepos != filepos)
+            break;
+        if (mkv_d->indexes[i].tnum == tnum)
+            return;
+    }
+    MP_TARRAY_APPEND(mkv_d, mkv_d->indexes, mkv_d->num_indexes,
+                     (mkv_index_t){
+                         .tnum = tnum,
+                         .timecode = timecode / mkv_d->tc_scale,
+                         .filepos = filepos,
+                     });
+}
 
-    mkv_d->cluster_positions =
-        grow_array(mkv_d->cluster_positions, mkv_d->num_cluster_pos,
-                   sizeof(*mkv_d->cluster_positions));
-    mkv_d->cluster_positions[mkv_d->num_cluster_pos++] = (struct cluster_pos){
-        .filepos = filepos,
-        .timecode = timecode,
-    };
+/* Called when entering the cluster at mkv_d->cluster_start while demuxing.
+ * Its keyframes are indexed if it directly follows the indexed part of the
+ * file; search_start is where looking for the cluster started. */
+static void index_enter_cluster(mkv_demuxer_t *mkv_d, uint64_t search_start,
+                                uint64_t cluster_end)
+{
+    mkv_d->index_cluster = mkv_d->index_generated && !mkv_d->index_complete
+        && mkv_d->cluster_size != EBML_UINT_INVALID
+        && search_start <= mkv_d->index_end
+        && mkv_d->cluster_start >= mkv_d->index_end;
+    if (mkv_d->index_cluster)
+        mkv_d->index_end = cluster_end;
 }
 
 
@@ -692,51 +714,87 @@ static int demux_mkv_read_tracks(demuxer_t *demuxer)
     return 0;
 }
 
-static int demux_mkv_read_cues(demuxer_t *demuxer)
-{
-    mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
-    stream_t *s = demuxer->stream;
-
-    if (index_mode == 0 || index_mode == 2) {
-        ebml_read_skip(s, NULL);
-        return 0;
-    }
+struct index_scan;
+static bool index_scan_cancelled(struct index_scan *scan);
 
+/* Read the Cues at mkv_d->cues_pos into mkv_d->indexes. This parses the
+ * elements directly instead of using ebml_read_element(), because files
+ * can have hundreds of thousands of cue points. If scan is set, stop when
+ * it's cancelled, leaving cues_pos set. */
+static void read_cues(mkv_demuxer_t *mkv_d, struct stream *s,
+                      struct index_scan *scan)
+{
     mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] /---- [ parsing cues ] -----------\n");
-    struct ebml_cues cues = {};
-    struct ebml_parse_ctx parse_ctx = {};
-    if (ebml_read_element(s, &parse_ctx, &cues, &ebml_cues_desc) < 0)
-        return -1;
-    for (int i = 0; i < cues.n_cue_point; i++) {
-        struct ebml_cue_point *cuepoint = &cues.cue_point[i];
-        if (cuepoint->n_cue_time != 1 || !cuepoint->n_cue_track_positions) {
-            mp_msg(MSGT_DEMUX, MSGL_WARN, "[mkv] Malformed CuePoint element\n");
+    if (!stream_seek(s, mkv_d->cues_pos) ||
+        ebml_read_id(s, NULL) != MATROSKA_ID_CUES) {
+        mp_msg(MSGT_DEMUX, MSGL_WARN, "[mkv] Cues not found\n");
+        goto done;
+    }
+    uint64_t len = ebml_read_length(s, NULL);
+    if (len == EBML_UINT_INVALID)
+        goto done;
+    uint64_t end = stream_tell(s) + len;
+    for (int n = 0; !s->eof && stream_tell(s) < end; n++) {
+        if (scan && !(n & 1023) && index_scan_cancelled(scan))
+            return;
+        uint32_t id = ebml_read_id(s, NULL);
+        if (id != MATROSKA_ID_CUEPOINT) {
+            if (id == EBML_ID_INVALID || ebml_read_skip(s, NULL))
+                break;
             continue;
         }
-        uint64_t time = cuepoint->cue_time;
-        for (int i = 0; i < cuepoint->n_cue_track_positions; i++) {
-            struct ebml_cue_track_positions *trackpos =
-                &cuepoint->cue_track_positions[i];
-            uint64_t track = trackpos->cue_track;
-            uint64_t pos = trackpos->cue_cluster_position;
-            mkv_d->indexes =
-                grow_array(mkv_d->indexes, mkv_d->num_indexes,
-                           sizeof(mkv_index_t));
-            mkv_d->indexes[mkv_d->num_indexes].tnum = track;
-            mkv_d->indexes[mkv_d->num_indexes].timecode = time;
-            mkv_d->indexes[mkv_d->num_indexes].filepos =
-                mkv_d->segment_start + pos;
+        len = ebml_read_length(s, NULL);
+        if (len == EBML_UINT_INVALID)
+            break;
+        uint64_t point_end = stream_tell(s) + len;
+        uint64_t time = EBML_UINT_INVALID;
+        int first = mkv_d->num_indexes;
+        while (!s->eof && stream_tell(s) < point_end) {
+            id = ebml_read_id(s, NULL);
+            if (id == MATROSKA_ID_CUETIME) {
+                time = ebml_read_uint(s, NULL);
+            } else if (id == MATROSKA_ID_CUETRACKPOSITIONS) {
+                len = ebml_read_length(s, NULL);
+                if (len == EBML_UINT_INVALID)
+                    break;
+                uint64_t pos_end = stream_tell(s) + len;
+                uint64_t track = EBML_UINT_INVALID, pos = EBML_UINT_INVALID;
+                while (!s->eof && stream_tell(s) < pos_end) {
+                    id = ebml_read_id(s, NULL);
+                    if (id == MATROSKA_ID_CUETRACK)
+                        track = ebml_read_uint(s, NULL);
+                    else if (id == MATROSKA_ID_CUECLUSTERPOSITION)
+                        pos = ebml_read_uint(s, NULL);
+                    else if (id == EBML_ID_INVALID || ebml_read_skip(s, NULL))
+                        break;
+                }
+                if (track != EBML_UINT_INVALID && pos != EBML_UINT_INVALID)
+                    MP_TARRAY_APPEND(mkv_d, mkv_d->indexes, mkv_d->num_indexes,
+                                     (mkv_index_t){
+                                         .tnum = track,
+                                         .filepos = mkv_d->segment_start + pos,
+                                     });
+                stream_seek(s, pos_end);
+            } else if (id == EBML_ID_INVALID || ebml_read_skip(s, NULL)) {
+                break;
+            }
+        }
+        if (time == EBML_UINT_INVALID || first == mkv_d->num_indexes) {
+            mp_msg(MSGT_DEMUX, MSGL_WARN, "[mkv] Malformed CuePoint element\n");
+            mkv_d->num_indexes = first;
+        }
+        for (int i = first; i < mkv_d->num_indexes; i++) {
+            mkv_d->indexes[i].timecode = time;
             mp_msg(MSGT_DEMUX, MSGL_DBG2,
-                   "[mkv] |+ found cue point for track %" PRIu64
-                   ": timecode %" PRIu64 ", filepos: %" PRIu64 "\n", track,
-                   time, mkv_d->segment_start + pos);
-            mkv_d->num_indexes++;
+                   "[mkv] |+ found cue point for track %d: timecode %"
+                   PRIu64 ", filepos: %" PRIu64 "\n", mkv_d->indexes[i].tnum,
+                   time, mkv_d->indexes[i].filepos);
         }
+        stream_seek(s, point_end);
     }
-
+ done:
+    mkv_d->cues_pos = 0;
     mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] \\---- [ parsing cues ] -----------\n");
-    talloc_free(parse_ctx.talloc_ctx);
-    return 0;
 }
 
 static int demux_mkv_read_chapters(struct demuxer *demuxer)
@@ -1010,9 +1068,11 @@ static int read_header_element(struct demuxer *demuxer, uint32_t id,
     case MATROSKA_ID_CUES:
         if (is_parsed_header(mkv_d, pos))
             break;
-        if (at_filepos && !seek_pos_id(s, at_filepos, id))
-            return -1;
-        return demux_mkv_read_cues(demuxer);
+        if (index_mode == 0 || index_mode == 2 || mkv_d->cues_pos)
+            break;
+        // Reading them is deferred until they're needed, see load_cues().
+        mkv_d->cues_pos = at_filepos ? at_filepos : pos;
+        break;
 
     case MATROSKA_ID_TAGS:
         if (mkv_d->parsed_tags)
@@ -1591,15 +1651,32 @@ static int demux_mkv_open_sub(demuxer_t *demuxer, mkv_track_t *track,
     return 0;
 }
 
+static void load_index_cache(struct demuxer *demuxer);
+static void save_index_cache(struct demuxer *demuxer);
+static void start_index_scan(struct demuxer *demuxer);
+static void merge_index_scan(struct demuxer *demuxer, bool force);
+
+// Build the index from the clusters, for files without (usable) Cues.
+static void use_generated_index(struct demuxer *demuxer)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    mkv_d->index_generated = true;
+    mkv_d->index_end = mkv_d->first_cluster;
+    if (demuxer->seekable) {
+        load_index_cache(demuxer);
+        start_index_scan(demuxer);
+    }
+}
+
 static void mkv_free(struct demuxer *demuxer)
 {
     struct mkv_demuxer *mkv_d = demuxer->priv;
     if (!mkv_d)
         return;
+    merge_index_scan(demuxer, true);
+    save_index_cache(demuxer);
     for (int i = 0; i < mkv_d->num_tracks; i++)
         demux_mkv_free_trackentry(mkv_d->tracks[i]);
-    free(mkv_d->indexes);
-    free(mkv_d->cluster_positions);
 }
 
 static int demux_mkv_open(demuxer_t *demuxer)
@@ -1677,6 +1754,7 @@ static int demux_mkv_open(demuxer_t *demuxer)
         if (res < 0)
             break;
     }
+    mkv_d->first_cluster = stream_tell(s);
 
     display_create_tracks(demuxer);
 
@@ -1726,6 +1804,15 @@ static int demux_mkv_open(demuxer_t *demuxer)
 
     demuxer->accurate_seek = true;
 
+    if (mkv_d->cues_pos) {
+        if (demuxer->seekable)
+            start_index_scan(demuxer);
+        else
+            mkv_d->cues_pos = 0;
+    } else if (!mkv_d->indexes) {
+        use_generated_index(demuxer);
+    }
+
     return DEMUXER_TYPE_MATROSKA;
 }
 
@@ -2046,6 +2133,8 @@ static int handle_block(demuxer_t *demuxer, uint8_t *block, uint64_t length,
         free(lace_size);
         return 1;
     }
+    if (mkv_d->index_cluster && keyframe)
+        add_keyframe_index(mkv_d, num, tc, mkv_d->cluster_start);
     if (track->type == MATROSKA_TRACK_AUDIO
         && track->id == demuxer->audio->id) {
         ds = demuxer->audio;
@@ -2213,8 +2302,8 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
                     if (num == EBML_UINT_INVALID)
                         return 0;
                     mkv_d->cluster_tc = num * mkv_d->tc_scale;
-                    add_cluster_position(mkv_d, mkv_d->cluster_start,
-                                         mkv_d->cluster_tc);
+                    if (mkv_d->index_cluster)
+                        mkv_d->index_tc = mkv_d->cluster_tc;
                     break;
 
                 case MATROSKA_ID_BLOCKGROUP:
@@ -2227,15 +2316,22 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
                     block_length = ebml_read_length(s, &tmp);
                     if (block_length > 500000000)
                         return 0;
-                    block = malloc(block_length);
                     demuxer->filepos = stream_tell(s);
-                    if (stream_read(s, block, block_length) !=
-                        (int) block_length) {
+                    // Use the data in place if the file is memory mapped.
+                    uint8_t *data;
+                    int len = stream_read_ptr(s, block_length, &data);
+                    if (len) {
+                        block = NULL;
+                    } else {
+                        block = data = malloc(block_length);
+                        len = stream_read(s, block, block_length);
+                    }
+                    if (len != (int) block_length) {
                         free(block);
                         return 0;
                     }
                     l = tmp + block_length;
-                    res = handle_block(demuxer, block, block_length,
+                    res = handle_block(demuxer, data, block_length,
                                        block_duration, false, true);
                     free(block);
                     mkv_d->cluster_size -= l + il;
@@ -2258,6 +2354,7 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
             }
         }
 
+        uint64_t search_start = stream_tell(s);
         while (ebml_read_id(s, &il) != MATROSKA_ID_CLUSTER) {
             ebml_read_skip(s, NULL);
             if (s->eof)
@@ -2265,79 +2362,430 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
         }
         mkv_d->cluster_start = stream_tell(s) - il;
         mkv_d->cluster_size = ebml_read_length(s, NULL);
+        index_enter_cluster(mkv_d, search_start,
+                            stream_tell(s) + mkv_d->cluster_size);
     }
 
     return 0;
 }
 
-static int seek_creating_index(struct demuxer *demuxer, float rel_seek_secs,
-                               int flags)
+// Read the track number, relative timecode and flags of a (Simple)Block with
+// the given size. Returns the track number, or -1 on error.
+static int read_block_header(struct stream *s, uint64_t size, int16_t *time,
+                             uint8_t *flags)
 {
-    struct mkv_demuxer *mkv_d = demuxer->priv;
-    struct stream *s = demuxer->stream;
-    int64_t target_tc_ns = (int64_t) (rel_seek_secs * 1e9);
-    if (target_tc_ns < 0)
-        target_tc_ns = 0;
-    uint64_t max_filepos = 0;
-    int64_t max_tc = -1;
-    int n = mkv_d->num_cluster_pos;
-    if (n > 0) {
-        max_filepos = mkv_d->cluster_positions[n - 1].filepos;
-        max_tc = mkv_d->cluster_positions[n - 1].timecode;
-    }
-
-    if (target_tc_ns > max_tc) {
-        if ((int64_t) max_filepos > stream_tell(s))
-            stream_seek(s, max_filepos);
-        else
-            stream_seek(s, stream_tell(s) + mkv_d->cluster_size);
-        /* parse all the clusters upto target_filepos */
-        while (!s->eof) {
-            uint64_t start = stream_tell(s);
-            uint32_t type = ebml_read_id(s, NULL);
-            uint64_t len = ebml_read_length(s, NULL);
-            uint64_t end = stream_tell(s) + len;
-            if (type == MATROSKA_ID_CLUSTER) {
-                while (!s->eof && stream_tell(s) < end) {
-                    if (ebml_read_id(s, NULL) == MATROSKA_ID_TIMECODE) {
-                        uint64_t tc = ebml_read_uint(s, NULL);
-                        tc *= mkv_d->tc_scale;
-                        add_cluster_position(mkv_d, start, tc);
-                        if (tc >= target_tc_ns)
-                            goto enough_index;
+    uint8_t buf[8 + 3] = {0};
+    int len = FFMIN(size, sizeof(buf));
+    if (stream_read(s, buf, len) != len)
+        return -1;
+    int l;
+    uint64_t num = ebml_read_vlen_uint(buf, &l);
+    if (num == EBML_UINT_INVALID || num > INT_MAX || l + 3 > len)
+        return -1;
+    *time = AV_RB16(buf + l);
+    *flags = buf[l + 2];
+    return num;
+}
+
+// Add the keyframes of the cluster starting at cluster_start to the index,
+// reading only the block headers. The stream is positioned after the cluster
+// header, and is left at end.
+static void index_scan_cluster(mkv_demuxer_t *mkv_d, struct stream *s,
+                               uint64_t cluster_start, uint64_t end)
+{
+    uint64_t cluster_tc = 0;
+    while (!s->eof && stream_tell(s) < end) {
+        uint32_t id = ebml_read_id(s, NULL);
+        if (id == MATROSKA_ID_TIMECODE) {
+            uint64_t num = ebml_read_uint(s, NULL);
+            if (num == EBML_UINT_INVALID)
+                break;
+            cluster_tc = num * mkv_d->tc_scale;
+            mkv_d->index_tc = cluster_tc;
+            continue;
+        }
+        if (id != MATROSKA_ID_SIMPLEBLOCK && id != MATROSKA_ID_BLOCKGROUP) {
+            if (id == EBML_ID_INVALID || ebml_read_skip(s, NULL))
+                break;
+            continue;
+        }
+        uint64_t len = ebml_read_length(s, NULL);
+        if (len == EBML_UINT_INVALID)
+            break;
+        uint64_t block_end = stream_tell(s) + len;
+        int tnum = -1;
+        int16_t time = 0;
+        uint8_t flags = 0;
+        bool keyframe = true;
+        if (id == MATROSKA_ID_SIMPLEBLOCK) {
+            tnum = read_block_header(s, len, &time, &flags);
+            keyframe = flags & 0x80;
+        } else {
+            while (!s->eof && stream_tell(s) < block_end) {
+                id = ebml_read_id(s, NULL);
+                if (id == MATROSKA_ID_BLOCK) {
+                    uint64_t l = ebml_read_length(s, NULL);
+                    if (l == EBML_UINT_INVALID)
                         break;
-                    }
+                    uint64_t next = stream_tell(s) + l;
+                    tnum = read_block_header(s, l, &time, &flags);
+                    stream_seek(s, next);
+                } else if (id == MATROSKA_ID_REFERENCEBLOCK) {
+                    if (ebml_read_int(s, NULL) != 0)
+                        keyframe = false;
+                } else if (id == EBML_ID_INVALID || ebml_read_skip(s, NULL)) {
+                    break;
                 }
             }
-            if (s->eof)
-                break;
-            stream_seek(s, end);
         }
-    enough_index:
-        if (s->eof)
-            stream_reset(s);
+        if (tnum >= 0 && keyframe) {
+            int64_t tc = cluster_tc + time * (int64_t)mkv_d->tc_scale;
+            add_keyframe_index(mkv_d, tnum, FFMAX(tc, 0), cluster_start);
+        }
+        stream_seek(s, block_end);
     }
-    if (!mkv_d->num_cluster_pos) {
-        mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] no target for seek found\n");
-        return -1;
+}
+
+/* Index the clusters from index_end on, until one with a timecode of at
+ * least target_tc (in ns) has been indexed, or the end of the file is
+ * reached. If scan is set, stop when it's cancelled. */
+static void index_scan_clusters(mkv_demuxer_t *mkv_d, struct stream *s,
+                                uint64_t target_tc, struct index_scan *scan)
+{
+    stream_seek(s, mkv_d->index_end);
+    while (!mkv_d->index_complete) {
+        if (scan && index_scan_cancelled(scan))
+            return;
+        uint64_t start = stream_tell(s);
+        uint32_t id = ebml_read_id(s, NULL);
+        uint64_t len = ebml_read_length(s, NULL);
+        if (s->eof || id == EBML_ID_INVALID || len == EBML_UINT_INVALID) {
+            mkv_d->index_complete = true;
+            break;
+        }
+        uint64_t end = stream_tell(s) + len;
+        if (id == MATROSKA_ID_CLUSTER)
+            index_scan_cluster(mkv_d, s, start, end);
+        mkv_d->index_end = end;
+        if (id == MATROSKA_ID_CLUSTER && mkv_d->index_tc >= target_tc)
+            break;
+        stream_seek(s, end);
     }
-    uint64_t cluster_pos = mkv_d->cluster_positions[0].filepos;
-    /* Let's find the nearest cluster */
-    int64_t min_diff = 0xFFFFFFFFFFFFFFF;
-    for (int i = 0; i < mkv_d->num_cluster_pos; i++) {
-        int64_t diff = mkv_d->cluster_positions[i].timecode - target_tc_ns;
-        if (flags & SEEK_BACKWARD && diff < 0 && -diff < min_diff) {
-            cluster_pos = mkv_d->cluster_positions[i].filepos;
-            min_diff = -diff;
-        } else if (flags & SEEK_FORWARD
-                   && (diff < 0 ? -1 * diff : diff) < min_diff) {
-            cluster_pos = mkv_d->cluster_positions[i].filepos;
-            min_diff = diff < 0 ? -1 * diff : diff;
+}
+
+// Make sure the index extends to target_tc (in ns), if possible.
+static void extend_index(struct demuxer *demuxer, uint64_t target_tc)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    struct stream *s = demuxer->stream;
+    if (mkv_d->index_complete || (mkv_d->num_indexes &&
+                                  mkv_d->index_tc >= target_tc))
+        return;
+    int64_t pos = stream_tell(s);
+    mkv_d->index_cluster = false;
+    index_scan_clusters(mkv_d, s, target_tc, NULL);
+    if (s->eof)
+        stream_reset(s);
+    stream_seek(s, pos);
+}
+
+#ifdef HAVE_PTHREADS
+/* Reads the deferred Cues, or scans the whole file if there are none, on a
+ * separate stream after opening, so that seeks need no scanning. The result
+ * is merged into the demuxer's index by merge_index_scan(). */
+struct index_scan {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    bool cancel;
+    bool done;
+    struct stream *stream;
+    struct mkv_demuxer *index;  // only index fields, tc_scale and
+                                // segment_start are used
+    uint64_t start;             // where the scan started
+};
+
+static bool index_scan_cancelled(struct index_scan *scan)
+{
+    pthread_mutex_lock(&scan->lock);
+    bool cancel = scan->cancel;
+    pthread_mutex_unlock(&scan->lock);
+    return cancel;
+}
+
+static void *index_scan_thread(void *arg)
+{
+    struct index_scan *scan = arg;
+    struct mkv_demuxer *index = scan->index;
+    if (index->cues_pos) {
+        read_cues(index, scan->stream, scan);
+        index->index_complete = !index->cues_pos;
+    } else {
+        index_scan_clusters(index, scan->stream, UINT64_MAX, scan);
+    }
+    pthread_mutex_lock(&scan->lock);
+    scan->done = index->index_complete;
+    pthread_mutex_unlock(&scan->lock);
+    return NULL;
+}
+
+static void start_index_scan(struct demuxer *demuxer)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    struct stream *s = demuxer->stream;
+    if (!demuxer->opts->mkv_index_scan || mkv_d->index_complete ||
+        !(mkv_d->index_generated || mkv_d->cues_pos) ||
+        s->type != STREAMTYPE_FILE || !demuxer->filename)
+        return;
+    int file_format = DEMUXER_TYPE_UNKNOWN;
+    struct stream *stream = open_stream(demuxer->filename, demuxer->opts,
+                                        &file_format);
+    if (!stream)
+        return;
+    struct index_scan *scan = talloc_zero(NULL, struct index_scan);
+    scan->stream = stream;
+    scan->start = mkv_d->index_end;
+    scan->index = talloc_zero(scan, struct mkv_demuxer);
+    scan->index->tc_scale = mkv_d->tc_scale;
+    scan->index->segment_start = mkv_d->segment_start;
+    scan->index->cues_pos = mkv_d->cues_pos;
+    scan->index->index_generated = mkv_d->index_generated;
+    scan->index->index_end = mkv_d->index_end;
+    pthread_mutex_init(&scan->lock, NULL);
+    if (pthread_create(&scan->thread, NULL, index_scan_thread, scan)) {
+        pthread_mutex_destroy(&scan->lock);
+        free_stream(stream);
+        talloc_free(scan);
+        return;
+    }
+    mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] %s in the background.\n",
+           mkv_d->cues_pos ? "Reading Cues" : "No Cues, indexing file");
+    mkv_d->index_scan = scan;
+}
+
+// If the background scan has finished (or if force is set), stop it, and
+// use its index if it covers more of the file (or if it read all Cues).
+static void merge_index_scan(struct demuxer *demuxer, bool force)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    struct index_scan *scan = mkv_d->index_scan;
+    if (!scan)
+        return;
+    pthread_mutex_lock(&scan->lock);
+    bool done = scan->done;
+    if (done || force)
+        scan->cancel = true;
+    pthread_mutex_unlock(&scan->lock);
+    if (!done && !force)
+        return;
+    pthread_join(scan->thread, NULL);
+    struct mkv_demuxer *index = scan->index;
+    if (!index->index_generated) {
+        if (done) {
+            mkv_d->indexes = talloc_steal(mkv_d, index->indexes);
+            mkv_d->num_indexes = index->num_indexes;
+            mkv_d->cues_pos = 0;
+            mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] Read %d cue points in the "
+                   "background.\n", mkv_d->num_indexes);
         }
+    } else if (index->index_end > mkv_d->index_end) {
+        int n = 0;
+        while (n < mkv_d->num_indexes &&
+               mkv_d->indexes[n].filepos < scan->start)
+            n++;
+        mkv_d->num_indexes = n;
+        for (int i = 0; i < index->num_indexes; i++)
+            MP_TARRAY_APPEND(mkv_d, mkv_d->indexes, mkv_d->num_indexes,
+                             index->indexes[i]);
+        mkv_d->index_end = index->index_end;
+        mkv_d->index_tc = index->index_tc;
+        mkv_d->index_complete = index->index_complete;
+        mkv_d->index_cluster = false;
+        mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] Background indexing %s, %d "
+               "index entries.\n", done ? "finished" : "stopped",
+               mkv_d->num_indexes);
+    }
+    free_stream(scan->stream);
+    pthread_mutex_destroy(&scan->lock);
+    talloc_free(scan);
+    mkv_d->index_scan = NULL;
+}
+#else
+static bool index_scan_cancelled(struct index_scan *scan)
+{
+    return false;
+}
+
+static void start_index_scan(struct demuxer *demuxer)
+{
+}
+
+static void merge_index_scan(struct demuxer *demuxer, bool force)
+{
+}
+#endif
+
+/* The generated index is cached in ~/.mpv/mkv-index/, in a file named after
+ * the MD5 of the absolute path of the video. It's only used if the size and
+ * the modification time of the video still match.
+ * Layout (little endian): magic, size, mtime, tc_scale, segment_start,
+ * index_end, index_tc, complete flag (all 64 bit), number of entries
+ * (32 bit), and the entries (32 bit track number, 64 bit timecode in
+ * tc_scale units, 64 bit cluster position). */
+#define INDEX_CACHE_MAGIC "mpvmkvi1"
+#define INDEX_CACHE_HEADER_SIZE (8 * 8 + 4)
+#define INDEX_CACHE_ENTRY_SIZE (4 + 8 + 8)
+
+static char *index_cache_file(struct demuxer *demuxer, struct stat *st)
+{
+    struct stream *s = demuxer->stream;
+    if (!demuxer->opts->mkv_index_cache || s->type != STREAMTYPE_FILE ||
+        !demuxer->filename)
+        return NULL;
+    if (mp_stat(demuxer->filename, st) < 0 || !S_ISREG(st->st_mode))
+        return NULL;
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd)))
+        return NULL;
+    char *path = mp_path_join(NULL, bstr0(cwd), bstr0(demuxer->filename));
+    uint8_t md5[16];
+    av_md5_sum(md5, path, strlen(path));
+    talloc_free(path);
+    char name[sizeof(md5) * 2 + 1];
+    for (int i = 0; i < sizeof(md5); i++)
+        snprintf(name + i * 2, 3, "%02x", md5[i]);
+    char *dir = mp_find_user_config_file("mkv-index");
+    if (!dir)
+        return NULL;
+    char *file = mp_path_join(NULL, bstr0(dir), bstr0(name));
+    talloc_free(dir);
+    return file;
+}
+
+static void load_index_cache(struct demuxer *demuxer)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    struct stat st;
+    if (index_mode == 2)
+        return;
+    char *file = index_cache_file(demuxer, &st);
+    if (!file)
+        return;
+    FILE *f = fopen(file, "rb");
+    if (!f)
+        goto out;
+    uint8_t hdr[INDEX_CACHE_HEADER_SIZE];
+    if (fread(hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr, INDEX_CACHE_MAGIC, 8) != 0 ||
+        AV_RL64(hdr + 8) != st.st_size ||
+        AV_RL64(hdr + 16) != st.st_mtime ||
+        AV_RL64(hdr + 24) != mkv_d->tc_scale ||
+        AV_RL64(hdr + 32) != mkv_d->segment_start) {
+        mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] Index cache %s is outdated.\n",
+               file);
+        goto out;
+    }
+    uint32_t num = AV_RL32(hdr + 64);
+    if (num > INT_MAX / sizeof(mkv_index_t))
+        goto out;
+    mkv_index_t *indexes = talloc_array(mkv_d, mkv_index_t, num);
+    for (uint32_t i = 0; i < num; i++) {
+        uint8_t e[INDEX_CACHE_ENTRY_SIZE];
+        if (fread(e, sizeof(e), 1, f) != 1) {
+            talloc_free(indexes);
+            goto out;
+        }
+        indexes[i] = (mkv_index_t){
+            .tnum = AV_RL32(e),
+            .timecode = AV_RL64(e + 4),
+            .filepos = AV_RL64(e + 12),
+        };
+    }
+    talloc_free(mkv_d->indexes);
+    mkv_d->indexes = indexes;
+    mkv_d->num_indexes = num;
+    mkv_d->index_end = mkv_d->index_saved_end = AV_RL64(hdr + 40);
+    mkv_d->index_tc = AV_RL64(hdr + 48);
+    mkv_d->index_complete = AV_RL64(hdr + 56);
+    mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] Loaded %d index entries from %s.\n",
+           mkv_d->num_indexes, file);
+ out:
+    if (f)
+        fclose(f);
+    talloc_free(file);
+}
+
+static void save_index_cache(struct demuxer *demuxer)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    struct stat st;
+    if (mkv_d->index_end <= mkv_d->index_saved_end || !mkv_d->num_indexes)
+        return;
+    char *file = index_cache_file(demuxer, &st);
+    if (!file)
+        return;
+    char *dir = mp_find_user_config_file("mkv-index");
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        mp_msg(MSGT_DEMUX, MSGL_WARN, "[mkv] Can't create %s: %s\n", dir,
+               strerror(errno));
+    talloc_free(dir);
+    char *tmp = talloc_asprintf(NULL, "%s.tmp", file);
+    FILE *f = fopen(tmp, "wb");
+    if (!f)
+        goto out;
+    uint8_t hdr[INDEX_CACHE_HEADER_SIZE];
+    memcpy(hdr, INDEX_CACHE_MAGIC, 8);
+    AV_WL64(hdr + 8, st.st_size);
+    AV_WL64(hdr + 16, st.st_mtime);
+    AV_WL64(hdr + 24, mkv_d->tc_scale);
+    AV_WL64(hdr + 32, mkv_d->segment_start);
+    AV_WL64(hdr + 40, mkv_d->index_end);
+    AV_WL64(hdr + 48, mkv_d->index_tc);
+    AV_WL64(hdr + 56, mkv_d->index_complete);
+    AV_WL32(hdr + 64, mkv_d->num_indexes);
+    bool ok = fwrite(hdr, sizeof(hdr), 1, f) == 1;
+    for (int i = 0; i < mkv_d->num_indexes && ok; i++) {
+        uint8_t e[INDEX_CACHE_ENTRY_SIZE];
+        AV_WL32(e, mkv_d->indexes[i].tnum);
+        AV_WL64(e + 4, mkv_d->indexes[i].timecode);
+        AV_WL64(e + 12, mkv_d->indexes[i].filepos);
+        ok = fwrite(e, sizeof(e), 1, f) == 1;
+    }
+    if (fclose(f) != 0)
+        ok = false;
+    if (ok && rename(tmp, file) == 0) {
+        mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] Saved %d index entries to %s.\n",
+               mkv_d->num_indexes, file);
+    } else {
+        mp_msg(MSGT_DEMUX, MSGL_WARN, "[mkv] Can't write index cache %s.\n",
+               file);
+        unlink(tmp);
+    }
+ out:
+    talloc_free(tmp);
+    talloc_free(file);
+}
+
+// Read the Cues skipped when opening the file, unless the background thread
+// already did. If they turn out to be missing or broken, index the file.
+static void load_cues(struct demuxer *demuxer)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    struct stream *s = demuxer->stream;
+    if (!mkv_d->cues_pos)
+        return;
+    merge_index_scan(demuxer, true);
+    if (mkv_d->cues_pos) {
+        int64_t pos = stream_tell(s);
+        read_cues(mkv_d, s, NULL);
+        if (s->eof)
+            stream_reset(s);
+        stream_seek(s, pos);
+    }
+    if (!mkv_d->num_indexes) {
+        mp_msg(MSGT_DEMUX, MSGL_WARN, "[mkv] No usable Cues, indexing file "
+               "instead.\n");
+        use_generated_index(demuxer);
     }
-    mkv_d->cluster_size = mkv_d->blockgroup_size = 0;
-    stream_seek(s, cluster_pos);
-    return 0;
 }
 
 static struct mkv_index *seek_with_cues(struct demuxer *demuxer, int seek_id,
@@ -2401,6 +2849,8 @@ static void demux_mkv_seek(demuxer_t *demuxer, float rel_seek_secs,
     // specifies a keyframe with high, but not perfect, precision.
     rel_seek_secs += flags & SEEK_FORWARD ? -0.005 : 0.005;
 
+    load_cues(demuxer);
+
     if (!(flags & SEEK_FACTOR)) {       /* time in secs */
         mkv_index_t *index = NULL;
 
@@ -2409,16 +2859,18 @@ static void demux_mkv_seek(demuxer_t *demuxer, float rel_seek_secs,
         rel_seek_secs = FFMAX(rel_seek_secs, 0);
         int64_t target_timecode = rel_seek_secs * 1e9 + 0.5;
 
+        if (mkv_d->index_generated) {
+            merge_index_scan(demuxer, false);
+            extend_index(demuxer, target_timecode);
+        }
         if (mkv_d->indexes == NULL) {   /* no index was found */
-            if (seek_creating_index(demuxer, rel_seek_secs, flags) < 0)
-                return;
-        } else {
-            int seek_id = (demuxer->video->id < 0) ?
-                a_tnum : v_tnum;
-            index = seek_with_cues(demuxer, seek_id, target_timecode, flags);
-            if (!index)
-                index = seek_with_cues(demuxer, -1, target_timecode, flags);
+            mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] no target for seek found\n");
+            return;
         }
+        int seek_id = (demuxer->video->id < 0) ? a_tnum : v_tnum;
+        index = seek_with_cues(demuxer, seek_id, target_timecode, flags);
+        if (!index)
+            index = seek_with_cues(demuxer, -1, target_timecode, flags);
 
         if (demuxer->video->id >= 0)
             mkv_d->v_skip_to_keyframe = 1;
@@ -30,6 +30,7 @@ typedef struct demux_packet {
     double stream_pts;
     int64_t pos; // position in index (AVI) or file (MPG)
     unsigned char *buffer;
+    int buffer_class; // packet pool size class of buffer, -1 if not pooled
     bool keyframe;
     int refcount; // counter for the master packet, if 0, buffer can be free()d
     struct demux_packet *master; //in clones, pointer to the master packet
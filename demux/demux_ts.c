@@ -50,6 +50,11 @@
 #define NUM_CONSECUTIVE_AUDIO_PACKETS 348
 #define MAX_A52_FRAME_SIZE 3840
 
+#define TS_INDEX_INTERVAL 0.5			/* min. seconds between index entries */
+#define TS_INDEX_MAX_REORDER 1.0		/* PTS going back more than this is a discontinuity */
+#define TS_INDEX_PROBE_BYTES (2*1024*1024)	/* max. bytes read to find a PTS when seeking */
+#define TS_INDEX_MAX_PROBES 32
+
 #ifndef SIZE_MAX
 #define SIZE_MAX ((size_t)-1)
 #endif
@@ -228,6 +233,11 @@ typedef struct {
 	double last_pts;
 } TS_stream_info;
 
+typedef struct {
+	int64_t pos;		// start of the TS packet containing the PES header
+	double pts;
+} ts_index_t;
+
 typedef struct {
 	MpegTSContext ts;
 	int last_pid;
@@ -243,6 +253,12 @@ typedef struct {
 	int last_sid;
 	char packet[TS_FEC_PACKET_SIZE];
 	TS_stream_info vstr, astr;
+	ts_index_t *index;	// PTS samples of index_pid, sorted by position (and PTS)
+	int index_cnt, index_alloc;
+	int index_pid;		// video PID, or audio PID if there's no video
+	int index_broken;	// PTS discontinuity found, don't use the index
+	uint8_t discard[NB_PID_MAX / 8];	// bitmap of PIDs skipped right after the TS header
+	int discard_sel[4];	// selected streams and program the bitmap is valid for
 } ts_priv_t;
 
 
@@ -297,6 +313,7 @@ static int IS_SUB(es_stream_type_t type)
 }
 
 static int ts_parse(demuxer_t *demuxer, ES_stream_t *es, unsigned char *packet, int probe);
+static void ts_index_add(ts_priv_t *priv, int pid, int64_t pos, double pts);
 
 static uint8_t get_packet_size(const unsigned char *buf, int size)
 {
@@ -1018,6 +1035,7 @@ static demuxer_t *demux_open_ts(demuxer_t * demuxer)
 
 	priv->keep_broken = ts_keep_broken;
 	priv->ts.packet_size = packet_size;
+	priv->index_pid = -1;
 
 
 	demuxer->priv = priv;
@@ -1136,6 +1154,7 @@ static void demux_close_ts(demuxer_t * demuxer)
 				free_demux_packet(priv->fifo[i].pack);
 			priv->fifo[i].pack = NULL;
 		}
+		free(priv->index);
 		free(priv);
 	}
 	demuxer->priv=NULL;
@@ -1640,8 +1659,20 @@ static int ts_sync(stream_t *stream)
 	mp_msg(MSGT_DEMUX, MSGL_DBG3, "TS_SYNC \n");
 
 	while (!stream->eof)
+	{
+		int len;
+		unsigned char *buf = stream_buffered_data(stream, &len);
+		unsigned char *p = memchr(buf, 0x47, len);
+
+		if (p)
+		{
+			stream_skip(stream, p - buf + 1);
+			return 1;
+		}
+		stream_skip(stream, len);
 		if (stream_read_char(stream) == 0x47)
 			return 1;
+	}
 
 	return 0;
 }
@@ -2459,6 +2490,7 @@ static int parse_pmt(ts_priv_t * priv, uint16_t progid, uint16_t pid, int is_sta
 	pmt->table_id = base[0];
 	if(pmt->table_id != 2)
 		return -1;
+	memset(priv->discard, 0, sizeof(priv->discard));	// the streams may have changed
 	pmt->ssi = base[1] & 0x80;
 	pmt->section_length = (((base[1] & 0xf) << 8 ) | base[2]);
 	pmt->version_number = (base[5] >> 1) & 0x1f;
@@ -2771,6 +2803,58 @@ static int fill_extradata(mp4_decoder_config_t * mp4_dec, ES_stream_t *tss)
 
 // 0 = EOF or no stream found
 // else = [-] number of bytes written to the packet
+/* Whether packets of the given PID can be skipped without looking at them:
+ * true for audio, video and subtitle streams that are known but not selected,
+ * unless they carry the PCR. */
+static int ts_discard_pid(demuxer_t *demuxer, ES_stream_t *tss, int pid)
+{
+	ts_priv_t *priv = (ts_priv_t*) demuxer->priv;
+	sh_sub_t *sh_sub = demuxer->sub->sh;
+	int type = tss->type;
+
+	if(!priv->ts.streams[pid].sh || pid == prog_pcr_pid(priv, priv->prog))
+		return 0;
+	if(IS_VIDEO(type))
+		return demuxer->video->id != priv->ts.streams[pid].id;
+	if(IS_AUDIO(type) || type == PES_PRIVATE1)
+		return demuxer->audio->id != priv->ts.streams[pid].id;
+	if(IS_SUB(type))
+		return !sh_sub || sh_sub->sid != pid;
+	return 0;
+}
+
+// Skip the packets of discarded PIDs that are already in the stream buffer.
+static void ts_skip_discarded(demuxer_t *demuxer)
+{
+	ts_priv_t *priv = (ts_priv_t*) demuxer->priv;
+	stream_t *stream = demuxer->stream;
+	sh_sub_t *sh_sub = demuxer->sub->sh;
+	int sel[4] = {demuxer->video->id, demuxer->audio->id, sh_sub ? sh_sub->sid : -1, priv->prog};
+	unsigned char *buf, *p;
+	int len;
+
+	if(memcmp(sel, priv->discard_sel, sizeof(sel)))
+	{
+		memset(priv->discard, 0, sizeof(priv->discard));
+		memcpy(priv->discard_sel, sel, sizeof(sel));
+		return;
+	}
+
+	buf = stream_buffered_data(stream, &len);
+	for(p = buf; p + priv->ts.packet_size <= buf + len; p += priv->ts.packet_size)
+	{
+		int pid = ((p[1] & 0x1f) << 8) | p[2];
+		ES_stream_t *tss = priv->ts.pids[pid];
+
+		if(p[0] != 0x47 || !(priv->discard[pid >> 3] & (1 << (pid & 7))))
+			break;
+		if(p[1] & 0x40)
+			tss->is_synced = 1;
+		tss->last_cc = p[3] & 0xf;
+	}
+	stream_skip(stream, p - buf);
+}
+
 static int ts_parse(demuxer_t *demuxer , ES_stream_t *es, unsigned char *packet, int probe)
 {
 	ES_stream_t *tss;
@@ -2816,6 +2900,8 @@ static int ts_parse(demuxer_t *demuxer , ES_stream_t *es, unsigned char *packet,
 			return 0;
 		}
 
+		if(! probe)
+			ts_skip_discarded(demuxer);
 
 		if(! ts_sync(stream))
 		{
@@ -2868,6 +2954,13 @@ static int ts_parse(demuxer_t *demuxer , ES_stream_t *es, unsigned char *packet,
 			continue;
 		}
 
+		if(! probe && ts_discard_pid(demuxer, tss, pid))
+		{
+			priv->discard[pid >> 3] |= 1 << (pid & 7);
+			stream_skip(stream, buf_size+junk);
+			continue;
+		}
+
 
 		afc = (packet[3] >> 4) & 3;
 		if(! (afc % 2))	//no payload in this TS packet
@@ -3123,7 +3216,11 @@ static int ts_parse(demuxer_t *demuxer , ES_stream_t *es, unsigned char *packet,
 				if(es->pts == 0.0)
 					es->pts = tss->pts = tss->last_pts;
 				else
+				{
 					tss->pts = tss->last_pts = es->pts;
+					if(ds == demuxer->video || (ds == demuxer->audio && !demuxer->video->sh))
+						ts_index_add(priv, pid, stream_tell(stream) - priv->ts.packet_size, es->pts);
+				}
 
 				mp_msg(MSGT_DEMUX, MSGL_DBG2, "ts_parse, NEW pid=%d, PSIZE: %u, type=%X, start=%p, len=%d\n",
 					es->pid, es->payload_size, es->type, es->start, es->size);
@@ -3245,6 +3342,173 @@ static void reset_fifos(demuxer_t *demuxer, int a, int v, int s)
 }
 
 
+//returns the number of index entries before pos
+static int ts_index_find(ts_priv_t *priv, int64_t pos)
+{
+	int lo = 0, hi = priv->index_cnt;
+
+	while(lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if(priv->index[mid].pos < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Record that the PES packet starting at pos has the given PTS. The index
+ * is filled while playing and while seeking, so it can have gaps; entries
+ * are kept at least TS_INDEX_INTERVAL apart. */
+static void ts_index_add(ts_priv_t *priv, int pid, int64_t pos, double pts)
+{
+	ts_index_t *prev, *next;
+	int i;
+
+	if(pid != priv->index_pid)
+	{
+		priv->index_cnt = 0;
+		priv->index_broken = 0;
+		priv->index_pid = pid;
+	}
+	if(priv->index_broken)
+		return;
+
+	i = ts_index_find(priv, pos);
+	prev = i > 0 ? &priv->index[i-1] : NULL;
+	next = i < priv->index_cnt ? &priv->index[i] : NULL;
+	if((prev && pts < prev->pts - TS_INDEX_MAX_REORDER) || (next && pts > next->pts + TS_INDEX_MAX_REORDER))
+	{
+		mp_msg(MSGT_DEMUX, MSGL_V, "TS_INDEX: PTS discontinuity at %"PRId64", not using the index anymore\n", pos);
+		priv->index_broken = 1;
+		return;
+	}
+	if((prev && pts - prev->pts < TS_INDEX_INTERVAL) || (next && next->pts - pts < TS_INDEX_INTERVAL))
+		return;
+
+	if(priv->index_cnt == priv->index_alloc)
+	{
+		int alloc = priv->index_alloc ? priv->index_alloc * 2 : 1024;
+		ts_index_t *index = realloc_struct(priv->index, alloc, sizeof(ts_index_t));
+		if(!index)
+			return;
+		priv->index = index;
+		priv->index_alloc = alloc;
+	}
+	memmove(&priv->index[i+1], &priv->index[i], (priv->index_cnt - i) * sizeof(ts_index_t));
+	priv->index[i].pos = pos;
+	priv->index[i].pts = pts;
+	priv->index_cnt++;
+}
+
+/* Find the first PES packet of pid at or after pos, and return the position
+ * of its TS packet and its PTS. Reads at most TS_INDEX_PROBE_BYTES. Returns
+ * -1 if nothing was found. */
+static int64_t ts_index_probe(demuxer_t *demuxer, int pid, int64_t pos, double *pts)
+{
+	ts_priv_t *priv = demuxer->priv;
+	stream_t *stream = demuxer->stream;
+	unsigned char buf[TS_PACKET_SIZE];
+	int64_t end = pos + TS_INDEX_PROBE_BYTES;
+
+	stream_seek(stream, pos);
+	while(stream_tell(stream) < end && ts_sync(stream))
+	{
+		int64_t pkt_pos = stream_tell(stream) - 1;
+		unsigned char *p = &buf[4];
+		int afc;
+
+		if(stream_read(stream, &buf[1], TS_PACKET_SIZE - 1) != TS_PACKET_SIZE - 1)
+			break;
+		stream_skip(stream, priv->ts.packet_size - TS_PACKET_SIZE);
+
+		if(!(buf[1] & 0x40) || (((buf[1] & 0x1f) << 8) | buf[2]) != pid)
+			continue;
+		afc = (buf[3] >> 4) & 3;
+		if(!(afc & 1))
+			continue;
+		if(afc & 2)
+			p += buf[4] + 1;
+		if(p + 14 > &buf[TS_PACKET_SIZE])
+			continue;
+		if(p[0] || p[1] || p[2] != 1 || !(p[7] & 0x80))
+			continue;
+
+		*pts = (((int64_t)(p[9] & 0x0E) << 29) | (p[10] << 22) | ((p[11] & 0xFE) << 14) |
+			(p[12] << 7) | ((p[13] & 0xFE) >> 1)) / 90000.0;
+		ts_index_add(priv, pid, pkt_pos, *pts);
+		return pkt_pos;
+	}
+	return -1;
+}
+
+/* Find the position of the last indexed PES packet with a PTS not after
+ * target. Gaps in the index around the target are narrowed down by probing
+ * the file, interpolating between the neighbouring entries. Returns -1 if
+ * the index can't be used. */
+static int64_t ts_index_seek(demuxer_t *demuxer, double target)
+{
+	ts_priv_t *priv = demuxer->priv;
+	int pid = priv->index_pid;
+	ts_index_t lo, hi;
+	int64_t pos;
+	double pts;
+	int i, probes;
+
+	if(pid < 0 || priv->index_broken || demuxer->movi_end <= demuxer->movi_start)
+		return -1;
+
+	// make sure the index covers the start and the end of the file
+	if(!priv->index_cnt || priv->index[0].pos > demuxer->movi_start + TS_INDEX_PROBE_BYTES)
+		ts_index_probe(demuxer, pid, demuxer->movi_start, &pts);
+	if(priv->index_cnt && priv->index[priv->index_cnt-1].pos < demuxer->movi_end - 2 * TS_INDEX_PROBE_BYTES)
+		ts_index_probe(demuxer, pid, FFMAX(demuxer->movi_end - TS_INDEX_PROBE_BYTES, demuxer->movi_start), &pts);
+	if(!priv->index_cnt || priv->index_broken)
+		return -1;
+
+	//the index is sorted by PTS as well
+	for(i = 0; i < priv->index_cnt && priv->index[i].pts <= target; i++)
+		;
+	if(i == 0)
+		return priv->index[0].pos;
+	if(i == priv->index_cnt)
+		return priv->index[i-1].pos;
+	lo = priv->index[i-1];
+	hi = priv->index[i];
+
+	for(probes = 0; probes < TS_INDEX_MAX_PROBES && hi.pts - lo.pts > 2 * TS_INDEX_INTERVAL; probes++)
+	{
+		int64_t span = hi.pos - lo.pos;
+		if(span <= TS_INDEX_PROBE_BYTES / 16)
+			break;
+		// interpolate, but bisect every other time in case the bitrate varies a lot
+		if(probes & 1)
+			pos = lo.pos + span / 2;
+		else
+			pos = lo.pos + (int64_t)((target - lo.pts) / (hi.pts - lo.pts) * span);
+		pos = FFMIN(FFMAX(pos, lo.pos + span / 16), hi.pos - span / 16);
+		pos = ts_index_probe(demuxer, pid, pos, &pts);
+		if(priv->index_broken)
+			return -1;
+		if(pos < 0 || pos >= hi.pos)
+			break;		// no PES start between pos and hi
+		if(pts <= target)
+		{
+			lo.pos = pos;
+			lo.pts = pts;
+		}
+		else
+		{
+			hi.pos = pos;
+			hi.pts = pts;
+		}
+	}
+	mp_msg(MSGT_DEMUX, MSGL_V, "TS_INDEX: seek to %.3f, pos %"PRId64" (PTS %.3f), %d probes, %d entries\n",
+		target, lo.pos, lo.pts, probes, priv->index_cnt);
+	return lo.pos;
+}
+
 static void demux_seek_ts(demuxer_t *demuxer, float rel_seek_secs, float audio_delay, int flags)
 {
 	demux_stream_t *d_audio=demuxer->audio;
@@ -3286,6 +3550,19 @@ static void demux_seek_ts(demuxer_t *demuxer, float rel_seek_secs, float audio_d
 			newpos += video_stats*rel_seek_secs;
 	}
 
+	// the PTS index is exact if it can be used
+	if(!(flags & SEEK_FACTOR) && priv->index_pid >= 0 && priv->ts.pids[priv->index_pid])
+	{
+		double target = rel_seek_secs;
+		int64_t pos;
+
+		if(!(flags & SEEK_ABSOLUTE))
+			target += priv->ts.pids[priv->index_pid]->last_pts;
+		pos = ts_index_seek(demuxer, target);
+		if(pos >= 0)
+			newpos = pos;
+	}
+
 
 	if(newpos < demuxer->movi_start)
   		newpos = demuxer->movi_start;	//begininng of stream
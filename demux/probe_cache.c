@@ -0,0 +1,190 @@
+/*
+ * This file is part of MPlayer.
+ *
+ * MPlayer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * MPlayer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with MPlayer; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Cache of probing results, stored in ~/.mpv/probe-cache/, one file per
+ * stream, named after the MD5 of its URL (made absolute for local files).
+ * Each file is a list of "key=value" lines. An entry is only used if the
+ * URL, the stream size and, for local files, the modification time still
+ * match. The caller is responsible for validating the cached results and
+ * for falling back to normal probing if they turn out to be wrong.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <libavutil/md5.h>
+
+#include "talloc.h"
+#include "core/mp_msg.h"
+#include "core/bstr.h"
+#include "core/path.h"
+#include "osdep/io.h"
+#include "stream/stream.h"
+#include "probe_cache.h"
+
+#define CACHE_DIR "probe-cache"
+#define MAX_CACHE_FILE_SIZE (1024 * 1024)
+
+struct cache_key {
+    char *url;
+    int64_t size;
+    int64_t mtime;
+};
+
+// Return the name of the cache file for the stream, or NULL if the stream
+// can't be cached.
+static char *cache_file(void *ctx, struct stream *stream, struct cache_key *k)
+{
+    if (!stream->url || stream->end_pos <= 0)
+        return NULL;
+    *k = (struct cache_key) {
+        .url = talloc_strdup(ctx, stream->url),
+        .size = stream->end_pos,
+    };
+    if (stream->type == STREAMTYPE_FILE) {
+        struct bstr path = bstr0(stream->url);
+        bstr_eatstart0(&path, "file://");
+        char *p = bstrdup0(ctx, path);
+        struct stat st;
+        if (mp_stat(p, &st) < 0)
+            return NULL;
+        k->mtime = st.st_mtime;
+        char cwd[4096];
+        if (!getcwd(cwd, sizeof(cwd)))
+            return NULL;
+        k->url = mp_path_join(ctx, bstr0(cwd), path);
+    }
+    uint8_t md5[16];
+    av_md5_sum(md5, k->url, strlen(k->url));
+    char name[sizeof(md5) * 2 + 1];
+    for (int i = 0; i < sizeof(md5); i++)
+        snprintf(name + i * 2, 3, "%02x", md5[i]);
+    char *dir = mp_find_user_config_file(CACHE_DIR);
+    if (!dir)
+        return NULL;
+    char *file = mp_path_join(ctx, bstr0(dir), bstr0(name));
+    talloc_free(dir);
+    return file;
+}
+
+struct probe_cache_entry *probe_cache_load(void *talloc_ctx,
+                                           struct stream *stream)
+{
+    void *tmp = talloc_new(NULL);
+    struct probe_cache_entry *e = NULL;
+    struct cache_key k;
+    char *file = cache_file(tmp, stream, &k);
+    if (!file)
+        goto done;
+    FILE *f = fopen(file, "rb");
+    if (!f)
+        goto done;
+    char *buf = talloc_size(tmp, MAX_CACHE_FILE_SIZE);
+    size_t len = fread(buf, 1, MAX_CACHE_FILE_SIZE, f);
+    fclose(f);
+
+    e = talloc_zero(talloc_ctx, struct probe_cache_entry);
+    bool url_ok = false, size_ok = false, mtime_ok = false;
+    struct bstr data = {buf, len};
+    while (data.len) {
+        struct bstr line = bstr_strip_linebreaks(bstr_getline(data, &data));
+        struct bstr val;
+        struct bstr key = bstr_split(line, "=", &val);
+        if (!bstr_eatstart0(&val, "="))
+            continue;
+        if (bstr_equals0(key, "url")) {
+            url_ok = bstr_equals0(val, k.url);
+        } else if (bstr_equals0(key, "size")) {
+            size_ok = bstrtoll(val, NULL, 10) == k.size;
+        } else if (bstr_equals0(key, "mtime")) {
+            mtime_ok = bstrtoll(val, NULL, 10) == k.mtime;
+        } else if (bstr_equals0(key, "demuxer")) {
+            e->demuxer = bstrdup0(e, val);
+        } else if (bstr_equals0(key, "lavf-format")) {
+            e->lavf_format = bstrdup0(e, val);
+        } else if (bstr_equals0(key, "lavf-streams")) {
+            e->lavf_streams = bstrdup0(e, val);
+        }
+    }
+    if (!url_ok || !size_ok || !mtime_ok || !e->demuxer) {
+        mp_msg(MSGT_DEMUXER, MSGL_V, "Probe cache entry %s is outdated.\n",
+               file);
+        talloc_free(e);
+        e = NULL;
+        goto done;
+    }
+    mp_msg(MSGT_DEMUXER, MSGL_V, "Using probe cache entry %s.\n", file);
+
+done:
+    talloc_free(tmp);
+    return e;
+}
+
+void probe_cache_save(struct stream *stream, struct probe_cache_entry *e)
+{
+    void *tmp = talloc_new(NULL);
+    struct cache_key k;
+    char *file = cache_file(tmp, stream, &k);
+    if (!file || !e->demuxer)
+        goto done;
+    char *dir = mp_find_user_config_file(CACHE_DIR);
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        mp_msg(MSGT_DEMUXER, MSGL_WARN, "Can't create %s: %s\n", dir,
+               strerror(errno));
+    talloc_free(dir);
+    char *tmpfile = talloc_asprintf(tmp, "%s.tmp", file);
+    FILE *f = fopen(tmpfile, "wb");
+    if (!f)
+        goto done;
+    fprintf(f, "url=%s\nsize=%"PRId64"\nmtime=%"PRId64"\ndemuxer=%s\n",
+            k.url, k.size, k.mtime, e->demuxer);
+    if (e->lavf_format)
+        fprintf(f, "lavf-format=%s\n", e->lavf_format);
+    if (e->lavf_streams)
+        fprintf(f, "lavf-streams=%s\n", e->lavf_streams);
+    bool ok = !ferror(f);
+    if (fclose(f) != 0)
+        ok = false;
+    if (ok && rename(tmpfile, file) == 0) {
+        mp_msg(MSGT_DEMUXER, MSGL_V, "Saved probe cache entry %s.\n", file);
+        e->dirty = false;
+    } else {
+        mp_msg(MSGT_DEMUXER, MSGL_WARN, "Can't write probe cache entry %s.\n",
+               file);
+        unlink(tmpfile);
+    }
+
+done:
+    talloc_free(tmp);
+}
+
+void probe_cache_remove(struct stream *stream)
+{
+    void *tmp = talloc_new(NULL);
+    struct cache_key k;
+    char *file = cache_file(tmp, stream, &k);
+    if (file)
+        unlink(file);
+    talloc_free(tmp);
+}
@@ -0,0 +1,43 @@
+/*
+ * This file is part of MPlayer.
+ *
+ * MPlayer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * MPlayer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with MPlayer; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef MPLAYER_PROBE_CACHE_H
+#define MPLAYER_PROBE_CACHE_H
+
+#include <stdbool.h>
+
+struct stream;
+
+// What was found out when opening a file (see --probe-cache). All strings
+// are allocated as talloc children of the entry.
+struct probe_cache_entry {
+    char *demuxer;      // demuxer_desc.name
+    char *lavf_format;  // AVInputFormat.name, if demux_lavf was used
+    // Parameters of the streams as read from the file header by demux_lavf.
+    // Only set if avformat_find_stream_info() didn't change any of them, so
+    // it can be skipped if the header still yields the same parameters.
+    char *lavf_streams;
+    bool dirty;         // needs to be written
+};
+
+struct probe_cache_entry *probe_cache_load(void *talloc_ctx,
+                                           struct stream *stream);
+void probe_cache_save(struct stream *stream, struct probe_cache_entry *e);
+void probe_cache_remove(struct stream *stream);
+
+#endif /* MPLAYER_PROBE_CACHE_H */
@@ -136,7 +136,7 @@ typedef struct sh_video {
     double i_pts;   // PTS for the _next_ I/P frame (internal mpeg demuxing)
     float next_frame_time;
     double last_pts;
-    double buffered_pts[32];
+    double buffered_pts[128]; // enough for --video-decode-ahead plus codec lag
     int num_buffered_pts;
     double codec_reordered_pts;
     double prev_codec_reordered_pts;
@@ -152,6 +152,8 @@ typedef struct sh_video {
     float stream_aspect;  // aspect ratio in media headers (DVD IFO files)
     int i_bps;            // == bitrate  (compressed bytes/sec)
     int disp_w, disp_h;   // display size (filled by demuxer)
+    int disp_shift;       // if the decoder reduces the resolution, the size
+                          // to display at is (disp_w, disp_h) << disp_shift
     int colorspace;       // mp_csp
     int color_range;      // mp_csp_levels
     // output driver/filters: (set by libmpcodecs core)
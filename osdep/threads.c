@@ -0,0 +1,37 @@
+/*
+ * This file is part of MPlayer.
+ *
+ * MPlayer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * MPlayer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with MPlayer; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/time.h>
+#include <errno.h>
+
+#include "threads.h"
+
+// Wait on the condition for at most timeout seconds. The mutex must be
+// locked. Returns 0 if woken up, ETIMEDOUT if the timeout elapsed.
+int mpthread_cond_timed_wait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                             double timeout)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    long long usec = (long long)tv.tv_usec + (long long)(timeout * 1000000);
+    struct timespec ts = {
+        .tv_sec  = tv.tv_sec + usec / 1000000,
+        .tv_nsec = (usec % 1000000) * 1000,
+    };
+    return pthread_cond_timedwait(cond, mutex, &ts);
+}
@@ -16,265 +16,690 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
-// Initial draft of my new cache system...
-// Note it runs in 2 processes (using fork()), but doesn't require locking!!
-// TODO: seeking, data consistency checking
-
-#define READ_SLEEP_TIME 10
-// These defines are used to reduce the cost of many successive
-// seeks (e.g. when a file has no index) by spinning quickly at first.
-#define INITIAL_FILL_USLEEP_TIME 1000
-#define INITIAL_FILL_USLEEP_COUNT 10
-#define FILL_USLEEP_TIME 50000
-#define PREFILL_SLEEP_TIME 200
-#define CONTROL_SLEEP_TIME 1
+// The cache runs in a separate thread, which reads ahead from the underlying
+// stream into the cache buffer. All state shared between the cache thread and
+// the reader (the main thread) is protected by a mutex. A single condition
+// variable is used to wake up the other side: the cache thread broadcasts it
+// whenever new data has been read or a control has been executed, and the
+// reader broadcasts it whenever it seeks, consumes data, or requests a
+// control. Nobody busy-waits or polls with sleeps.
+//
+// The buffer is split into fixed size blocks. Each block caches an aligned
+// part of the file, so the cache can hold several disjoint byte ranges, e.g.
+// the data around a previous seek target. Seeking back into any cached range
+// doesn't need to touch the underlying stream. Blocks are looked up with a
+// hash table, and evicted in least-recently-used order. The blocks from the
+// read position up to the end of the contiguously cached data ahead of it
+// ("forward" blocks) are never evicted.
+//
+// With --cache-connections, additional threads fill the cache in parallel,
+// each using its own connection (a clone of the stream, see
+// STREAM_CTRL_CLONE). Every filler claims a run of missing blocks ahead
+// of the read position and fills it, so the data arrives out of order. A block
+// that is being filled is marked busy and is never touched by other threads.
+//
+// With --cache-file, the block storage is a file mapped into memory instead
+// of anonymous memory. This allows caching much more data than fits into RAM;
+// the kernel writes cold blocks back to the disk and pages them in again when
+// a seek goes back into them.
+
+// Time in seconds the main thread waits for the cache thread. On wakeups, the
+// code checks for user requested aborts and also prints warnings that the
+// cache is being slow.
+#define CACHE_WAIT_TIME 0.5
+
+// The time the cache sleeps in idle mode. This controls how often the cache
+// retries reading from the stream after EOF has been reached (in case the
+// stream is actually readable again, for example if data has been appended
+// to a file). If this is too low, the cache wastes CPU when paused.
+#define CACHE_IDLE_SLEEP_TIME 1.0
+
+// Interval (in milliseconds) in which the cache thread updates the cached
+// STREAM_CTRL_GET_TIME_LENGTH/STREAM_CTRL_GET_CURRENT_TIME values.
+#define CACHE_UPDATE_CONTROLS_TIME 100
+
+// Interval (in milliseconds) in which the cache fill status is printed while
+// prefilling the cache.
+#define PREFILL_STATUS_TIME 200
+
+// Preferred size of a cache block in bytes. It's always rounded to a multiple
+// of the sector size, and reduced for very small caches.
+#define BLOCK_SIZE 65536
+// Minimum number of blocks the cache is split into.
+#define MIN_BLOCKS 8
+// Maximum number of blocks claimed at once by a filler in parallel mode.
+#define MAX_RUN_BLOCKS 32
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
-#include <signal.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include <libavutil/common.h>
 
 #include "config.h"
 
-#include "osdep/shmem.h"
-#include "osdep/timer.h"
-#if defined(__MINGW32__)
-#include <windows.h>
-static void ThreadProc( void *s );
-#elif defined(PTHREAD_CACHE)
-#include <pthread.h>
-static void *ThreadProc(void *s);
-#else
-#include <sys/wait.h>
-#define FORKED_CACHE 1
-#endif
-#ifndef FORKED_CACHE
-#define FORKED_CACHE 0
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <sys/file.h>
 #endif
 
+#include "osdep/threads.h"
+#include "osdep/timer.h"
+
 #include "core/mp_msg.h"
 
 #include "stream.h"
 #include "cache2.h"
 #include "core/mp_common.h"
-
-typedef struct {
-  // constats:
+#include "core/options.h"
+
+enum {
+    CACHE_INTERRUPTED = -1,
+
+    CACHE_CTRL_NONE = -1,
+    CACHE_CTRL_QUIT = -2,
+};
+
+struct cache_block {
+  int64_t filepos; // file position of the first byte, -1 if unused
+  int len;         // number of valid bytes, starting at filepos
+  int hash_next;   // next block in the same hash bucket (or free list)
+  int lru_prev, lru_next; // LRU list, lru_prev points to more recent blocks
+  bool busy;       // being filled by a parallel filler
+  bool stale;      // busy block flushed from the cache, removed when done
+};
+
+// A thread filling the cache in parallel mode.
+struct cache_filler {
+  struct cache_vars *cache;
+  stream_t *stream;  // the filler's own stream, only accessed by the filler
+  pthread_t thread;  // unused for the cache thread itself
+  bool thread_running;
+  int block;         // busy block being filled, -1 if none
+  // Range of blocks claimed by this filler, [run_pos, run_end). run_pos is
+  // the start of the next block to fill.
+  int64_t run_pos, run_end;
+};
+
+typedef struct cache_vars {
+  // constants:
   unsigned char *buffer;      // base pointer of the allocated buffer memory
   int64_t buffer_size; // size of the allocated buffer memory
+  int file_fd;         // backing file if the buffer is mmap'ed, -1 otherwise
   int sector_size; // size of a single sector (2048/2324)
-  int64_t back_size;   // we should keep back_size amount of old bytes for backward seek
-  int64_t fill_limit;  // we should fill buffer only if space>=fill_limit
+  int block_size;  // size of a cache block (multiple of sector_size)
+  int num_blocks;
+  int back_blocks; // we should keep back_blocks amount of other blocks for backward seek
+  int64_t fill_limit;  // prefill amount is limited to buffer_size-fill_limit
   int64_t seek_limit;  // keep filling cache if distance is less that seek limit
-#if FORKED_CACHE
-  pid_t ppid; // parent PID to detect killed parent
-#endif
+
+  pthread_t cache_thread;
+  bool cache_thread_running;
+  pthread_mutex_t mutex;
+  // Signalled on any state change (see comment at the top of the file).
+  pthread_cond_t wakeup;
+
+  // All fields below are protected by the mutex.
+
+  struct cache_block *blocks;
+  int *hash;       // hash buckets, indexed by block number & hash_mask
+  int hash_mask;
+  int free_head;   // list of unused blocks, linked with hash_next
+  int lru_head, lru_tail;
+
+  // Parallel mode, NULL if disabled. fillers[0] is the cache thread, using
+  // the stream field below.
+  struct cache_filler *fillers;
+  int num_fillers;
+  int run_blocks;  // number of blocks a filler claims at once
+
   // filler's pointers:
-  int eof;
-  int64_t min_filepos; // buffer contain only a part of the file, from min-max pos
-  int64_t max_filepos;
-  int64_t offset;      // filepos <-> bufferpos  offset value (filepos of the buffer's first byte)
+  int64_t eof_pos;     // file position at which EOF was hit, -1 if unknown
+  int64_t fill_end;    // end of the contiguously cached data at read_filepos
+  bool seek_failed;    // the filler can't reach read_filepos
   // reader's pointers:
   int64_t read_filepos;
-  // commands/locking:
-//  int seek_lock;   // 1 if we will seek/reset buffer, 2 if we are ready for cmd
-//  int fifo_flag;  // 1 if we should use FIFO to notice cache about buffer reads.
-  // callback
+  // Private copy of the stream, only accessed by the cache thread. The
+  // filler reads from it without holding the mutex.
   stream_t* stream;
-  volatile int control;
-  volatile uint64_t control_uint_arg;
-  volatile double control_double_arg;
-  volatile struct stream_lang_req control_lang_arg;
-  volatile int control_res;
-  volatile double stream_time_length;
-  volatile double stream_time_pos;
-  volatile int idle;
+  // commands:
+  int control;
+  uint64_t control_uint_arg;
+  double control_double_arg;
+  struct stream_lang_req control_lang_arg;
+  int control_res;
+  double stream_time_length;
+  double stream_time_pos;
+  unsigned int last_time_update;
+  int idle;
+  // statistics:
+  int64_t bytes_read;      // read from the stream
+  int64_t bytes_delivered; // passed to the reader
 } cache_vars_t;
 
-static void cache_wakeup(stream_t *s)
+// Used by the main thread to wakeup the cache thread, and to wait for the
+// cache thread. The cache mutex has to be locked when calling this function.
+// *retry_time should be set to 0 on the first call.
+// Returns CACHE_INTERRUPTED if the caller is supposed to abort.
+static int cache_wakeup_and_wait(cache_vars_t *s, double *retry_time)
 {
-#if FORKED_CACHE
-  // signal process to wake up immediately
-  kill(s->cache_pid, SIGUSR1);
-#endif
+  if (stream_check_interrupt(0))
+    return CACHE_INTERRUPTED;
+
+  unsigned int start = GetTimer();
+
+  pthread_cond_broadcast(&s->wakeup);
+  mpthread_cond_timed_wait(&s->wakeup, &s->mutex, CACHE_WAIT_TIME);
+
+  *retry_time += (GetTimer() - start) / 1e6;
+  return 0;
+}
+
+static int block_hash(cache_vars_t *s, int64_t filepos)
+{
+  return (filepos / s->block_size) & s->hash_mask;
+}
+
+static unsigned char *block_data(cache_vars_t *s, int idx)
+{
+  return s->buffer + (int64_t)idx * s->block_size;
+}
+
+// Return the index of the block starting at filepos (must be aligned to
+// block_size), or -1 if it isn't cached.
+static int block_find(cache_vars_t *s, int64_t filepos)
+{
+  int idx = s->hash[block_hash(s, filepos)];
+  while (idx >= 0 && (s->blocks[idx].filepos != filepos ||
+                      s->blocks[idx].stale))
+    idx = s->blocks[idx].hash_next;
+  return idx;
+}
+
+static void lru_unlink(cache_vars_t *s, int idx)
+{
+  struct cache_block *b = &s->blocks[idx];
+  if (b->lru_prev >= 0)
+    s->blocks[b->lru_prev].lru_next = b->lru_next;
+  else
+    s->lru_head = b->lru_next;
+  if (b->lru_next >= 0)
+    s->blocks[b->lru_next].lru_prev = b->lru_prev;
+  else
+    s->lru_tail = b->lru_prev;
+  b->lru_prev = b->lru_next = -1;
+}
+
+static void lru_link_head(cache_vars_t *s, int idx)
+{
+  s->blocks[idx].lru_prev = -1;
+  s->blocks[idx].lru_next = s->lru_head;
+  if (s->lru_head >= 0)
+    s->blocks[s->lru_head].lru_prev = idx;
+  s->lru_head = idx;
+  if (s->lru_tail < 0)
+    s->lru_tail = idx;
+}
+
+// Mark the block as most recently used.
+static void block_touch(cache_vars_t *s, int idx)
+{
+  if (s->lru_head == idx)
+    return;
+  lru_unlink(s, idx);
+  lru_link_head(s, idx);
+}
+
+static void block_remove(cache_vars_t *s, int idx)
+{
+  struct cache_block *b = &s->blocks[idx];
+  int *link = &s->hash[block_hash(s, b->filepos)];
+  while (*link != idx)
+    link = &s->blocks[*link].hash_next;
+  *link = b->hash_next;
+  lru_unlink(s, idx);
+  b->filepos = -1;
+  b->len = 0;
+  b->busy = b->stale = false;
+  b->hash_next = s->free_head;
+  s->free_head = idx;
+}
+
+// Get a block for the data starting at filepos. If no unused block is left,
+// evict the least recently used block that is not busy and not in the range of
+// forward blocks [fwd_start, fwd_end). Returns -1 if there is no such block.
+static int block_alloc(cache_vars_t *s, int64_t filepos,
+                       int64_t fwd_start, int64_t fwd_end)
+{
+  int idx = s->free_head;
+  if (idx < 0) {
+    idx = s->lru_tail;
+    while (idx >= 0 && (s->blocks[idx].busy ||
+                        (s->blocks[idx].filepos >= fwd_start &&
+                         s->blocks[idx].filepos < fwd_end)))
+      idx = s->blocks[idx].lru_prev;
+    if (idx < 0)
+      return -1;
+    mp_msg(MSGT_CACHE, MSGL_DBG2, "Evicting block at 0x%"PRIX64"\n",
+           s->blocks[idx].filepos);
+    block_remove(s, idx);
+  }
+  struct cache_block *b = &s->blocks[idx];
+  s->free_head = b->hash_next;
+  int *bucket = &s->hash[block_hash(s, filepos)];
+  b->filepos = filepos;
+  b->len = 0;
+  b->hash_next = *bucket;
+  *bucket = idx;
+  lru_link_head(s, idx);
+  return idx;
+}
+
+// Return the end of the contiguously cached data starting at filepos.
+static int64_t cached_end(cache_vars_t *s, int64_t filepos)
+{
+  while (1) {
+    int64_t start = filepos - filepos % s->block_size;
+    int idx = block_find(s, start);
+    if (idx < 0 || start + s->blocks[idx].len <= filepos)
+      return filepos;
+    filepos = start + s->blocks[idx].len;
+    if (s->blocks[idx].len < s->block_size)
+      return filepos;
+  }
+}
+
+// Return the position at which the filler has to continue filling the block
+// containing filepos, i.e. the first byte that's missing in the block.
+static int64_t block_fill_pos(cache_vars_t *s, int64_t filepos)
+{
+  int64_t start = filepos - filepos % s->block_size;
+  int idx = block_find(s, start);
+  return idx < 0 ? start : start + s->blocks[idx].len;
+}
+
+// Whether the filler can continue filling the cache at filepos.
+static bool is_fill_pos(cache_vars_t *s, int64_t filepos)
+{
+  return block_fill_pos(s, filepos) == filepos;
+}
+
+// End of the forward blocks, which are never evicted: as much as the cache
+// can hold ahead of the block containing the read position.
+static int64_t forward_end(cache_vars_t *s)
+{
+  int64_t read_start = s->read_filepos - s->read_filepos % s->block_size;
+  return read_start + (int64_t)(s->num_blocks - s->back_blocks) * s->block_size;
 }
 
 static void cache_flush(cache_vars_t *s)
 {
-  s->offset= // FIXME!?
-  s->min_filepos=s->max_filepos=s->read_filepos; // drop cache content :(
+  for (int n = 0; n < s->num_blocks; n++) {
+    if (s->blocks[n].busy)
+      s->blocks[n].stale = true;
+    else if (s->blocks[n].filepos >= 0)
+      block_remove(s, n);
+  }
+  for (int n = 0; n < s->num_fillers; n++)
+    s->fillers[n].run_pos = s->fillers[n].run_end = 0;
+  s->fill_end = s->read_filepos;
+  s->eof_pos = -1;
+  s->seek_failed = false;
 }
 
+// Runs in the main thread, with the mutex locked.
 static int cache_read(cache_vars_t *s, unsigned char *buf, int size)
 {
   int total=0;
-  int sleep_count = 0;
-  int64_t last_max = s->max_filepos;
+  double retry_time = 0;
+  bool warned = false;
+  int64_t last_fill_end = s->fill_end;
   while(size>0){
-    int64_t pos,newb,len;
-
-  //printf("CACHE2_READ: 0x%X <= 0x%X <= 0x%X  \n",s->min_filepos,s->read_filepos,s->max_filepos);
+    int64_t read = s->read_filepos;
+    int64_t start = read - read % s->block_size;
+    int idx = block_find(s, start);
 
-    if(s->read_filepos>=s->max_filepos || s->read_filepos<s->min_filepos){
+    if (idx < 0 || start + s->blocks[idx].len <= read) {
 	// eof?
-	if(s->eof) break;
-	if (s->max_filepos == last_max) {
-	    if (sleep_count++ == 10)
+	if ((s->eof_pos >= 0 && read >= s->eof_pos) || s->seek_failed)
+	    break;
+	if (s->fill_end == last_fill_end) {
+	    if (retry_time >= CACHE_WAIT_TIME && !warned) {
 	        mp_msg(MSGT_CACHE, MSGL_WARN, "Cache empty, consider increasing -cache and/or -cache-min. [performance issue]\n");
+	        warned = true;
+	    }
 	} else {
-	    last_max = s->max_filepos;
-	    sleep_count = 0;
+	    last_fill_end = s->fill_end;
+	    retry_time = 0;
 	}
 	// waiting for buffer fill...
-	if (stream_check_interrupt(READ_SLEEP_TIME)) {
-	    s->eof = 1;
+	if (cache_wakeup_and_wait(s, &retry_time) == CACHE_INTERRUPTED)
 	    break;
-	}
 	continue; // try again...
     }
-    sleep_count = 0;
-
-    newb=s->max_filepos-s->read_filepos; // new bytes in the buffer
-
-//    printf("*** newb: %d bytes ***\n",newb);
 
-    pos=s->read_filepos - s->offset;
-    if(pos<0) pos+=s->buffer_size; else
-    if(pos>=s->buffer_size) pos-=s->buffer_size;
-
-    if(newb>s->buffer_size-pos) newb=s->buffer_size-pos; // handle wrap...
-    if(newb>size) newb=size;
-
-    // check:
-    if(s->read_filepos<s->min_filepos) mp_msg(MSGT_CACHE,MSGL_ERR,"Ehh. s->read_filepos<s->min_filepos !!! Report bug...\n");
-
-    // len=write(mem,newb)
-    //printf("Buffer read: %d bytes\n",newb);
-    memcpy(buf,&s->buffer[pos],newb);
-    buf+=newb;
-    len=newb;
-    // ...
+    int len = FFMIN(start + s->blocks[idx].len - read, size);
+    memcpy(buf, block_data(s, idx) + (read - start), len);
+    block_touch(s, idx);
+    buf+=len;
 
     s->read_filepos+=len;
     size-=len;
     total+=len;
-
   }
+  s->bytes_delivered += total;
+  // the cache thread might be waiting for free buffer space
+  pthread_cond_broadcast(&s->wakeup);
   return total;
 }
 
+// Runs in the cache thread, with the mutex locked. The mutex is unlocked while
+// doing blocking I/O on the stream. Returns 0 if nothing was done and the
+// cache thread can go idle.
 static int cache_fill(cache_vars_t *s)
 {
-  int64_t back,back2,newb,space,len,pos;
-  int64_t read=s->read_filepos;
+  int64_t read = s->read_filepos;
+  int64_t read_start = read - read % s->block_size;
   int read_chunk;
-  int wraparound_copy = 0;
-
-  if(read<s->min_filepos || read>s->max_filepos){
-      // seek...
-      mp_msg(MSGT_CACHE,MSGL_DBG2,"Out of boundaries... seeking to 0x%"PRIX64"  \n",read);
-      // drop cache contents only if seeking backward or too much fwd.
-      // This is also done for on-disk files, since it loses the backseek cache.
-      // That in turn can cause major bandwidth increase and performance
-      // issues with e.g. mov or badly interleaved files
-      if(read<s->min_filepos || read>=s->max_filepos+s->seek_limit)
+
+  if (s->seek_failed)
+    return 0;
+
+  // The first byte that is not cached yet.
+  int64_t target = cached_end(s, read);
+  s->fill_end = target;
+
+  if (s->eof_pos >= 0 && target >= s->eof_pos)
+    return 0;
+
+  // The missing data is read starting with the first missing byte of the
+  // block, which might be before the read position.
+  target = block_fill_pos(s, target);
+
+  int64_t pos = target;
+  int64_t stream_pos = s->stream->pos;
+  if (stream_pos != target) {
+      // Avoid seeking the stream if reading the data in between is cheaper.
+      // This is also done for on-disk files, because a seek loses the stream
+      // layer's read-ahead. That in turn can cause major bandwidth increase
+      // and performance issues with e.g. mov or badly interleaved files.
+      if (stream_pos < target && target - stream_pos <= s->seek_limit &&
+          is_fill_pos(s, stream_pos))
       {
-        cache_flush(s);
+        pos = stream_pos;
+      } else {
+        mp_msg(MSGT_CACHE,MSGL_DBG2,"Out of boundaries... seeking to 0x%"PRIX64"  \n",target);
+        pthread_mutex_unlock(&s->mutex);
         if(s->stream->eof) stream_reset(s->stream);
-        stream_seek_internal(s->stream,read);
+        stream_seek_internal(s->stream,target);
+        pthread_mutex_lock(&s->mutex);
         mp_msg(MSGT_CACHE,MSGL_DBG2,"Seek done. new pos: 0x%"PRIX64"  \n",(int64_t)stream_tell(s->stream));
+        // the reader might have seeked again in the meantime
+        if (s->read_filepos != read)
+          return 1;
+        stream_pos = s->stream->pos;
+        if (stream_pos < target && is_fill_pos(s, stream_pos)) {
+          // stream can't seek forward, read up to the target instead
+          pos = stream_pos;
+        } else if (stream_pos != target) {
+          mp_msg(MSGT_CACHE, MSGL_V, "Can't seek stream to 0x%"PRIX64".\n", target);
+          s->seek_failed = true;
+          pthread_cond_broadcast(&s->wakeup);
+          return 0;
+        }
       }
   }
 
-  // calc number of back-bytes:
-  back=read - s->min_filepos;
-  if(back<0) back=0; // strange...
-  if(back>s->back_size) back=s->back_size;
+  int64_t start = pos - pos % s->block_size;
+  int idx = block_find(s, start);
+  if (idx < 0) {
+    // Number of forward blocks, which must not be evicted.
+    int64_t fwd_blocks = (target - read_start + s->block_size - 1) / s->block_size;
+    if (s->free_head < 0 && fwd_blocks >= s->num_blocks - s->back_blocks)
+      return 0; // buffer is full
+    idx = block_alloc(s, start, read_start, forward_end(s));
+    if (idx < 0)
+      return 0;
+  }
 
-  // calc number of new bytes:
-  newb=s->max_filepos - read;
-  if(newb<0) newb=0; // strange...
+  // limit one-time block size
+  read_chunk = s->stream->read_chunk;
+  if (!read_chunk) read_chunk = 4*s->sector_size;
+  int space = FFMIN(s->block_size - (pos - start), read_chunk);
+  unsigned char *dst = block_data(s, idx) + (pos - start);
+
+  // The block part written to is not visible to the reader yet, so the
+  // reader never accesses it while the mutex is unlocked. Only the cache
+  // thread itself evicts blocks.
+  pthread_mutex_unlock(&s->mutex);
+  int len = stream_read_internal(s->stream, dst, space);
+  pthread_mutex_lock(&s->mutex);
+
+  s->blocks[idx].len += len;
+  s->bytes_read += len;
+  if (!len) {
+    s->eof_pos = pos;
+  } else if (s->eof_pos >= 0 && pos + len > s->eof_pos) {
+    s->eof_pos = -1; // the stream grew
+  }
+  if (s->fill_end == pos)
+    s->fill_end += len;
 
-  // calc free buffer space:
-  space=s->buffer_size - (newb+back);
+  pthread_cond_broadcast(&s->wakeup);
 
-  // calc bufferpos:
-  pos=s->max_filepos - s->offset;
-  if(pos>=s->buffer_size) pos-=s->buffer_size; // wrap-around
+  // Make sure a seek done by the reader while we were reading is handled
+  // before going idle.
+  return len || s->read_filepos != read;
+}
 
-  if(space<s->fill_limit){
-//    printf("Buffer is full (%d bytes free, limit: %d)\n",space,s->fill_limit);
-    return 0; // no fill...
+// Whether filepos is in the range claimed by a filler other than f.
+static bool claimed_by_other(cache_vars_t *s, struct cache_filler *f,
+                             int64_t filepos)
+{
+  for (int n = 0; n < s->num_fillers; n++) {
+    struct cache_filler *o = &s->fillers[n];
+    if (o != f && filepos >= o->run_pos && filepos < o->run_end)
+      return true;
   }
+  return false;
+}
 
-//  printf("### read=0x%X  back=%d  newb=%d  space=%d  pos=%d\n",read,back,newb,space,pos);
+// Whether a filler can start filling the block at filepos.
+static bool can_claim(cache_vars_t *s, struct cache_filler *f, int64_t filepos)
+{
+  int idx = block_find(s, filepos);
+  int len = idx >= 0 ? s->blocks[idx].len : 0;
+  if ((idx >= 0 && s->blocks[idx].busy) || len == s->block_size)
+    return false;
+  if (s->eof_pos >= 0 && filepos + len >= s->eof_pos)
+    return false;
+  return !claimed_by_other(s, f, filepos);
+}
 
-  // try to avoid wrap-around. If not possible due to sector size
-  // do an extra copy.
-  if(space>s->buffer_size-pos) {
-    if (s->buffer_size-pos >= s->sector_size) {
-      space=s->buffer_size-pos;
-    } else {
-      space = s->sector_size;
-      wraparound_copy = 1;
+// Make f->block a busy block at filepos. Returns false if no block is free.
+static bool claim_block_at(cache_vars_t *s, struct cache_filler *f,
+                           int64_t filepos)
+{
+  int64_t read_start = s->read_filepos - s->read_filepos % s->block_size;
+  int idx = block_find(s, filepos);
+  if (idx < 0)
+    idx = block_alloc(s, filepos, read_start, forward_end(s));
+  if (idx < 0)
+    return false;
+  s->blocks[idx].busy = true;
+  f->block = idx;
+  f->run_pos = filepos + s->block_size;
+  f->run_end = FFMAX(f->run_end, f->run_pos);
+  return true;
+}
+
+// Find the next block f should fill. The block containing the first missing
+// byte at the read position is taken first, so that the reader never waits for
+// data while fillers are busy further ahead. Otherwise, the filler continues
+// its claimed run of blocks, or claims a new run after the first missing block
+// nobody is working on. Runs are read with a single request if possible.
+static bool claim_block(cache_vars_t *s, struct cache_filler *f)
+{
+  int64_t read_start = s->read_filepos - s->read_filepos % s->block_size;
+  int64_t limit = forward_end(s);
+  if (s->eof_pos >= 0)
+    limit = FFMIN(limit, s->eof_pos);
+  if (f->stream->end_pos > 0)
+    limit = FFMIN(limit, f->stream->end_pos);
+
+  int64_t first = s->fill_end - s->fill_end % s->block_size;
+  if (first < limit && can_claim(s, f, first)) {
+    f->run_end = 0;
+    if (claim_block_at(s, f, first))
+      goto done;
+  }
+  if (f->run_pos >= read_start && f->run_pos < FFMIN(f->run_end, limit) &&
+      can_claim(s, f, f->run_pos) && claim_block_at(s, f, f->run_pos))
+    goto done;
+  f->run_pos = f->run_end = 0;
+  for (int64_t pos = first; pos < limit; pos += s->block_size) {
+    if (!can_claim(s, f, pos))
+      continue;
+    int64_t end = pos + s->block_size;
+    for (int n = 1; n < s->run_blocks && end < limit; n++) {
+      if (block_find(s, end) >= 0 || claimed_by_other(s, f, end))
+        break;
+      end += s->block_size;
     }
+    f->run_end = end;
+    if (claim_block_at(s, f, pos))
+      goto done;
+    f->run_end = 0;
+    return false;
   }
+  return false;
 
-  // limit one-time block size
-  read_chunk = s->stream->read_chunk;
-  if (!read_chunk) read_chunk = 4*s->sector_size;
-  space = FFMIN(space, read_chunk);
+done:
+  f->stream->read_end_hint = FFMIN(f->run_end, limit);
+  return true;
+}
 
-#if 1
-  // back+newb+space <= buffer_size
-  back2=s->buffer_size-(space+newb); // max back size
-  if(s->min_filepos<(read-back2)) s->min_filepos=read-back2;
-#else
-  s->min_filepos=read-back; // avoid seeking-back to temp area...
-#endif
+// Parallel mode version of cache_fill(). Runs in the cache thread and the
+// helper threads, with the mutex locked. The mutex is unlocked while doing
+// blocking I/O on f->stream. Returns 0 if the filler can go idle.
+static int cache_fill_parallel(cache_vars_t *s, struct cache_filler *f)
+{
+  stream_t *stream = f->stream;
+
+  if (s->seek_failed)
+    return 0;
+
+  s->fill_end = cached_end(s, s->read_filepos);
+
+  if (f->block < 0 && !claim_block(s, f))
+    return 0;
+
+  struct cache_block *b = &s->blocks[f->block];
+  int64_t pos = b->filepos + b->len;
+  bool stale = b->stale;
+
+  if (!stale && stream->pos != pos) {
+    mp_msg(MSGT_CACHE, MSGL_DBG2, "Filler seeking to 0x%"PRIX64"\n", pos);
+    pthread_mutex_unlock(&s->mutex);
+    if (stream->eof)
+      stream_reset(stream);
+    stream_seek_internal(stream, pos);
+    pthread_mutex_lock(&s->mutex);
+    if (stream->pos != pos) {
+      mp_msg(MSGT_CACHE, MSGL_V, "Can't seek stream to 0x%"PRIX64".\n", pos);
+      s->seek_failed = true;
+      stale = true;
+    }
+  }
 
-  if (wraparound_copy) {
-    int to_copy;
-    len = stream_read_internal(s->stream, s->stream->buffer, space);
-    to_copy = FFMIN(len, s->buffer_size-pos);
-    memcpy(s->buffer + pos, s->stream->buffer, to_copy);
-    memcpy(s->buffer, s->stream->buffer + to_copy, len - to_copy);
-  } else
-  len = stream_read_internal(s->stream, &s->buffer[pos], space);
-  s->eof= !len;
+  int len = 0;
+  if (!stale) {
+    int read_chunk = stream->read_chunk;
+    if (!read_chunk)
+      read_chunk = 4 * s->sector_size;
+    int space = FFMIN(s->block_size - b->len, read_chunk);
+    unsigned char *dst = block_data(s, f->block) + b->len;
+
+    // Busy blocks are never evicted, and nobody else writes to them.
+    pthread_mutex_unlock(&s->mutex);
+    len = stream_read_internal(stream, dst, space);
+    pthread_mutex_lock(&s->mutex);
+
+    b->len += len;
+    s->bytes_read += len;
+    if (b->stale) {
+      // flushed while reading, the EOF state was reset
+    } else if (!len) {
+      if (s->eof_pos < 0 || pos < s->eof_pos)
+        s->eof_pos = pos;
+    } else if (s->eof_pos >= 0 && pos + len > s->eof_pos) {
+      s->eof_pos = -1; // the stream grew
+    }
+  }
 
-  s->max_filepos+=len;
-  if(pos+len>=s->buffer_size){
-      // wrap...
-      s->offset+=s->buffer_size;
+  if (!len || b->len == s->block_size || b->stale) {
+    b->busy = false;
+    if (b->stale || !b->len)
+      block_remove(s, f->block);
+    f->block = -1;
   }
 
-  return len;
+  s->fill_end = cached_end(s, s->read_filepos);
+  pthread_cond_broadcast(&s->wakeup);
+  return len || stale || f->block >= 0;
+}
 
+// Amount of data cached ahead of the read position in parallel mode. Unlike
+// fill_end, this includes data after holes not filled yet.
+static int64_t parallel_fill(cache_vars_t *s)
+{
+  int64_t read = s->read_filepos;
+  int64_t end = forward_end(s);
+  int64_t fill = 0;
+  for (int n = 0; n < s->num_blocks; n++) {
+    struct cache_block *b = &s->blocks[n];
+    if (b->filepos < 0 || b->stale || b->filepos >= end)
+      continue;
+    fill += FFMAX(b->filepos + b->len - FFMAX(b->filepos, read), 0);
+  }
+  return fill;
+}
+
+// Main loop of the helper threads in parallel mode.
+static void *cache_filler_thread(void *arg)
+{
+  struct cache_filler *f = arg;
+  cache_vars_t *s = f->cache;
+  pthread_mutex_lock(&s->mutex);
+  while (s->control != CACHE_CTRL_QUIT) {
+    if (!cache_fill_parallel(s, f))
+      mpthread_cond_timed_wait(&s->wakeup, &s->mutex, CACHE_IDLE_SLEEP_TIME);
+  }
+  pthread_mutex_unlock(&s->mutex);
+  return NULL;
 }
 
-static int cache_execute_control(cache_vars_t *s) {
+// Runs in the cache thread, with the mutex locked.
+static void cache_execute_control(cache_vars_t *s) {
   double double_res;
   unsigned uint_res;
   uint64_t uint64_res;
   int needs_flush = 0;
-  static unsigned last;
-  int quit = s->control == -2;
   uint64_t old_pos = s->stream->pos;
   int old_eof = s->stream->eof;
-  if (quit || !s->stream->control) {
+  if (!s->stream->control) {
     s->stream_time_length = 0;
     s->stream_time_pos = MP_NOPTS_VALUE;
     s->control_res = STREAM_UNSUPPORTED;
-    s->control = -1;
-    return !quit;
+    goto done;
   }
-  if (GetTimerMS() - last > 99) {
+  if (GetTimerMS() - s->last_time_update >= CACHE_UPDATE_CONTROLS_TIME) {
     double len, pos;
     if (s->stream->control(s->stream, STREAM_CTRL_GET_TIME_LENGTH, &len) == STREAM_OK)
       s->stream_time_length = len;
@@ -284,16 +709,9 @@ static int cache_execute_control(cache_vars_t *s) {
       s->stream_time_pos = pos;
     else
       s->stream_time_pos = MP_NOPTS_VALUE;
-#if FORKED_CACHE
-    // if parent PID changed, main process was killed -> exit
-    if (s->ppid != getppid()) {
-      mp_msg(MSGT_CACHE, MSGL_WARN, "Parent process disappeared, exiting cache process.\n");
-      return 0;
-    }
-#endif
-    last = GetTimerMS();
+    s->last_time_update = GetTimerMS();
   }
-  if (s->control == -1) return 1;
+  if (s->control == CACHE_CTRL_NONE) return;
   switch (s->control) {
     case STREAM_CTRL_SEEK_TO_TIME:
       needs_flush = 1;
@@ -329,120 +747,271 @@ static int cache_execute_control(cache_vars_t *s) {
   }
   if (s->control_res == STREAM_OK && needs_flush) {
     s->read_filepos = s->stream->pos;
-    s->eof = s->stream->eof;
     cache_flush(s);
+    if (s->stream->eof)
+      s->eof_pos = s->read_filepos;
   } else if (needs_flush &&
              (old_pos != s->stream->pos || old_eof != s->stream->eof))
     mp_msg(MSGT_STREAM, MSGL_ERR, "STREAM_CTRL changed stream pos but returned error, this is not allowed!\n");
-  s->control = -1;
-  return 1;
+done:
+  if (s->control != CACHE_CTRL_NONE) {
+    s->control = CACHE_CTRL_NONE;
+    pthread_cond_broadcast(&s->wakeup);
+  }
 }
 
-static void *shared_alloc(int64_t size) {
-#if FORKED_CACHE
-    return shmem_alloc(size);
-#else
-    return malloc(size);
+#ifdef HAVE_SYS_MMAN_H
+// Open (or create) the cache file and map buffer_size bytes of it. If the
+// filename is "TMP", an anonymous temporary file is used, which is deleted
+// as soon as it's closed. A named file is locked, and fails if it's already
+// used by another cache (e.g. an external audio file, or a prefetched
+// playlist entry), so that the caches don't overwrite each other's data.
+static bool cache_map_file(cache_vars_t *s, const char *filename)
+{
+  char tmp_name[512];
+  if (strcmp(filename, "TMP") == 0) {
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !dir[0])
+      dir = "/tmp";
+    snprintf(tmp_name, sizeof(tmp_name), "%s/mpv-cache-XXXXXX", dir);
+    s->file_fd = mkstemp(tmp_name);
+    if (s->file_fd >= 0)
+      unlink(tmp_name);
+    filename = tmp_name;
+  } else {
+    s->file_fd = open(filename, O_RDWR | O_CREAT, 0600);
+    // Failure for other reasons (no locking support on the filesystem) is
+    // ignored.
+    if (s->file_fd >= 0 && flock(s->file_fd, LOCK_EX | LOCK_NB) < 0 &&
+        errno == EWOULDBLOCK)
+    {
+      mp_msg(MSGT_CACHE, MSGL_WARN, "Cache file '%s' is already in use.\n",
+             filename);
+      close(s->file_fd);
+      s->file_fd = -1;
+      return false;
+    }
+  }
+  if (s->file_fd < 0)
+    goto error;
+  if (ftruncate(s->file_fd, s->buffer_size) < 0)
+    goto error;
+#ifdef HAVE_POSIX_FALLOCATE
+  // Reserve the disk space now. Writing to a sparse mapping on a full disk
+  // would crash with SIGBUS instead of returning an error.
+  int err = posix_fallocate(s->file_fd, 0, s->buffer_size);
+  if (err && err != EINVAL && err != EOPNOTSUPP) {
+    errno = err;
+    goto error;
+  }
 #endif
+  void *p = mmap(NULL, s->buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 s->file_fd, 0);
+  if (p == MAP_FAILED)
+    goto error;
+  s->buffer = p;
+  return true;
+
+error:
+  mp_msg(MSGT_CACHE, MSGL_ERR, "Can't use '%s' as cache file: %s\n",
+         filename, strerror(errno));
+  if (s->file_fd >= 0)
+    close(s->file_fd);
+  s->file_fd = -1;
+  return false;
 }
-
-static void shared_free(void *ptr, int64_t size) {
-#if FORKED_CACHE
-    shmem_free(ptr, size);
 #else
-    free(ptr);
+static bool cache_map_file(cache_vars_t *s, const char *filename)
+{
+  mp_msg(MSGT_CACHE, MSGL_ERR, "Cache files are not supported on this "
+         "system.\n");
+  return false;
+}
+#endif
+
+static void cache_free_buffer(cache_vars_t *s)
+{
+#ifdef HAVE_SYS_MMAN_H
+  if (s->file_fd >= 0) {
+    if (s->buffer)
+      munmap(s->buffer, s->buffer_size);
+    close(s->file_fd);
+    return;
+  }
 #endif
+  free(s->buffer);
 }
 
-static cache_vars_t* cache_init(int64_t size,int sector){
+// If filename is not NULL, the buffer is mapped from that file.
+static cache_vars_t* cache_init(int64_t size,int sector,const char *filename){
   int64_t num;
-  cache_vars_t* s=shared_alloc(sizeof(cache_vars_t));
+  cache_vars_t* s=calloc(1, sizeof(cache_vars_t));
   if(s==NULL) return NULL;
+  s->file_fd = -1;
 
-  memset(s,0,sizeof(cache_vars_t));
   num=size/sector;
   if(num < 32){
      num = 32;
   }//64kb min_size
-  s->buffer_size=num*sector;
+  int sectors_per_block = FFMAX(BLOCK_SIZE / sector, 1);
+  sectors_per_block = FFMIN(sectors_per_block, num / MIN_BLOCKS);
+  s->block_size=sectors_per_block*sector;
+  s->num_blocks=num/sectors_per_block;
+  s->buffer_size=(int64_t)s->num_blocks*s->block_size;
   s->sector_size=sector;
-  s->buffer=shared_alloc(s->buffer_size);
-
-  if(s->buffer == NULL){
-    shared_free(s, sizeof(cache_vars_t));
+  if (filename) {
+    if (!cache_map_file(s, filename)) {
+      free(s);
+      return NULL;
+    }
+  } else {
+    s->buffer=malloc(s->buffer_size);
+  }
+  s->blocks=calloc(s->num_blocks, sizeof(struct cache_block));
+  int hash_size = 1;
+  while (hash_size < s->num_blocks)
+    hash_size <<= 1;
+  s->hash_mask=hash_size-1;
+  s->hash=malloc(hash_size * sizeof(int));
+
+  if(s->buffer == NULL || s->blocks == NULL || s->hash == NULL){
+    cache_free_buffer(s);
+    free(s->blocks);
+    free(s->hash);
+    free(s);
     return NULL;
   }
 
-  s->fill_limit=8*sector;
-  s->back_size=s->buffer_size/2;
-#if FORKED_CACHE
-  s->ppid = getpid();
-#endif
+  for (int n = 0; n < hash_size; n++)
+    s->hash[n] = -1;
+  for (int n = 0; n < s->num_blocks; n++) {
+    s->blocks[n] = (struct cache_block) {
+      .filepos = -1,
+      .hash_next = n + 1 < s->num_blocks ? n + 1 : -1,
+      .lru_prev = -1,
+      .lru_next = -1,
+    };
+  }
+  s->free_head = 0;
+  s->lru_head = s->lru_tail = -1;
+  s->eof_pos = -1;
+
+  s->fill_limit=s->block_size;
+  s->back_blocks=s->num_blocks/2;
+  s->control = CACHE_CTRL_NONE;
+  pthread_mutex_init(&s->mutex, NULL);
+  pthread_cond_init(&s->wakeup, NULL);
   return s;
 }
 
-void cache_uninit(stream_t *s) {
-  cache_vars_t* c = s->cache_data;
-  if(s->cache_pid) {
-#if !FORKED_CACHE
-    cache_do_control(s, -2, NULL);
-#else
-    kill(s->cache_pid,SIGKILL);
-    waitpid(s->cache_pid,NULL,0);
-#endif
-    s->cache_pid = 0;
+// Open additional connections for parallel mode. If the stream can't be
+// cloned, the cache is filled by the cache thread alone.
+static void cache_init_fillers(cache_vars_t *s, int connections)
+{
+  stream_t *stream = s->stream;
+  // Without the file size, every filler would have to find EOF on its own.
+  if (!stream->control || stream->end_pos <= 0)
+    return;
+  s->fillers = calloc(connections, sizeof(struct cache_filler));
+  if (!s->fillers)
+    return;
+  s->num_fillers = 1;
+  while (s->num_fillers < connections) {
+    stream_t *clone = NULL;
+    if (stream->control(stream, STREAM_CTRL_CLONE, &clone) != STREAM_OK)
+      break;
+    s->fillers[s->num_fillers++].stream = clone;
   }
-  if(!c) return;
-  shared_free(c->buffer, c->buffer_size);
-  c->buffer = NULL;
-  c->stream = NULL;
-  shared_free(s->cache_data, sizeof(cache_vars_t));
-  s->cache_data = NULL;
+  if (s->num_fillers < 2) {
+    mp_msg(MSGT_CACHE, MSGL_V, "Cache: stream doesn't support multiple "
+           "connections.\n");
+    free(s->fillers);
+    s->fillers = NULL;
+    s->num_fillers = 0;
+    return;
+  }
+  s->fillers[0].stream = stream;
+  for (int n = 0; n < s->num_fillers; n++) {
+    s->fillers[n].cache = s;
+    s->fillers[n].block = -1;
+  }
+  int window_blocks = s->num_blocks - s->back_blocks;
+  s->run_blocks = av_clip(window_blocks / (2 * s->num_fillers), 1,
+                          MAX_RUN_BLOCKS);
+  mp_msg(MSGT_CACHE, MSGL_V, "Cache: filling with %d connections, %d blocks "
+         "per request.\n", s->num_fillers, s->run_blocks);
 }
 
-#if FORKED_CACHE
-static void exit_sighandler(int x){
-  // close stream
-  exit(0);
+static void cache_free(cache_vars_t *c)
+{
+  for (int n = 1; n < c->num_fillers; n++)
+    free_stream(c->fillers[n].stream);
+  free(c->fillers);
+  pthread_cond_destroy(&c->wakeup);
+  pthread_mutex_destroy(&c->mutex);
+  cache_free_buffer(c);
+  free(c->blocks);
+  free(c->hash);
+  free(c->stream);
+  free(c);
 }
 
-static void dummy_sighandler(int x) {
+void cache_uninit(stream_t *s) {
+  cache_vars_t* c = s->cache_data;
+  if(!c) return;
+  if (c->cache_thread_running) {
+    pthread_mutex_lock(&c->mutex);
+    c->control = CACHE_CTRL_QUIT;
+    pthread_cond_broadcast(&c->wakeup);
+    pthread_mutex_unlock(&c->mutex);
+    pthread_join(c->cache_thread, NULL);
+    for (int n = 1; n < c->num_fillers; n++) {
+      if (c->fillers[n].thread_running)
+        pthread_join(c->fillers[n].thread, NULL);
+    }
+    mp_msg(MSGT_CACHE, MSGL_V, "Cache: %"PRId64" bytes read from stream, "
+           "%"PRId64" bytes delivered.\n", c->bytes_read, c->bytes_delivered);
+    // The stream was read only through the cache's copy (and its clones).
+    s->read_calls = c->stream->read_calls;
+    s->read_bytes = c->stream->read_bytes;
+    s->read_time = c->stream->read_time;
+    for (int n = 1; n < c->num_fillers; n++) {
+      s->read_calls += c->fillers[n].stream->read_calls;
+      s->read_bytes += c->fillers[n].stream->read_bytes;
+      s->read_time += c->fillers[n].stream->read_time;
+    }
+    // Network streams can reconnect on seeks, so the copy might own a
+    // different connection now.
+    s->fd = c->stream->fd;
+  }
+  cache_free(c);
+  s->cache_data = NULL;
 }
-#endif
 
 /**
- * Main loop of the cache process or thread.
+ * Main loop of the cache thread.
  */
-static void cache_mainloop(cache_vars_t *s) {
-    int sleep_count = 0;
-#if FORKED_CACHE
-    struct sigaction sa = { .sa_handler = SIG_IGN };
-    sigaction(SIGUSR1, &sa, NULL);
-#endif
-    do {
-        if (!cache_fill(s)) {
-            s->idle = 1;
-#if FORKED_CACHE
-            // Let signal wake us up, we cannot leave this
-            // enabled since we do not handle EINTR in most places.
-            // This might need extra code to work on BSD.
-            sa.sa_handler = dummy_sighandler;
-            sigaction(SIGUSR1, &sa, NULL);
-#endif
-            if (sleep_count < INITIAL_FILL_USLEEP_COUNT) {
-                sleep_count++;
-                usec_sleep(INITIAL_FILL_USLEEP_TIME);
-            } else
-                usec_sleep(FILL_USLEEP_TIME); // idle
-#if FORKED_CACHE
-            sa.sa_handler = SIG_IGN;
-            sigaction(SIGUSR1, &sa, NULL);
-#endif
-        } else {
-            sleep_count = 0;
+static void *cache_thread(void *arg)
+{
+    cache_vars_t *s = arg;
+    pthread_mutex_lock(&s->mutex);
+    while (s->control != CACHE_CTRL_QUIT) {
+        int progress = s->fillers ? cache_fill_parallel(s, &s->fillers[0])
+                                  : cache_fill(s);
+        if (progress) {
             s->idle = 0;
+        } else {
+            s->idle = 1;
+            if (s->control == CACHE_CTRL_NONE &&
+                mpthread_cond_timed_wait(&s->wakeup, &s->mutex,
+                                         CACHE_IDLE_SLEEP_TIME) == ETIMEDOUT)
+                s->eof_pos = -1; // retry reading after EOF
         }
-    } while (cache_execute_control(s));
+        if (s->control != CACHE_CTRL_QUIT)
+            cache_execute_control(s);
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return NULL;
 }
 
 int stream_enable_cache_percent(stream_t *stream, int64_t stream_cache_size,
@@ -462,23 +1031,41 @@ int stream_enable_cache(stream_t *stream,int64_t size,int64_t min,int64_t seek_l
       size = stream->cache_size * 1024;
   if (!size)
       return 1;
-  mp_tmsg(MSGT_NETWORK,MSGL_INFO,"Cache size set to %"PRId64" KiB\n", size / 1024);
 
   int ss = stream->sector_size ? stream->sector_size : STREAM_BUFFER_SIZE;
   int res = -1;
-  cache_vars_t* s;
-
-  if (size > SIZE_MAX) {
-    mp_msg(MSGT_CACHE, MSGL_FATAL, "Cache size larger than max. allocation size\n");
-    return -1;
+  cache_vars_t* s = NULL;
+
+  // A file backed cache replaces the in-memory buffer. The prefill and seek
+  // limits are still derived from the normal cache size.
+  struct MPOpts *opts = stream->opts;
+  if (opts && opts->stream_cache_file && opts->stream_cache_file[0]) {
+    int64_t file_size = opts->stream_cache_file_size * (int64_t)1024;
+    if (file_size > SIZE_MAX) {
+      mp_msg(MSGT_CACHE, MSGL_ERR, "Cache file size larger than address "
+             "space.\n");
+    } else {
+      s = cache_init(FFMAX(file_size, size), ss, opts->stream_cache_file);
+      if (s)
+        mp_tmsg(MSGT_NETWORK, MSGL_INFO, "Cache file size set to %"PRId64
+                " KiB\n", s->buffer_size / 1024);
+      else
+        mp_msg(MSGT_CACHE, MSGL_WARN, "Falling back to memory cache.\n");
+    }
   }
 
-  s=cache_init(size,ss);
-  if(s == NULL) return -1;
-  stream->cache_data=s;
-  s->stream=stream; // callback
-  s->seek_limit=seek_limit;
+  if (!s) {
+    mp_tmsg(MSGT_NETWORK,MSGL_INFO,"Cache size set to %"PRId64" KiB\n", size / 1024);
 
+    if (size > SIZE_MAX) {
+      mp_msg(MSGT_CACHE, MSGL_FATAL, "Cache size larger than max. allocation size\n");
+      return -1;
+    }
+
+    s=cache_init(size,ss,NULL);
+    if(s == NULL) return -1;
+  }
+  s->seek_limit=seek_limit;
 
   //make sure that we won't wait from cache_fill
   //more data than it is allowed to fill
@@ -488,93 +1075,85 @@ int stream_enable_cache(stream_t *stream,int64_t size,int64_t min,int64_t seek_l
   if (min > s->buffer_size - s->fill_limit) {
      min = s->buffer_size - s->fill_limit;
   }
-  // to make sure we wait for the cache process/thread to be active
+  // to make sure we wait for the cache thread to be active
   // before continuing
   if (min <= 0)
     min = 1;
 
-#if FORKED_CACHE
-  if((stream->cache_pid=fork())){
-    if ((pid_t)stream->cache_pid == -1)
-      stream->cache_pid = 0;
-#else
-  {
-    stream_t* stream2=malloc(sizeof(stream_t));
-    memcpy(stream2,s->stream,sizeof(stream_t));
-    s->stream=stream2;
-#if defined(__MINGW32__)
-    stream->cache_pid = _beginthread( ThreadProc, 0, s );
-#else
-    {
-    pthread_t tid;
-    pthread_create(&tid, NULL, ThreadProc, s);
-    stream->cache_pid = 1;
-    }
-#endif
-#endif
-    if (!stream->cache_pid) {
-        mp_msg(MSGT_CACHE, MSGL_ERR,
-               "Starting cache process/thread failed: %s.\n", strerror(errno));
-        goto err_out;
-    }
-    // wait until cache is filled at least prefill_init %
-    mp_msg(MSGT_CACHE,MSGL_V,"CACHE_PRE_INIT: %"PRId64" [%"PRId64"] %"PRId64"  pre:%"PRId64"  eof:%d  \n",
-	s->min_filepos,s->read_filepos,s->max_filepos,min,s->eof);
-    while(s->read_filepos<s->min_filepos || s->max_filepos-s->read_filepos<min){
-	mp_tmsg(MSGT_CACHE,MSGL_STATUS,"\rCache fill: %5.2f%% (%"PRId64" bytes)   ",
-	    100.0*(float)(s->max_filepos-s->read_filepos)/(float)(s->buffer_size),
-	    s->max_filepos-s->read_filepos
-	);
-	if(s->eof) break; // file is smaller than prefill size
-	if(stream_check_interrupt(PREFILL_SLEEP_TIME)) {
-	  res = 0;
-	  goto err_out;
-        }
-    }
-    mp_msg(MSGT_CACHE,MSGL_STATUS,"\n");
-    stream->cached = true;
-    return 1; // parent exits
+  // The cache thread works on its own copy of the stream struct, so that
+  // pos/buffer of the stream seen by the reader are not touched by it.
+  s->stream = malloc(sizeof(stream_t));
+  if (!s->stream) {
+    cache_free(s);
+    return -1;
+  }
+  memcpy(s->stream, stream, sizeof(stream_t));
 
-err_out:
-    cache_uninit(stream);
-    return res;
+  if (opts && opts->stream_cache_connections > 1)
+    cache_init_fillers(s, opts->stream_cache_connections);
+
+  if (pthread_create(&s->cache_thread, NULL, cache_thread, s) != 0) {
+    mp_msg(MSGT_CACHE, MSGL_ERR,
+           "Starting cache thread failed: %s.\n", strerror(errno));
+    cache_free(s);
+    return -1;
   }
+  s->cache_thread_running = true;
+  stream->cache_data = s;
 
-#if FORKED_CACHE
-  signal(SIGTERM,exit_sighandler); // kill
-  cache_mainloop(s);
-  // make sure forked code never leaves this function
-  exit(0);
-#endif
-}
+  for (int n = 1; n < s->num_fillers; n++) {
+    struct cache_filler *f = &s->fillers[n];
+    f->thread_running =
+      pthread_create(&f->thread, NULL, cache_filler_thread, f) == 0;
+  }
 
-#if !FORKED_CACHE
-#if defined(__MINGW32__)
-static void ThreadProc( void *s ){
-  cache_mainloop(s);
-  _endthread();
-}
-#else
-static void *ThreadProc( void *s ){
-  cache_mainloop(s);
-  return NULL;
+  // wait until cache is filled at least prefill_init %
+  pthread_mutex_lock(&s->mutex);
+  mp_msg(MSGT_CACHE,MSGL_V,"CACHE_PRE_INIT: [%"PRId64"] %"PRId64"  pre:%"PRId64"  blocks:%d*%d\n",
+      s->read_filepos,s->fill_end,min,s->num_blocks,s->block_size);
+  unsigned int last_status = 0;
+  double retry_time = 0;
+  while(s->fill_end-s->read_filepos<min){
+      if (GetTimerMS() - last_status >= PREFILL_STATUS_TIME) {
+          mp_tmsg(MSGT_CACHE,MSGL_STATUS,"\rCache fill: %5.2f%% (%"PRId64" bytes)   ",
+              100.0*(float)(s->fill_end-s->read_filepos)/(float)(s->buffer_size),
+              s->fill_end-s->read_filepos
+          );
+          last_status = GetTimerMS();
+      }
+      if(s->eof_pos >= 0 || s->seek_failed) break; // file is smaller than prefill size
+      if (cache_wakeup_and_wait(s, &retry_time) == CACHE_INTERRUPTED) {
+          res = 0;
+          pthread_mutex_unlock(&s->mutex);
+          goto err_out;
+      }
+  }
+  pthread_mutex_unlock(&s->mutex);
+  mp_msg(MSGT_CACHE,MSGL_STATUS,"\n");
+  stream->cached = true;
+  return 1;
+
+err_out:
+  cache_uninit(stream);
+  return res;
 }
-#endif
-#endif
 
 int cache_stream_fill_buffer(stream_t *s){
+  cache_vars_t *c = s->cache_data;
   int len;
   int sector_size;
-  if(!s->cache_pid) return stream_fill_buffer(s);
+  if(!c) return stream_fill_buffer(s);
 
-  if(s->pos!=((cache_vars_t*)s->cache_data)->read_filepos) mp_msg(MSGT_CACHE,MSGL_ERR,"!!! read_filepos differs!!! report this bug...\n");
-  sector_size = ((cache_vars_t*)s->cache_data)->sector_size;
+  pthread_mutex_lock(&c->mutex);
+  if(s->pos!=c->read_filepos) mp_msg(MSGT_CACHE,MSGL_ERR,"!!! read_filepos differs!!! report this bug...\n");
+  sector_size = c->sector_size;
   if (sector_size > STREAM_MAX_SECTOR_SIZE) {
     mp_msg(MSGT_CACHE, MSGL_ERR, "Sector size %i larger than maximum %i\n", sector_size, STREAM_MAX_SECTOR_SIZE);
     sector_size = STREAM_MAX_SECTOR_SIZE;
   }
 
-  len=cache_read(s->cache_data,s->buffer, sector_size);
+  len=cache_read(c,s->buffer, sector_size);
+  pthread_mutex_unlock(&c->mutex);
   //printf("cache_stream_fill_buffer->read -> %d\n",len);
 
   if(len<=0){ s->eof=1; s->buf_pos=s->buf_len=0; return 0; }
@@ -590,17 +1169,19 @@ int cache_stream_fill_buffer(stream_t *s){
 int cache_stream_seek_long(stream_t *stream,int64_t pos){
   cache_vars_t* s;
   int64_t newpos;
-  if(!stream->cache_pid) return stream_seek_long(stream,pos);
+  if(!stream->cache_data) return stream_seek_long(stream,pos);
 
   s=stream->cache_data;
-//  s->seek_lock=1;
 
-  mp_msg(MSGT_CACHE,MSGL_DBG2,"CACHE2_SEEK: 0x%"PRIX64" <= 0x%"PRIX64" (0x%"PRIX64") <= 0x%"PRIX64"  \n",s->min_filepos,pos,s->read_filepos,s->max_filepos);
+  pthread_mutex_lock(&s->mutex);
+  mp_msg(MSGT_CACHE,MSGL_DBG2,"CACHE2_SEEK: 0x%"PRIX64" (0x%"PRIX64")\n",pos,s->read_filepos);
 
   newpos=pos/s->sector_size; newpos*=s->sector_size; // align
   stream->pos=s->read_filepos=newpos;
-  s->eof=0; // !!!!!!!
-  cache_wakeup(stream);
+  s->fill_end=cached_end(s, newpos);
+  s->seek_failed=false;
+  pthread_cond_broadcast(&s->wakeup);
+  pthread_mutex_unlock(&s->mutex);
 
   cache_stream_fill_buffer(stream);
 
@@ -618,19 +1199,23 @@ int cache_stream_seek_long(stream_t *stream,int64_t pos){
 }
 
 int cache_do_control(stream_t *stream, int cmd, void *arg) {
-  int sleep_count = 0;
+  double retry_time = 0;
+  bool warned = false;
   int pos_change = 0;
+  int res = STREAM_OK;
   cache_vars_t* s = stream->cache_data;
+  pthread_mutex_lock(&s->mutex);
   switch (cmd) {
     case STREAM_CTRL_GET_CACHE_SIZE:
       *(int64_t *)arg = s->buffer_size;
-      return STREAM_OK;
+      goto done;
     case STREAM_CTRL_GET_CACHE_FILL:
-      *(int64_t *)arg = s->max_filepos - s->read_filepos;
-      return STREAM_OK;
+      *(int64_t *)arg = s->fillers ? parallel_fill(s)
+                                   : FFMAX(s->fill_end - s->read_filepos, 0);
+      goto done;
     case STREAM_CTRL_GET_CACHE_IDLE:
       *(int *)arg = s->idle;
-      return STREAM_OK;
+      goto done;
     case STREAM_CTRL_SEEK_TO_TIME:
       s->control_double_arg = *(double *)arg;
       s->control = cmd;
@@ -645,10 +1230,12 @@ int cache_do_control(stream_t *stream, int cmd, void *arg) {
     // the core might call these every frame, so cache them...
     case STREAM_CTRL_GET_TIME_LENGTH:
       *(double *)arg = s->stream_time_length;
-      return s->stream_time_length ? STREAM_OK : STREAM_UNSUPPORTED;
+      res = s->stream_time_length ? STREAM_OK : STREAM_UNSUPPORTED;
+      goto done;
     case STREAM_CTRL_GET_CURRENT_TIME:
       *(double *)arg = s->stream_time_pos;
-      return s->stream_time_pos != MP_NOPTS_VALUE ? STREAM_OK : STREAM_UNSUPPORTED;
+      res = s->stream_time_pos != MP_NOPTS_VALUE ? STREAM_OK : STREAM_UNSUPPORTED;
+      goto done;
     case STREAM_CTRL_GET_LANG:
       s->control_lang_arg = *(struct stream_lang_req *)arg;
     case STREAM_CTRL_GET_NUM_TITLES:
@@ -659,23 +1246,25 @@ int cache_do_control(stream_t *stream, int cmd, void *arg) {
     case STREAM_CTRL_GET_NUM_ANGLES:
     case STREAM_CTRL_GET_ANGLE:
     case STREAM_CTRL_GET_SIZE:
-    case -2:
       s->control = cmd;
       break;
     default:
-      return STREAM_UNSUPPORTED;
+      res = STREAM_UNSUPPORTED;
+      goto done;
   }
-  cache_wakeup(stream);
-  while (s->control != -1) {
-    if (sleep_count++ == 1000)
+  while (s->control != CACHE_CTRL_NONE) {
+    if (retry_time >= CACHE_WAIT_TIME * 2 && !warned) {
       mp_msg(MSGT_CACHE, MSGL_WARN, "Cache not responding! [performance issue]\n");
-    if (stream_check_interrupt(CONTROL_SLEEP_TIME)) {
-      s->eof = 1;
-      return STREAM_UNSUPPORTED;
+      warned = true;
+    }
+    if (cache_wakeup_and_wait(s, &retry_time) == CACHE_INTERRUPTED) {
+      res = STREAM_UNSUPPORTED;
+      goto done;
     }
   }
-  if (s->control_res != STREAM_OK)
-    return s->control_res;
+  res = s->control_res;
+  if (res != STREAM_OK)
+    goto done;
   // We cannot do this on failure, since this would cause the
   // stream position to jump when e.g. STREAM_CTRL_SEEK_TO_TIME
   // is unsupported - but in that case we need the old value
@@ -685,7 +1274,7 @@ int cache_do_control(stream_t *stream, int cmd, void *arg) {
   // when an error happened.
   if (pos_change) {
     stream->pos = s->read_filepos;
-    stream->eof = s->eof;
+    stream->eof = s->eof_pos >= 0 && s->read_filepos >= s->eof_pos;
   }
   switch (cmd) {
     case STREAM_CTRL_GET_TIME_LENGTH:
@@ -708,5 +1297,7 @@ int cache_do_control(stream_t *stream, int cmd, void *arg) {
       *(struct stream_lang_req *)arg = s->control_lang_arg;
       break;
   }
-  return s->control_res;
+done:
+  pthread_mutex_unlock(&s->mutex);
+  return res;
 }
@@ -861,14 +861,11 @@ static int fixup_open(stream_t *stream,int seekable) {
 	int is_ultravox = strcasecmp(stream->streaming_ctrl->url->protocol, "unsv") == 0;
 
 	stream->type = STREAMTYPE_STREAM;
-	if(!is_icy && !is_ultravox && seekable)
-	{
-		stream->flags |= MP_STREAM_SEEK;
-		stream->seek = http_seek;
-	}
+	seekable = !is_icy && !is_ultravox && seekable;
 	stream->streaming_ctrl->bandwidth = network_bandwidth;
 	if ((!is_icy && !is_ultravox) || scast_streaming_start(stream))
-	if(nop_streaming_start( stream )) {
+	if(nop_streaming_start( stream ) ||
+	   (seekable && http_enable_range_requests(stream) < 0)) {
 		mp_msg(MSGT_NETWORK,MSGL_ERR,"nop_streaming_start failed\n");
 		if (stream->fd >= 0)
 			closesocket(stream->fd);
@@ -877,6 +874,8 @@ static int fixup_open(stream_t *stream,int seekable) {
 		stream->streaming_ctrl = NULL;
 		return STREAM_UNSUPPORTED;
 	}
+	if (seekable)
+		stream->flags |= MP_STREAM_SEEK;
 
 	return STREAM_OK;
 }
@@ -28,6 +28,8 @@
 #include <errno.h>
 #include <ctype.h>
 
+#include <libavutil/common.h>
+
 #include "config.h"
 #include "core/options.h"
 
@@ -169,16 +171,26 @@ URL_t *url_new_with_proxy(const char *urlstr)
 	return url_with_proxy;
 }
 
-int
-http_send_request( URL_t *url, int64_t pos ) {
+/**
+ * \brief send a HTTP GET request for the byte range [start, end]
+ * \param fd connection to send the request on, or -1 to connect to the server
+ * \param end last byte requested, or -1 to request everything after start
+ * \param keep_alive ask the server to keep the connection open (this sends a
+ *                   HTTP/1.1 request)
+ * \return the connection on success, -1 on error (fd is closed in this case)
+ */
+static int http_send_range_request(int fd, URL_t *url, int64_t start,
+                                   int64_t end, int keep_alive)
+{
 	HTTP_header_t *http_hdr;
 	URL_t *server_url;
 	char str[256];
-	int fd = -1;
 	int ret;
 	int proxy = 0;		// Boolean
 
 	http_hdr = http_new_header();
+	if (keep_alive)
+		http_hdr->http_minor_version = 1;
 
 	if( !strcasecmp(url->protocol, "http_proxy") ) {
 		proxy = 1;
@@ -223,9 +235,13 @@ http_send_request( URL_t *url, int64_t pos ) {
 	if( strcasecmp(url->protocol, "noicyx") )
 	    http_set_field(http_hdr, "Icy-MetaData: 1");
 
-	if(pos>0) {
+	if (end >= 0) {
+	    snprintf(str, sizeof(str), "Range: bytes=%"PRId64"-%"PRId64,
+	             start, end);
+	    http_set_field(http_hdr, str);
+	} else if(start>0) {
 	// Extend http_send_request with possibility to do partial content retrieval
-	    snprintf(str, sizeof(str), "Range: bytes=%"PRId64"-", (int64_t)pos);
+	    snprintf(str, sizeof(str), "Range: bytes=%"PRId64"-", start);
 	    http_set_field(http_hdr, str);
 	}
 
@@ -237,7 +253,7 @@ http_send_request( URL_t *url, int64_t pos ) {
 			http_set_field(http_hdr, network_http_header_fields[i++]);
 	}
 
-	http_set_field( http_hdr, "Connection: close");
+	http_set_field( http_hdr, keep_alive ? "Connection: keep-alive" : "Connection: close");
 	if (proxy)
 		http_add_basic_proxy_authentication(http_hdr, url->username, url->password);
 	http_add_basic_authentication(http_hdr, server_url->username, server_url->password);
@@ -245,7 +261,11 @@ http_send_request( URL_t *url, int64_t pos ) {
 		goto err_out;
 	}
 
-	if( proxy ) {
+	if (fd >= 0) {
+		if (proxy)
+			url_free(server_url);
+		server_url = NULL;
+	} else if( proxy ) {
 		if( url->port==0 ) url->port = 8080;			// Default port for the proxy server
 		fd = connect2Server( url->hostname, url->port,1 );
 		url_free( server_url );
@@ -276,6 +296,11 @@ err_out:
 	return -1;
 }
 
+int
+http_send_request( URL_t *url, int64_t pos ) {
+	return http_send_range_request(-1, url, pos, -1, 0);
+}
+
 HTTP_header_t *
 http_read_response( int fd ) {
 	HTTP_header_t *http_hdr;
@@ -361,49 +386,294 @@ http_authenticate(HTTP_header_t *http_hdr, URL_t *url, int *auth_retry) {
 	return 0;
 }
 
-int
-http_seek( stream_t *stream, int64_t pos ) {
-	HTTP_header_t *http_hdr = NULL;
-	int fd;
-	if( stream==NULL ) return 0;
+// Seekable HTTP streams are read with byte range requests. If the server
+// supports persistent connections, the ranges are bounded, so that the next
+// request (the next part of the file, or a seek) can be sent on the same
+// connection. The size of the requested ranges starts small after a seek
+// (for demuxers that seek a lot while probing or reading indexes), and grows
+// while reading sequentially, to reduce the number of requests.
+
+// Size of the first range requested after a seek.
+#define HTTP_MIN_RANGE_SIZE (64 * 1024)
+// Maximum size of a range request.
+#define HTTP_MAX_RANGE_SIZE (8 * 1024 * 1024)
+// If a seek happens while at most this many bytes of the current response are
+// left, they are read and discarded to reuse the connection. Otherwise, the
+// connection is closed and a new one is opened.
+#define HTTP_MAX_DRAIN_SIZE (64 * 1024)
+
+// State of a seekable HTTP stream (streaming_ctrl->data).
+typedef struct {
+	int64_t pos;       // file position of the next byte read from stream->fd
+	int64_t range_end; // end of the current response body, -1 if unknown
+	int range_size;    // size of the next range request
+	int persistent;    // the server keeps the current connection open
+	int keep_alive;    // 0 if the server doesn't support persistent connections
+} http_range_t;
+
+static void http_discard_buffer(streaming_ctrl_t *streaming_ctrl) {
+	free(streaming_ctrl->buffer);
+	streaming_ctrl->buffer = NULL;
+	streaming_ctrl->buffer_size = 0;
+	streaming_ctrl->buffer_pos = 0;
+}
 
-	if( stream->fd>0 ) closesocket(stream->fd); // need to reconnect to seek in http-stream
-	fd = http_send_request( stream->streaming_ctrl->url, pos );
-	if( fd<0 ) return 0;
+static void http_close_connection(stream_t *stream) {
+	http_range_t *st = stream->streaming_ctrl->data;
+	if (stream->fd >= 0)
+		closesocket(stream->fd);
+	stream->fd = -1;
+	st->persistent = 0;
+	http_discard_buffer(stream->streaming_ctrl);
+}
 
-	http_hdr = http_read_response( fd );
+// Whether the connection can be used for another request after the response
+// body has been read completely.
+static int http_is_persistent(HTTP_header_t *http_hdr) {
+	const char *connection = http_get_field(http_hdr, "Connection");
+	// Without Content-Length, the end of the body is the end of the
+	// connection (chunked transfer encoding is not supported).
+	if (!http_get_field(http_hdr, "Content-Length") ||
+	    http_get_field(http_hdr, "Transfer-Encoding"))
+		return 0;
+	if (http_hdr->http_minor_version >= 1)
+		return !connection || strcasecmp(connection, "close");
+	return connection && !strcasecmp(connection, "keep-alive");
+}
 
-	if( http_hdr==NULL ) return 0;
+// Check whether an idle persistent connection wasn't closed by the server.
+static int http_connection_alive(int fd) {
+#ifdef MSG_DONTWAIT
+	char c;
+	int r = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+#else
+	return 1;
+#endif
+}
+
+// Read and discard the rest of the current response body.
+static int http_drain(stream_t *stream) {
+	http_range_t *st = stream->streaming_ctrl->data;
+	char buf[4096];
+	while (st->pos < st->range_end) {
+		int len = FFMIN(st->range_end - st->pos, sizeof(buf));
+		len = nop_streaming_read(stream->fd, buf, len, stream->streaming_ctrl);
+		if (len <= 0)
+			return 0;
+		st->pos += len;
+	}
+	return 1;
+}
+
+/**
+ * \brief request the file starting at pos
+ * \return 1 on success, 0 on error (stream->fd is -1 in this case)
+ */
+static int http_range_request(stream_t *stream, int64_t pos) {
+	streaming_ctrl_t *streaming_ctrl = stream->streaming_ctrl;
+	http_range_t *st = streaming_ctrl->data;
+	HTTP_header_t *http_hdr = NULL;
+	int reuse = stream->fd >= 0 && st->persistent && st->range_end >= 0 &&
+	            st->range_end - st->pos <= HTTP_MAX_DRAIN_SIZE &&
+	            http_drain(stream) && http_connection_alive(stream->fd);
+	if (!reuse)
+		http_close_connection(stream);
+	http_discard_buffer(streaming_ctrl);
+
+	// Bounded ranges need the file size, and are pointless if every request
+	// needs a new connection anyway.
+	int keep_alive = st->keep_alive && stream->end_pos > 0;
+	int64_t end = -1;
+	if (keep_alive) {
+		end = pos + st->range_size;
+		// The reader knows better how much it's going to read.
+		if (stream->read_end_hint > pos)
+			end = stream->read_end_hint;
+		end = FFMIN(end, stream->end_pos) - 1;
+	}
+
+	mp_msg(MSGT_NETWORK, MSGL_DBG2, "HTTP: request %"PRId64"-%"PRId64" on %s "
+	       "connection\n", pos, end, reuse ? "existing" : "new");
+	stream->fd = http_send_range_request(stream->fd, streaming_ctrl->url,
+	                                     pos, end, keep_alive);
+	if (stream->fd >= 0)
+		http_hdr = http_read_response(stream->fd);
+	if (!http_hdr && reuse) {
+		// The server closed the connection in the meantime.
+		http_close_connection(stream);
+		st->persistent = 0;
+		return http_range_request(stream, pos);
+	}
+	if (!http_hdr)
+		goto err_out;
 
 	if( mp_msg_test(MSGT_NETWORK,MSGL_V) )
 		http_debug_hdr( http_hdr );
 
 	switch( http_hdr->status_code ) {
 		case 200:
+			if (pos > 0) {
+				mp_msg(MSGT_NETWORK, MSGL_ERR, "Server ignored range "
+				       "request, can't seek.\n");
+				goto err_out;
+			}
+			// fall through
 		case 206: // OK
 			mp_msg(MSGT_NETWORK,MSGL_V,"Content-Type: [%s]\n", http_get_field(http_hdr, "Content-Type") );
 			mp_msg(MSGT_NETWORK,MSGL_V,"Content-Length: [%s]\n", http_get_field(http_hdr, "Content-Length") );
-			if( http_hdr->body_size>0 ) {
-				if( streaming_bufferize( stream->streaming_ctrl, http_hdr->body, http_hdr->body_size )<0 ) {
-					http_free( http_hdr );
-					return -1;
-				}
-			}
 			break;
 		default:
 			mp_tmsg(MSGT_NETWORK,MSGL_ERR,"Server returns %d: %s\n", http_hdr->status_code, http_hdr->reason_phrase );
-			closesocket( fd );
-			fd = -1;
+			goto err_out;
 	}
-	stream->fd = fd;
 
-	if( http_hdr ) {
-		http_free( http_hdr );
-		stream->streaming_ctrl->data = NULL;
+	if (keep_alive && http_get_field(http_hdr, "Transfer-Encoding")) {
+		// Can't parse this; retry the old way.
+		mp_msg(MSGT_NETWORK, MSGL_V, "HTTP: disabling keep-alive.\n");
+		http_free(http_hdr);
+		st->keep_alive = 0;
+		http_close_connection(stream);
+		return http_range_request(stream, pos);
+	}
+
+	st->pos = pos;
+	st->range_end = -1;
+	const char *content_length = http_get_field(http_hdr, "Content-Length");
+	if (content_length)
+		st->range_end = pos + atoll(content_length);
+	st->persistent = keep_alive && http_is_persistent(http_hdr);
+	if (keep_alive && !st->persistent) {
+		mp_msg(MSGT_NETWORK, MSGL_V, "HTTP: server doesn't support "
+		       "persistent connections.\n");
+		st->keep_alive = 0;
+	}
+
+	if( http_hdr->body_size>0 ) {
+		if( streaming_bufferize( streaming_ctrl, http_hdr->body, http_hdr->body_size )<0 )
+			goto err_out;
+	}
+	http_free( http_hdr );
+	return 1;
+
+err_out:
+	http_free( http_hdr );
+	http_close_connection(stream);
+	return 0;
+}
+
+static int http_fill_buffer(stream_t *stream, char *buffer, int max_len) {
+	http_range_t *st = stream->streaming_ctrl->data;
+	if (st->range_end >= 0 && st->pos >= st->range_end) {
+		if (stream->end_pos && st->pos >= stream->end_pos)
+			return 0; // EOF
+		// Request the next part; we're reading sequentially.
+		st->range_size = FFMIN(st->range_size * 2, HTTP_MAX_RANGE_SIZE);
+		if (!http_range_request(stream, st->pos))
+			return -1;
 	}
+	if (stream->fd < 0)
+		return -1;
+	if (st->range_end >= 0)
+		max_len = FFMIN(max_len, st->range_end - st->pos);
+	int len = nop_streaming_read(stream->fd, buffer, max_len,
+	                             stream->streaming_ctrl);
+	if (len <= 0 && st->range_end < 0)
+		stream->eof = 1; // the body ends with the connection
+	st->pos += len;
+	return len;
+}
 
-	stream->pos=pos;
+static void http_close(stream_t *stream) {
+	streaming_ctrl_free(stream->streaming_ctrl);
+	stream->streaming_ctrl = NULL;
+}
 
+static http_range_t *http_range_new(stream_t *stream) {
+	http_range_t *st = calloc(1, sizeof(http_range_t));
+	if (!st)
+		return NULL;
+	st->range_end = stream->end_pos > 0 ? stream->end_pos : -1;
+	st->range_size = HTTP_MIN_RANGE_SIZE;
+	st->keep_alive = 1;
+	return st;
+}
+
+/**
+ * \brief open a second connection to the same file
+ *
+ * The new stream is independent from the old one and can be used from another
+ * thread. Nothing is requested until it's read from or seeked.
+ */
+static int http_control(stream_t *stream, int cmd, void *arg);
+
+static stream_t *http_clone(stream_t *stream) {
+	streaming_ctrl_t *sc = stream->streaming_ctrl;
+	stream_t *clone = new_stream(-1, stream->type);
+	clone->streaming_ctrl = streaming_ctrl_new();
+	if (!clone->streaming_ctrl)
+		goto err_out;
+	clone->streaming_ctrl->url = url_new(sc->url->url);
+	clone->streaming_ctrl->bandwidth = sc->bandwidth;
+	clone->streaming_ctrl->status = streaming_playing_e;
+	clone->streaming_ctrl->data = http_range_new(stream);
+	if (!clone->streaming_ctrl->url || !clone->streaming_ctrl->data)
+		goto err_out;
+	http_range_t *st = clone->streaming_ctrl->data;
+	st->range_end = 0; // request the first range on the first read
+	clone->url = strdup(stream->url);
+	clone->flags = stream->flags;
+	clone->mode = stream->mode;
+	clone->streaming = stream->streaming;
+	clone->end_pos = stream->end_pos;
+	clone->opts = stream->opts;
+	clone->fill_buffer = http_fill_buffer;
+	clone->seek = http_seek;
+	clone->control = http_control;
+	clone->close = http_close;
+	return clone;
+
+err_out:
+	free_stream(clone);
+	return NULL;
+}
+
+static int http_control(stream_t *stream, int cmd, void *arg) {
+	switch (cmd) {
+	case STREAM_CTRL_CLONE:
+		*(stream_t **)arg = http_clone(stream);
+		return *(stream_t **)arg ? STREAM_OK : STREAM_ERROR;
+	}
+	return STREAM_UNSUPPORTED;
+}
+
+/**
+ * \brief read the stream with (keep-alive) range requests from now on
+ *
+ * The stream must be at the start of the file, with the response body of the
+ * first request in streaming_ctrl->buffer.
+ */
+int http_enable_range_requests(stream_t *stream) {
+	http_range_t *st = http_range_new(stream);
+	if (!st)
+		return -1;
+	free(stream->streaming_ctrl->data);
+	stream->streaming_ctrl->data = st;
+	stream->streaming_ctrl->streaming_read = NULL;
+	stream->fill_buffer = http_fill_buffer;
+	stream->seek = http_seek;
+	stream->control = http_control;
+	stream->close = http_close;
+	return 0;
+}
+
+int
+http_seek( stream_t *stream, int64_t pos ) {
+	http_range_t *st = stream->streaming_ctrl->data;
+	st->range_size = HTTP_MIN_RANGE_SIZE;
+	if (!http_range_request(stream, pos))
+		return 0;
+	stream->pos = pos;
 	return 1;
 }
 
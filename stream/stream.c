@@ -42,7 +42,6 @@
 #endif
 
 #include "core/mp_msg.h"
-#include "osdep/shmem.h"
 #include "osdep/timer.h"
 #include "network.h"
 #include "stream.h"
@@ -297,6 +296,7 @@ static int stream_reconnect(stream_t *s)
 int stream_read_internal(stream_t *s, void *buf, int len)
 {
   int orig_len = len;
+  unsigned int start_time = GetTimer();
   // we will retry even if we already reached EOF previously.
   switch(s->type){
   case STREAMTYPE_STREAM:
@@ -321,6 +321,7 @@ int stream_read_internal(stream_t *s, void *buf, int len)
   default:
     len= s->fill_buffer ? s->fill_buffer(s, buf, len) : 0;
   }
+  s->read_time += GetTimer() - start_time;
   if(len<=0){
     // do not retry if this looks like proper eof
     if (s->eof || (s->end_pos && s->pos == s->end_pos))
@@ -342,11 +343,22 @@ eof_out:
   // This e.g. avoids issues with eof getting stuck when lavf seeks in MPEG-TS
   s->eof=0;
   s->pos+=len;
+  s->read_calls++;
+  s->read_bytes+=len;
   return len;
 }
 
 int stream_fill_buffer(stream_t *s){
-  int len = stream_read_internal(s, s->buffer, STREAM_BUFFER_SIZE);
+  int size = STREAM_BUFFER_SIZE;
+  if (s->max_read_size > size) {
+    // Called again without seeking in between: the data is read sequentially.
+    if (s->read_size)
+      s->read_size = FFMIN(s->read_size * 2, s->max_read_size);
+    else
+      s->read_size = size;
+    size = s->read_size;
+  }
+  int len = stream_read_internal(s, s->buffer, size);
   if (len <= 0)
     return 0;
   s->buf_pos=0;
@@ -355,6 +367,59 @@ int stream_fill_buffer(stream_t *s){
   return len;
 }
 
+/**
+ * Return a pointer to the data at the current stream position, and skip up to
+ * len bytes. This avoids copying the data if the stream is memory mapped. The
+ * pointer stays valid until the stream is closed; the data must not be
+ * modified.
+ * \return number of bytes available at *data (can be less than len at EOF),
+ *         0 if direct access is not possible (the stream position is not
+ *         changed in this case, and stream_read() must be used instead)
+ */
+int stream_read_ptr(stream_t *s, int len, unsigned char **data)
+{
+  // With the cache enabled, the position of the underlying stream belongs to
+  // the cache thread.
+  if (!s->mapped_data || s->cache_data || len <= 0)
+    return 0;
+  int64_t pos = stream_tell(s);
+  if (pos < 0 || pos >= s->mapped_size)
+    return 0;
+  len = FFMIN(len, s->mapped_size - pos);
+  *data = s->mapped_data + pos;
+  // Time spent in page faults can't be measured here; it's counted wherever
+  // the data is accessed.
+  s->read_calls++;
+  s->read_bytes += len;
+  s->pos = pos + len;
+  s->buf_pos = s->buf_len = 0;
+  s->eof = 0;
+  return len;
+}
+
+/**
+ * Read up to len bytes. Unlike stream_read(), this returns after the first
+ * low level read, and large reads bypass s->buffer if the stream supports
+ * reads of arbitrary size (max_read_size set), so the data is copied from the
+ * kernel straight into buf. Data already in s->buffer is returned first.
+ * \return number of bytes read, 0 on EOF
+ */
+int stream_read_direct(stream_t *s, void *buf, int len)
+{
+  int buffered = s->buf_len - s->buf_pos;
+  if (buffered > 0 || len < STREAM_BUFFER_SIZE || !s->max_read_size ||
+      s->cache_data || s->mapped_data)
+  {
+    if (buffered > 0)
+      len = FFMIN(len, buffered);
+    return stream_read(s, buf, len);
+  }
+  // s->buffer is empty, but stream_seek() must not reuse its stale contents
+  // for positions before s->pos.
+  s->buf_pos = s->buf_len = 0;
+  return stream_read_internal(s, buf, len);
+}
+
 int stream_write_buffer(stream_t *s, unsigned char *buf, int len) {
   int rd;
   if(!s->write_buffer)
@@ -423,6 +488,7 @@ int64_t newpos=0;
 //  if( mp_msg_test(MSGT_STREAM,MSGL_DBG3) ) printf("seek_long to 0x%X\n",(unsigned int)pos);
 
   s->buf_pos=s->buf_len=0;
+  s->read_size=0;
 
   if(s->mode == STREAM_WRITE) {
     if(!s->seek || !s->seek(s,pos))
@@ -472,6 +538,7 @@ void stream_reset(stream_t *s){
   if(s->eof){
     s->pos=0;
     s->buf_pos=s->buf_len=0;
+    s->read_size=0;
     s->eof=0;
   }
   if(s->control) s->control(s,STREAM_CTRL_RESET,NULL);
@@ -480,7 +547,7 @@ void stream_reset(stream_t *s){
 
 int stream_control(stream_t *s, int cmd, void *arg){
 #ifdef CONFIG_STREAM_CACHE
-  if (s->cache_pid)
+  if (s->cache_data)
     return cache_do_control(s, cmd, arg);
 #endif
   if(!s->control) return STREAM_UNSUPPORTED;
@@ -525,6 +592,7 @@ stream_t* new_stream(int fd,int type){
 
   s->fd=fd;
   s->type=type;
+  s->open_time=GetTimerMS();
   stream_reset(s);
   return s;
 }
@@ -535,6 +603,14 @@ void free_stream(stream_t *s){
     cache_uninit(s);
 #endif
 
+  if (s->read_calls) {
+    double secs = FFMAX((GetTimerMS() - s->open_time) / 1000.0, 0.001);
+    mp_msg(MSGT_STREAM, MSGL_V, "Stream: %"PRIu64" reads, %"PRIu64" bytes "
+           "(%.1f reads/s, %.1f KiB/s, %.1f KiB/read)\n", s->read_calls,
+           s->read_bytes, s->read_calls / secs, s->read_bytes / 1024.0 / secs,
+           s->read_bytes / 1024.0 / s->read_calls);
+  }
+
   if(s->close) s->close(s);
   if(s->fd>0){
     /* on unix we define closesocket to close
@@ -25,6 +25,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <inttypes.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -58,6 +59,8 @@
 
 #define STREAM_BUFFER_SIZE 2048
 #define STREAM_MAX_SECTOR_SIZE (8*1024)
+// Upper limit for stream_t.max_read_size
+#define STREAM_MAX_BUFFER_SIZE (128*1024)
 
 #define VCD_SECTOR_SIZE 2352
 #define VCD_SECTOR_OFFS 24
@@ -101,6 +104,9 @@
 #define STREAM_CTRL_GET_CACHE_SIZE 15
 #define STREAM_CTRL_GET_CACHE_FILL 16
 #define STREAM_CTRL_GET_CACHE_IDLE 17
+// Open an independent stream (e.g. a new network connection) to the same
+// file. arg is a stream_t **, which is set to the new stream.
+#define STREAM_CTRL_CLONE 18
 
 struct stream_lang_req {
 	int type; // STREAM_AUDIO, STREAM_SUB
@@ -164,22 +170,37 @@ typedef struct stream {
   int flags;
   int sector_size; // sector size (seek will be aligned on this size if non 0)
   int read_chunk; // maximum amount of data to read at once to limit latency (0 for default)
+  // If set, stream_fill_buffer() starts with reads of STREAM_BUFFER_SIZE and
+  // doubles the read size on each sequential read up to this value. Seeking
+  // goes back to small reads.
+  int max_read_size;
+  int read_size;  // current stream_fill_buffer() read size
   unsigned int buf_pos,buf_len;
   int64_t pos,start_pos,end_pos;
+  // Position up to which the stream is expected to be read before the next
+  // seek, or 0 if unknown. Network streams can use it to size requests.
+  int64_t read_end_hint;
   int eof;
   int mode; //STREAM_READ or STREAM_WRITE
   bool streaming;       // known to be a network stream if true
   int cache_size;       // cache size in KB to use if enabled
   bool cached;          // cache active
-  unsigned int cache_pid;
-  void* cache_data;
+  void* cache_data;     // cache state, non-NULL if the cache thread runs
   void* priv; // used for DVD, TV, RTSP etc
   char* url;  // strdup() of filename/url
   char *mime_type; // when HTTP streaming is used
   char *lavf_type; // name of expected demuxer type for lavf
   struct MPOpts *opts;
+  // If not NULL, the stream contents [0, mapped_size) are accessible in
+  // memory. Set by the stream implementation (see stream_read_ptr()).
+  unsigned char *mapped_data;
+  int64_t mapped_size;
   streaming_ctrl_t *streaming_ctrl;
-  unsigned char buffer[STREAM_BUFFER_SIZE>STREAM_MAX_SECTOR_SIZE?STREAM_BUFFER_SIZE:STREAM_MAX_SECTOR_SIZE];
+  // statistics (number of low level reads, and bytes returned by them):
+  uint64_t read_calls, read_bytes;
+  uint64_t read_time; // microseconds spent in low level reads
+  unsigned int open_time;
+  unsigned char buffer[STREAM_MAX_BUFFER_SIZE];
 } stream_t;
 
 #ifdef CONFIG_NETWORKING
@@ -203,6 +224,8 @@ int cache_stream_seek_long(stream_t *s,int64_t pos);
 #define stream_enable_cache_percent(x,y,z,w) 1
 #endif
 int stream_write_buffer(stream_t *s, unsigned char *buf, int len);
+int stream_read_ptr(stream_t *s, int len, unsigned char **data);
+int stream_read_direct(stream_t *s, void *buf, int len);
 
 inline static int stream_read_char(stream_t *s){
   return (s->buf_pos<s->buf_len)?s->buffer[s->buf_pos++]:
@@ -281,6 +304,15 @@ inline static int stream_read(stream_t *s,char* mem,int total){
   while(len>0){
     int x;
     x=s->buf_len-s->buf_pos;
+    if(x==0 && s->mapped_data){
+      unsigned char *ptr;
+      x=stream_read_ptr(s,len,&ptr);
+      if(x>0){
+        memcpy(mem,ptr,x);
+        mem+=x; len-=x;
+        continue;
+      }
+    }
     if(x==0){
       if(!cache_stream_fill_buffer(s)) return total-len; // EOF
       x=s->buf_len-s->buf_pos;
@@ -303,6 +335,21 @@ inline static int64_t stream_tell(stream_t *s){
   return s->pos+s->buf_pos-s->buf_len;
 }
 
+// Return the data that is already in the buffer at the current position,
+// without reading anything. If the buffer is empty and the stream is memory
+// mapped, this is the rest of the mapped file. Valid until the next read,
+// skip or seek.
+inline static unsigned char *stream_buffered_data(stream_t *s, int *len){
+  *len=s->buf_len-s->buf_pos;
+  if(*len==0 && s->mapped_data && !s->cache_data &&
+     s->pos>=0 && s->pos<s->mapped_size){
+    int64_t left=s->mapped_size-s->pos;
+    *len=left>INT_MAX?INT_MAX:left;
+    return s->mapped_data+s->pos;
+  }
+  return &s->buffer[s->buf_pos];
+}
+
 inline static int stream_seek(stream_t *s,int64_t pos){
 
   mp_dbg(MSGT_DEMUX, MSGL_DBG3, "seek to 0x%llX\n", (long long)pos);
@@ -332,6 +379,14 @@ inline static int stream_skip(stream_t *s,int64_t len){
   }
   while(len>0){
     int x=s->buf_len-s->buf_pos;
+    if(x==0 && s->mapped_data){
+      unsigned char *ptr;
+      x=stream_read_ptr(s,len>INT_MAX?INT_MAX:len,&ptr);
+      if(x>0){
+        len-=x;
+        continue;
+      }
+    }
     if(x==0){
       if(!cache_stream_fill_buffer(s)) return 0; // EOF
       x=s->buf_len-s->buf_pos;
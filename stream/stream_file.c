@@ -19,18 +19,28 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 
+#include <libavutil/common.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 #include "osdep/io.h"
 
 #include "core/mp_msg.h"
 #include "stream.h"
 #include "core/m_option.h"
 #include "core/m_struct.h"
+#include "core/options.h"
 
 static struct stream_priv_s {
   char* filename;
@@ -53,10 +63,51 @@ static const struct m_struct_st stream_opts = {
   stream_opts_fields
 };
 
+// Number of reads in a row continuing at the previous read position after
+// which the file is considered to be read sequentially.
+#define SEQUENTIAL_READS 4
+// Amount of data the kernel is asked to prefetch ahead of the read position
+// when reading sequentially.
+#define READAHEAD_SIZE (4 * 1024 * 1024)
+
+// Private state for seekable files.
+struct file_priv {
+  int64_t next_pos;     // file position after the last read
+  int sequential_reads; // number of sequential reads in a row
+  int64_t advised_end;  // end of the prefetch range requested last
+};
+
+static void update_readahead(stream_t *s)
+{
+  struct file_priv *p = s->priv;
+  if (!p)
+    return;
+  if (s->pos != p->next_pos) {
+    p->sequential_reads = 0;
+    p->advised_end = 0;
+    return;
+  }
+  if (++p->sequential_reads < SEQUENTIAL_READS)
+    return;
+#ifdef HAVE_POSIX_FADVISE
+  // Extend the prefetch window when half of it has been consumed, so that
+  // this costs one extra syscall per READAHEAD_SIZE/2 bytes.
+  if (s->pos + READAHEAD_SIZE / 2 >= p->advised_end) {
+    int64_t start = FFMAX(s->pos, p->advised_end);
+    int64_t end = s->pos + READAHEAD_SIZE;
+    posix_fadvise(s->fd, start, end - start, POSIX_FADV_WILLNEED);
+    p->advised_end = end;
+  }
+#endif
+}
+
 static int fill_buffer(stream_t *s, char* buffer, int max_len){
+  update_readahead(s);
   int r = read(s->fd,buffer,max_len);
   // We are certain this is EOF, do not retry
   if (max_len && r == 0) s->eof = 1;
+  if (s->priv && r > 0)
+    ((struct file_priv *)s->priv)->next_pos = s->pos + r;
   return (r <= 0) ? -1 : r;
 }
 
@@ -97,6 +148,58 @@ static int seek_forward(stream_t *s,int64_t newpos) {
   return 1;
 }
 
+#ifdef HAVE_SYS_MMAN_H
+// Used if the file is mapped into memory. Reading doesn't depend on the file
+// position of the fd, so seeking is free. Data past the mapped size (e.g. if
+// the file has grown since opening it) is read with normal I/O.
+static int fill_buffer_mapped(stream_t *s, char* buffer, int max_len){
+  if (s->pos < s->mapped_size) {
+    int len = FFMIN(max_len, s->mapped_size - s->pos);
+    memcpy(buffer, s->mapped_data + s->pos, len);
+    return len;
+  }
+  if (lseek(s->fd, s->pos, SEEK_SET) < 0)
+    return -1;
+  return fill_buffer(s, buffer, max_len);
+}
+
+static int seek_mapped(stream_t *s,int64_t newpos) {
+  s->pos = newpos;
+  return 1;
+}
+
+
+static void map_file(stream_t *stream, int64_t len)
+{
+  if (len <= 0 || len > SIZE_MAX)
+    return;
+  void *p = mmap(NULL, len, PROT_READ, MAP_SHARED, stream->fd, 0);
+  if (p == MAP_FAILED) {
+    mp_msg(MSGT_OPEN, MSGL_V, "[file] mmap failed: %s\n", strerror(errno));
+    return;
+  }
+#ifdef POSIX_MADV_SEQUENTIAL
+  posix_madvise(p, len, POSIX_MADV_SEQUENTIAL);
+#endif
+  stream->mapped_data = p;
+  stream->mapped_size = len;
+  stream->fill_buffer = fill_buffer_mapped;
+  stream->seek = seek_mapped;
+  mp_msg(MSGT_OPEN, MSGL_V, "[file] File is memory mapped.\n");
+}
+#endif
+
+static void close_f(stream_t *s) {
+#ifdef HAVE_SYS_MMAN_H
+  if (s->mapped_data)
+    munmap(s->mapped_data, s->mapped_size);
+  s->mapped_data = NULL;
+  s->mapped_size = 0;
+#endif
+  free(s->priv);
+  s->priv = NULL;
+}
+
 static int control(stream_t *s, int cmd, void *arg) {
   switch(cmd) {
     case STREAM_CTRL_GET_SIZE: {
@@ -202,6 +305,8 @@ static int open_f(stream_t *stream,int mode, void* opts, int* file_format) {
     stream->seek = seek;
     stream->end_pos = len;
     stream->type = STREAMTYPE_FILE;
+    if (mode == STREAM_READ)
+      stream->priv = calloc(1, sizeof(struct file_priv));
   }
 
   mp_msg(MSGT_OPEN,MSGL_V,"[file] File size is %"PRId64" bytes\n", (int64_t)len);
@@ -210,7 +315,15 @@ static int open_f(stream_t *stream,int mode, void* opts, int* file_format) {
   stream->fill_buffer = fill_buffer;
   stream->write_buffer = write_buffer;
   stream->control = control;
+  stream->close = close_f;
   stream->read_chunk = 64*1024;
+  stream->max_read_size = STREAM_MAX_BUFFER_SIZE;
+
+#ifdef HAVE_SYS_MMAN_H
+  if (mode == STREAM_READ && stream->type == STREAMTYPE_FILE &&
+      stream->opts && stream->opts->file_mmap)
+    map_file(stream, len);
+#endif
 
   m_struct_free(&stream_opts,opts);
   return STREAM_OK;
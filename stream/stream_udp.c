@@ -20,15 +20,352 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+// for recvmmsg()
+#define _GNU_SOURCE
+
 #include "config.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#if !HAVE_WINSOCK2_H
+#include <sys/socket.h>
+#else
+#include <winsock2.h>
+#endif
+
+#include <libavutil/common.h>
+#include <libavutil/intreadwrite.h>
 
+#include "core/options.h"
+#include "core/mp_msg.h"
+#include "osdep/timer.h"
 #include "stream.h"
 #include "url.h"
 #include "udp.h"
 
+// Datagrams are received in batches into a ring buffer, which doubles as
+// jitter buffer. If the datagrams are RTP packets, they're put back into the
+// order given by the RTP sequence numbers: a missing packet is waited for
+// until a later packet has been in the buffer for --udp-jitter-buffer
+// milliseconds, then it's counted as lost. Plain UDP has no sequence numbers,
+// so the datagrams are passed on in the order they're received.
+
+// Maximum number of datagrams received with one system call.
+#define UDP_BATCH 32
+// Number of datagrams the ring buffer can hold (must be a power of 2).
+#define UDP_RING_SIZE 512
+// Maximum datagram size. MPEG-TS is usually sent as 7 * 188 bytes.
+#define UDP_MAX_PACKET 4096
+
+struct udp_packet {
+  int64_t seq;       // sequence number, -1 if the slot is unused
+  unsigned int time; // GetTimerMS() when it was received
+  int len;
+  unsigned char data[UDP_MAX_PACKET];
+};
+
+struct udp_priv {
+  struct udp_packet *ring;  // UDP_RING_SIZE entries, indexed by seq
+  unsigned char *recv_buf;  // UDP_BATCH * UDP_MAX_PACKET bytes
+  int jitter_ms;
+  int rtp;          // 1 if RTP, 0 if plain UDP, -1 if not known yet
+  int64_t next_seq; // sequence number of the next packet to pass on
+  int64_t max_seq;  // highest sequence number received so far
+  int read_pos;     // bytes of the packet at next_seq already passed on
+  // statistics:
+  uint64_t packets;   // datagrams received
+  uint64_t lost;      // never received
+  uint64_t late;      // received after they were considered lost
+  uint64_t reordered; // received out of order, but in time
+  uint64_t overflows; // discarded because the ring buffer was full
+  uint64_t truncated; // larger than UDP_MAX_PACKET
+  uint32_t kernel_drops; // dropped by the kernel (socket buffer full)
+};
+
+// If the datagram is an RTP packet carrying MPEG-TS, return the size of the
+// RTP header, and reduce *len by the size of the padding. Otherwise, return -1.
+static int
+rtp_header_size (unsigned char *d, int *len)
+{
+  if (*len < 12 || (d[0] & 0xC0) != 0x80)
+    return -1;
+  int size = 12 + (d[0] & 0x0F) * 4;
+  if (d[0] & 0x10)
+  {
+    if (*len < size + 4)
+      return -1;
+    size += 4 + AV_RB16 (d + size + 2) * 4;
+  }
+  int end = *len;
+  if (d[0] & 0x20)
+    end -= d[*len - 1];
+  if (size >= end || d[size] != 0x47)
+    return -1;
+  *len = end;
+  return size;
+}
+
+static struct udp_packet *
+ring_slot (struct udp_priv *p, int64_t seq)
+{
+  return &p->ring[seq & (UDP_RING_SIZE - 1)];
+}
+
+// Forget all packets before seq.
+static void
+udp_skip (struct udp_priv *p, int64_t seq)
+{
+  for (int64_t n = p->next_seq; n < seq; n++)
+  {
+    struct udp_packet *pkt = ring_slot (p, n);
+    if (pkt->seq == n)
+    {
+      pkt->seq = -1;
+      p->overflows++;
+    }
+    else
+      p->lost++;
+  }
+  p->next_seq = seq;
+  p->max_seq = FFMAX (p->max_seq, seq - 1);
+  p->read_pos = 0;
+}
+
+static void
+udp_queue_packet (struct udp_priv *p, unsigned char *d, int len)
+{
+  int64_t seq = p->max_seq + 1;
+
+  if (p->rtp < 0)
+  {
+    int rtp_len = len;
+    p->rtp = rtp_header_size (d, &rtp_len) >= 0;
+    mp_msg (MSGT_NETWORK, MSGL_V, "UDP: receiving %s.\n",
+            p->rtp ? "RTP" : "plain UDP");
+  }
+  if (p->rtp)
+  {
+    int hdr = rtp_header_size (d, &len);
+    if (hdr < 0)
+    {
+      mp_msg (MSGT_NETWORK, MSGL_DBG2, "UDP: ignoring non-RTP datagram.\n");
+      return;
+    }
+    uint16_t rtp_seq = AV_RB16 (d + 2);
+    if (p->packets)
+      seq = p->max_seq + (int16_t)(rtp_seq - (uint16_t)p->max_seq);
+    else
+      p->next_seq = seq = rtp_seq;
+    d += hdr;
+    len -= hdr;
+    // A far jump means the sender was restarted.
+    if (seq < p->next_seq - UDP_RING_SIZE ||
+        seq >= p->next_seq + 4 * UDP_RING_SIZE)
+    {
+      mp_msg (MSGT_NETWORK, MSGL_V, "UDP: RTP sequence discontinuity.\n");
+      for (int n = 0; n < UDP_RING_SIZE; n++)
+        p->ring[n].seq = -1;
+      p->next_seq = seq;
+      p->max_seq = seq - 1;
+      p->read_pos = 0;
+    }
+  }
+  p->packets++;
+
+  struct udp_packet *pkt = ring_slot (p, seq);
+  if (seq < p->next_seq)
+  {
+    p->late++;
+    return;
+  }
+  if (seq <= p->max_seq)
+  {
+    if (pkt->seq == seq)
+      return; // duplicate
+    p->reordered++;
+  }
+  if (seq - p->next_seq >= UDP_RING_SIZE)
+  {
+    // The reader doesn't keep up; make room by dropping the oldest data.
+    udp_skip (p, seq - UDP_RING_SIZE + 1);
+  }
+  pkt->seq = seq;
+  pkt->time = GetTimerMS ();
+  pkt->len = len;
+  memcpy (pkt->data, d, len);
+  p->max_seq = FFMAX (p->max_seq, seq);
+}
+
+#ifdef HAVE_RECVMMSG
+// Update the number of datagrams dropped by the kernel from the
+// SO_RXQ_OVFL control message.
+static void
+udp_check_overflow (struct udp_priv *p, struct msghdr *msg)
+{
+#ifdef SO_RXQ_OVFL
+  for (struct cmsghdr *c = CMSG_FIRSTHDR (msg); c; c = CMSG_NXTHDR (msg, c))
+  {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL)
+    {
+      uint32_t drops;
+      memcpy (&drops, CMSG_DATA (c), sizeof (drops));
+      if (drops != p->kernel_drops)
+        mp_msg (MSGT_NETWORK, MSGL_V, "UDP: %"PRIu32" datagrams dropped by "
+                "the kernel.\n", drops - p->kernel_drops);
+      p->kernel_drops = drops;
+    }
+  }
+#endif
+}
+#endif
+
+// Receive the datagrams available on the socket. If there are none, wait up
+// to timeout milliseconds for one (forever if timeout is negative).
+// Returns -1 on error, otherwise the number of datagrams received.
+static int
+udp_receive (stream_t *s, struct udp_priv *p, int timeout)
+{
+  if (timeout >= 0)
+  {
+    fd_set set;
+    struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+    FD_ZERO (&set);
+    FD_SET (s->fd, &set);
+    int r = select (s->fd + 1, &set, NULL, NULL, &tv);
+    if (r <= 0)
+      return r < 0 && errno != EINTR ? -1 : 0;
+  }
+
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec iov[UDP_BATCH];
+  union {
+    char buf[CMSG_SPACE (sizeof (uint32_t))];
+    struct cmsghdr align;
+  } control[UDP_BATCH];
+  for (int n = 0; n < UDP_BATCH; n++)
+  {
+    iov[n].iov_base = p->recv_buf + n * UDP_MAX_PACKET;
+    iov[n].iov_len = UDP_MAX_PACKET;
+    msgs[n].msg_hdr = (struct msghdr) {
+      .msg_iov = &iov[n],
+      .msg_iovlen = 1,
+      .msg_control = control[n].buf,
+      .msg_controllen = sizeof (control[n].buf),
+    };
+  }
+  int num = recvmmsg (s->fd, msgs, UDP_BATCH, MSG_WAITFORONE, NULL);
+  if (num < 0)
+    return errno == EINTR || errno == EAGAIN ? 0 : -1;
+  for (int n = 0; n < num; n++)
+  {
+    udp_check_overflow (p, &msgs[n].msg_hdr);
+    if (msgs[n].msg_hdr.msg_flags & MSG_TRUNC)
+    {
+      p->truncated++;
+      continue;
+    }
+    udp_queue_packet (p, iov[n].iov_base, msgs[n].msg_len);
+  }
+  return num;
+#else
+  int len = recv (s->fd, p->recv_buf, UDP_MAX_PACKET, 0);
+  if (len < 0)
+    return errno == EINTR ? 0 : -1;
+  udp_queue_packet (p, p->recv_buf, len);
+  return 1;
+#endif
+}
+
+// Return how long to wait for more data before the next packet can be passed
+// on: 0 if it can be passed on now, -1 if there are no packets at all. Gives
+// up on a missing packet if later packets are waiting for too long.
+static int
+udp_check_gap (struct udp_priv *p)
+{
+  if (p->next_seq > p->max_seq)
+    return -1;
+  if (ring_slot (p, p->next_seq)->seq == p->next_seq)
+    return 0;
+  int64_t seq = p->next_seq + 1;
+  while (ring_slot (p, seq)->seq != seq)
+    seq++; // terminates at max_seq at the latest
+  int waited = GetTimerMS () - ring_slot (p, seq)->time;
+  if (waited < p->jitter_ms)
+    return p->jitter_ms - waited;
+  mp_msg (MSGT_NETWORK, MSGL_V, "UDP: %"PRId64" packets lost.\n",
+          seq - p->next_seq);
+  udp_skip (p, seq);
+  return 0;
+}
+
+// Copy the packets that are next in order to buf.
+static int
+udp_deliver (struct udp_priv *p, char *buf, int max_len)
+{
+  int total = 0;
+  while (total < max_len && p->next_seq <= p->max_seq)
+  {
+    struct udp_packet *pkt = ring_slot (p, p->next_seq);
+    if (pkt->seq != p->next_seq)
+      break;
+    int len = FFMIN (pkt->len - p->read_pos, max_len - total);
+    memcpy (buf + total, pkt->data + p->read_pos, len);
+    total += len;
+    p->read_pos += len;
+    if (p->read_pos == pkt->len)
+    {
+      pkt->seq = -1;
+      p->next_seq++;
+      p->read_pos = 0;
+    }
+  }
+  return total;
+}
+
+static int
+udp_fill_buffer (stream_t *s, char *buffer, int max_len)
+{
+  struct udp_priv *p = s->priv;
+
+  // Fetch what's pending first, so that the socket buffer never fills up
+  // while the ring buffer still has space.
+  if (udp_receive (s, p, 0) < 0)
+    return -1;
+  while (1)
+  {
+    int wait = udp_check_gap (p);
+    if (wait == 0)
+      return udp_deliver (p, buffer, max_len);
+    if (udp_receive (s, p, wait) < 0)
+      return -1;
+  }
+}
+
+static void
+udp_close (stream_t *s)
+{
+  struct udp_priv *p = s->priv;
+  bool loss = p->lost || p->late || p->overflows || p->kernel_drops;
+  mp_msg (MSGT_NETWORK, loss ? MSGL_WARN : MSGL_V,
+          "UDP: %"PRIu64" packets received, %"PRIu64" lost, %"PRIu64" late, "
+          "%"PRIu64" reordered, %"PRIu64" dropped (buffer full), %"PRIu64
+          " truncated, %"PRIu32" dropped by the kernel.\n", p->packets,
+          p->lost, p->late, p->reordered, p->overflows, p->truncated,
+          p->kernel_drops);
+  free (p->ring);
+  free (p->recv_buf);
+  free (p);
+  streaming_ctrl_free (s->streaming_ctrl);
+  s->streaming_ctrl = NULL;
+}
+
 static int
 udp_streaming_start (stream_t *stream)
 {
@@ -49,10 +386,32 @@ udp_streaming_start (stream_t *stream)
     stream->fd = fd;
   }
 
-  streaming_ctrl->streaming_read = nop_streaming_read;
+  struct udp_priv *p = calloc (1, sizeof (*p));
+  if (!p)
+    return -1;
+  p->ring = malloc (UDP_RING_SIZE * sizeof (struct udp_packet));
+  p->recv_buf = malloc (UDP_BATCH * UDP_MAX_PACKET);
+  if (!p->ring || !p->recv_buf)
+  {
+    free (p->ring);
+    free (p->recv_buf);
+    free (p);
+    return -1;
+  }
+  for (int n = 0; n < UDP_RING_SIZE; n++)
+    p->ring[n].seq = -1;
+  p->rtp = -1;
+  p->max_seq = -1;
+  p->jitter_ms = stream->opts ? stream->opts->udp_jitter_buffer : 0;
+  stream->priv = p;
+
+  streaming_ctrl->streaming_read = NULL;
   streaming_ctrl->streaming_seek = nop_streaming_seek;
   streaming_ctrl->status = streaming_playing_e;
   stream->streaming = false;
+  stream->fill_buffer = udp_fill_buffer;
+  stream->close = udp_close;
+  stream->max_read_size = STREAM_MAX_BUFFER_SIZE;
 
   return 0;
 }
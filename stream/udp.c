@@ -142,8 +142,9 @@ udp_open_socket (URL_t *url)
   }
 #endif /* HAVE_WINSOCK2_H */
 
-  /* Increase the socket rx buffer size to maximum -- this is UDP */
-  rxsockbufsz = 240 * 1024;
+  /* Increase the socket rx buffer size to maximum -- this is UDP. The kernel
+   * limits it to net.core.rmem_max. */
+  rxsockbufsz = 4 * 1024 * 1024;
   if (setsockopt (socket_server_fd, SOL_SOCKET, SO_RCVBUF,
                   &rxsockbufsz, sizeof (rxsockbufsz)))
   {
@@ -151,6 +152,14 @@ udp_open_socket (URL_t *url)
             "Couldn't set receive socket buffer size\n");
   }
 
+#ifdef SO_RXQ_OVFL
+  /* Report the number of datagrams dropped because the buffer was full */
+  {
+    int one = 1;
+    setsockopt (socket_server_fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof (one));
+  }
+#endif
+
   if ((ntohl (server_address.sin_addr.s_addr) >> 28) == 0xe)
   {
     mcast.imr_multiaddr.s_addr = server_address.sin_addr.s_addr;
@@ -177,6 +177,41 @@ int get_current_video_decoder_lag(sh_video_t *sh_video)
     return -1;
 }
 
+// Return the total time spent in the decoder, and the number of packets it
+// has decoded.
+bool get_video_decode_time(sh_video_t *sh_video, double *time, int *packets)
+{
+    const struct vd_functions *vd = sh_video->vd_driver;
+    struct vd_decode_stats st = {0};
+    if (!vd || vd->control(sh_video, VDCTRL_QUERY_DECODE_STATS, &st)
+               != CONTROL_TRUE)
+        return false;
+    *time = st.decode_time;
+    *packets = st.decoded_packets;
+    return true;
+}
+
+// Set the enum vd_degradation level. Returns the level the decoder uses,
+// which is lower if it doesn't support all of them.
+int set_video_degradation(sh_video_t *sh_video, int level)
+{
+    const struct vd_functions *vd = sh_video->vd_driver;
+    if (!vd || vd->control(sh_video, VDCTRL_SET_DEGRADATION, &level)
+               != CONTROL_TRUE)
+        return VD_DEGRADE_NONE;
+    return level;
+}
+
+// Make the decoder skip everything but keyframes (if supported). Since
+// frames referencing skipped frames can't be decoded, the stream must be
+// seeked to a keyframe after turning this off.
+void set_video_keyframes_only(sh_video_t *sh_video, bool enable)
+{
+    const struct vd_functions *vd = sh_video->vd_driver;
+    if (vd)
+        vd->control(sh_video, VDCTRL_SET_KEYFRAMES_ONLY, &enable);
+}
+
 void uninit_video(sh_video_t *sh_video)
 {
     if (!sh_video->initialized)
@@ -45,6 +45,9 @@ void set_video_colorspace(struct sh_video *sh);
 void resync_video_stream(sh_video_t *sh_video);
 void video_reset_aspect(struct sh_video *sh_video);
 int get_current_video_decoder_lag(sh_video_t *sh_video);
+bool get_video_decode_time(sh_video_t *sh_video, double *time, int *packets);
+int set_video_degradation(sh_video_t *sh_video, int level);
+void set_video_keyframes_only(sh_video_t *sh_video, bool enable);
 
 extern int divx_quality;
 
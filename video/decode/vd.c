@@ -60,6 +60,7 @@ int mpcodecs_config_vo(sh_video_t *sh, int w, int h,
     unsigned int out_fmt = 0;
     int screen_size_x = 0;
     int screen_size_y = 0;
+    int src_w, src_h;
     vf_instance_t *vf = sh->vfilter;
     int vocfg_flags = 0;
 
@@ -75,6 +76,8 @@ int mpcodecs_config_vo(sh_video_t *sh, int w, int h,
 
     if (!sh->disp_w || !sh->disp_h)
         return 0;
+    src_w = sh->disp_w << sh->disp_shift;
+    src_h = sh->disp_h << sh->disp_shift;
 
     mp_msg(MSGT_DECVIDEO, MSGL_V,
            "VDec: vo config request - %d x %d (preferred colorspace: %s)\n",
@@ -174,14 +177,14 @@ int mpcodecs_config_vo(sh_video_t *sh, int w, int h,
             if (!screen_size_y)
                 screen_size_y = 1;
             if (screen_size_x <= 8)
-                screen_size_x *= sh->disp_w;
+                screen_size_x *= src_w;
             if (screen_size_y <= 8)
-                screen_size_y *= sh->disp_h;
+                screen_size_y *= src_h;
         }
     } else {
         // check source format aspect, calculate prescale ::atmos
-        screen_size_x = sh->disp_w;
-        screen_size_y = sh->disp_h;
+        screen_size_x = src_w;
+        screen_size_y = src_h;
         if (opts->screen_size_xy >= 0.001) {
             if (opts->screen_size_xy <= 8) {
                 // -xy means x+y scale
@@ -190,7 +193,7 @@ int mpcodecs_config_vo(sh_video_t *sh, int w, int h,
             } else {
                 // -xy means forced width while keeping correct aspect
                 screen_size_x = opts->screen_size_xy;
-                screen_size_y = opts->screen_size_xy * sh->disp_h / sh->disp_w;
+                screen_size_y = opts->screen_size_xy * src_h / src_w;
             }
         }
         if (sh->aspect > 0.01) {
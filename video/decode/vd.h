@@ -46,6 +46,24 @@ extern const vd_functions_t *const mpcodecs_vd_drivers[];
 #define VDCTRL_RESYNC_STREAM 8 // reset decode state after seeking
 #define VDCTRL_QUERY_UNSEEN_FRAMES 9 // current decoder lag
 #define VDCTRL_RESET_ASPECT 10 // reinit filter/VO chain for new aspect ratio
+#define VDCTRL_QUERY_DECODE_STATS 11 // fill struct vd_decode_stats
+#define VDCTRL_SET_DEGRADATION 12 // set enum vd_degradation level (int *);
+                                  // updated to the level actually used
+#define VDCTRL_SET_KEYFRAMES_ONLY 13 // skip all but keyframes (bool *)
+
+struct vd_decode_stats {
+    double decode_time;   // total seconds spent in the decoder
+    int decoded_packets;
+};
+
+// Ways to make decoding cheaper (--video-degrade). Each level includes the
+// ones before it.
+enum vd_degradation {
+    VD_DEGRADE_NONE = 0,
+    VD_DEGRADE_SKIP_LOOP_FILTER,
+    VD_DEGRADE_SKIP_NONREF,
+    VD_DEGRADE_LOWRES,
+};
 
 // callbacks:
 int mpcodecs_config_vo(sh_video_t *sh, int w, int h,
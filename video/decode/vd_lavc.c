@@ -31,6 +31,9 @@
 
 #include "talloc.h"
 #include "config.h"
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #include "core/mp_msg.h"
 #include "core/options.h"
 #include "core/av_opts.h"
@@ -44,6 +47,7 @@
 #include "demux/demux_packet.h"
 #include "core/codec-cfg.h"
 #include "osdep/numcores.h"
+#include "osdep/timer.h"
 #include "video/csputils.h"
 
 static const vd_info_t info = {
@@ -61,12 +65,80 @@ static const vd_info_t info = {
 #error palette too large, adapt libmpcodecs/vf.c:vf_get_image
 #endif
 
+// Frame parameters the filter chain and VO are configured with.
+struct vo_params {
+    int w, h;
+    int lowres;
+    enum PixelFormat pix_fmt;
+    AVRational sample_aspect_ratio;
+    enum AVColorSpace colorspace;
+    enum AVColorRange color_range;
+};
+
+#ifdef HAVE_PTHREADS
+// --video-decode-ahead: libavcodec runs in a separate thread, which decodes
+// packets as soon as they're passed to decode() and queues the frames. The
+// frames are returned with a delay of max_frames packets, so that frames
+// which take long to decode don't stall playback.
+struct ahead_packet {
+    AVPacket pkt;           // owns a copy of the packet data
+    int flags;              // framedrop flags as passed to decode()
+    int degrade_level;      // ctx->degrade_level when the packet was queued
+    bool keyframes_only;    // same for ctx->keyframes_only
+    double pts;             // reordered_pts as passed to decode()
+    struct ahead_packet *next;
+};
+
+struct ahead_frame {
+    struct mp_image *img;   // references or copies the decoded picture
+    struct vo_params params;
+    AVFrame info;           // picture properties (not the data pointers)
+    double pts;
+    size_t bytes;
+    struct ahead_frame *next;
+};
+
+struct decode_ahead {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;  // signaled on any state change
+    int max_frames;
+    size_t max_bytes;
+    // Everything below is protected by lock.
+    struct ahead_packet *packets, **packets_tail;
+    int num_packets;
+    struct ahead_frame *frames, **frames_tail;
+    int num_frames;
+    size_t frame_bytes;
+    bool busy;              // thread is decoding (outside of the lock)
+    bool draining;          // no more packets, get the delayed frames
+    bool drained;           // decoder returned all delayed frames
+    bool quit;
+    int codec_delay;        // decoder lag as in VDCTRL_QUERY_UNSEEN_FRAMES
+    // Only accessed by the main thread.
+    struct mp_image *current; // plane memory of the last returned image
+    struct vo_params params;  // parameters of the last returned image
+};
+#endif
+
 typedef struct {
     AVCodecContext *avctx;
     AVFrame *pic;
     enum PixelFormat pix_fmt;
     int do_slices;
     int do_dr1;
+    // Use MP_IMGTYPE_NUMBERED images for direct rendering. They are reused
+    // only when libavcodec has released them, so any number of frames can be
+    // in use, as needed for frame threading.
+    bool numbered_dr;
+#ifdef HAVE_PTHREADS
+    // Protects the direct rendering state (ip_count/b_count and usage_count
+    // of the images), so that release_buffer() is safe wherever libavcodec
+    // calls it from.
+    pthread_mutex_t dr_lock;
+    // Set if decoding happens in a separate thread (--video-decode-ahead).
+    struct decode_ahead *ahead;
+#endif
     int vo_initialized;
     int best_csp;
     int qp_stat[32];
@@ -76,8 +148,25 @@ typedef struct {
     int b_count;
     AVRational last_sample_aspect_ratio;
     enum AVDiscard skip_frame;
+    // Settings as requested by the user, which --video-degrade can lower.
+    enum AVDiscard skip_loop_filter;
+    int lowres;
+    // Protected by ahead->lock with --video-decode-ahead.
+    int max_degrade;
+    // Set by VDCTRL_SET_DEGRADATION. With --video-decode-ahead, the level is
+    // passed to the decoding thread along with each packet.
+    int degrade_level;
+    // Set by VDCTRL_SET_KEYFRAMES_ONLY, passed to the thread the same way.
+    bool keyframes_only;
+    // skip_frame with the degradation level applied
+    enum AVDiscard cur_skip_frame;
+    // Protected by ahead->lock with --video-decode-ahead.
+    struct vd_decode_stats stats;
 } vd_ffmpeg_ctx;
 
+// The avcodec opaque field stupidly supports only int64_t type
+union pts { int64_t i; double d; };
+
 #include "core/m_option.h"
 
 static int get_buffer(AVCodecContext *avctx, AVFrame *pic);
@@ -87,7 +176,15 @@ static void draw_slice(struct AVCodecContext *s, const AVFrame *src,
 
 static enum PixelFormat get_format(struct AVCodecContext *avctx,
                                    const enum PixelFormat *pix_fmt);
+static struct mp_image *set_image_info(struct sh_video *sh, mp_image_t *mpi,
+                                       const AVFrame *pic);
 static void uninit(struct sh_video *sh);
+#ifdef HAVE_PTHREADS
+static int ahead_get_buffer(AVCodecContext *avctx, AVFrame *pic);
+static void ahead_release_buffer(AVCodecContext *avctx, AVFrame *pic);
+static void start_decode_ahead(struct sh_video *sh);
+static void stop_decode_ahead(struct sh_video *sh);
+#endif
 
 const m_option_t lavc_decode_opts_conf[] = {
     OPT_INTRANGE("bug", lavc_param.workaround_bugs, 0, -1, 999999),
@@ -134,6 +231,9 @@ static int init(sh_video_t *sh)
             (lavc_param->debug & (FF_DEBUG_VIS_MB_TYPE | FF_DEBUG_VIS_QP));
 
     ctx = sh->context = talloc_zero(NULL, vd_ffmpeg_ctx);
+#ifdef HAVE_PTHREADS
+    pthread_mutex_init(&ctx->dr_lock, NULL);
+#endif
 
     if (sh->codec->dll) {
         lavc_codec = avcodec_find_decoder_by_name(sh->codec->dll);
@@ -171,11 +271,15 @@ static int init(sh_video_t *sh)
             && !do_vis_debug)
         ctx->do_slices = 1;
 
-    if (lavc_codec->capabilities & CODEC_CAP_DR1 && !do_vis_debug
-            && lavc_codec->id != CODEC_ID_H264
-            && lavc_codec->id != CODEC_ID_INTERPLAY_VIDEO
-            && lavc_codec->id != CODEC_ID_ROQ && lavc_codec->id != CODEC_ID_VP8
-            && lavc_codec->id != CODEC_ID_LAGARITH)
+    // H.264 and VP8 keep too many reference frames for the IP/IPB image
+    // types, and are only supported with numbered images (see below).
+    bool many_refs = lavc_codec->id == CODEC_ID_H264 ||
+                     lavc_codec->id == CODEC_ID_VP8;
+    bool can_dr1 = lavc_codec->capabilities & CODEC_CAP_DR1 && !do_vis_debug
+                   && lavc_codec->id != CODEC_ID_INTERPLAY_VIDEO
+                   && lavc_codec->id != CODEC_ID_ROQ
+                   && lavc_codec->id != CODEC_ID_LAGARITH;
+    if (can_dr1)
         ctx->do_dr1 = sh->opts->vd_use_dr1;
     ctx->ip_count = ctx->b_count = 0;
 
@@ -212,14 +316,45 @@ static int init(sh_video_t *sh)
         threads = FFMIN(threads, 16);
         lavc_param->threads = threads;
     }
-    /* Our get_buffer and draw_horiz_band callbacks are not safe to call
-     * from other threads. */
+    /* Our draw_horiz_band callback is not safe to call from other threads.
+     * get_buffer may reconfigure the filter chain and VO, so we leave
+     * avctx->thread_safe_callbacks unset, and libavcodec calls it from the
+     * decoding thread. With frame threading, many frames are in flight (and
+     * are returned with a delay), which the IP/IPB image types can't handle,
+     * so use numbered images.
+     */
     if (lavc_param->threads > 1) {
-        ctx->do_dr1 = false;
         ctx->do_slices = false;
+        ctx->numbered_dr = ctx->do_dr1;
         mp_tmsg(MSGT_DECVIDEO, MSGL_V, "Asking decoder to use "
                 "%d threads if supported.\n", lavc_param->threads);
     }
+    if (many_refs && !ctx->numbered_dr &&
+        !(lavc_codec->capabilities & (CODEC_CAP_HWACCEL |
+                                      CODEC_CAP_HWACCEL_VDPAU)))
+        ctx->do_dr1 = false;
+
+    bool decode_ahead = false;
+#ifdef HAVE_PTHREADS
+    /* With --video-decode-ahead, libavcodec is called from a separate
+     * thread, which can't use direct rendering and slices, as they call
+     * into the filter chain and VO. vstats accesses the decoder state after
+     * each decode() call, and is not supported either.
+     */
+    decode_ahead = sh->opts->video_decode_ahead > 0 && !lavc_param->vstats &&
+                   !(lavc_codec->capabilities & (CODEC_CAP_HWACCEL |
+                                                 CODEC_CAP_HWACCEL_VDPAU));
+    if (decode_ahead) {
+        ctx->do_dr1 = false;
+        ctx->do_slices = false;
+        avctx->thread_safe_callbacks = 1;
+        if (can_dr1) {
+            avctx->flags |= CODEC_FLAG_EMU_EDGE;
+            avctx->get_buffer = ahead_get_buffer;
+            avctx->release_buffer = ahead_release_buffer;
+        }
+    }
+#endif
 
     if (ctx->do_dr1) {
         avctx->flags |= CODEC_FLAG_EMU_EDGE;
@@ -276,6 +411,13 @@ static int init(sh_video_t *sh)
 
     // Do this after the above avopt handling in case it changes values
     ctx->skip_frame = avctx->skip_frame;
+    ctx->cur_skip_frame = ctx->skip_frame;
+    ctx->skip_loop_filter = avctx->skip_loop_filter;
+    ctx->lowres = avctx->lowres;
+    ctx->max_degrade = VD_DEGRADE_LOWRES;
+    if (!lavc_codec->max_lowres || avctx->lowres ||
+        lavc_codec->capabilities & (CODEC_CAP_HWACCEL | CODEC_CAP_HWACCEL_VDPAU))
+        ctx->max_degrade = VD_DEGRADE_SKIP_NONREF;
 
     mp_dbg(MSGT_DECVIDEO, MSGL_DBG2,
            "libavcodec.size: %d x %d\n", avctx->width, avctx->height);
@@ -339,14 +481,36 @@ static int init(sh_video_t *sh)
         uninit(sh);
         return 0;
     }
+#ifdef HAVE_PTHREADS
+    if (decode_ahead)
+        start_decode_ahead(sh);
+#endif
     return 1;
 }
 
+static void free_avctx(AVCodecContext *avctx)
+{
+    if (avctx) {
+        if (avctx->codec && avcodec_close(avctx) < 0)
+            mp_tmsg(MSGT_DECVIDEO, MSGL_ERR, "Could not close codec.\n");
+
+        av_freep(&avctx->extradata);
+        av_freep(&avctx->slice_offset);
+    }
+
+    av_freep(&avctx);
+}
+
 static void uninit(sh_video_t *sh)
 {
     vd_ffmpeg_ctx *ctx = sh->context;
     AVCodecContext *avctx = ctx->avctx;
 
+#ifdef HAVE_PTHREADS
+    if (ctx->ahead)
+        stop_decode_ahead(sh);
+#endif
+
     sh->codecname = NULL;
     if (sh->opts->lavc_param.vstats && avctx->coded_frame) {
         for (int i = 1; i < 32; i++)
@@ -358,16 +522,12 @@ static void uninit(sh_video_t *sh)
             1.0 / (ctx->inv_qp_sum / avctx->coded_frame->coded_picture_number));
     }
 
-    if (avctx) {
-        if (avctx->codec && avcodec_close(avctx) < 0)
-            mp_tmsg(MSGT_DECVIDEO, MSGL_ERR, "Could not close codec.\n");
-
-        av_freep(&avctx->extradata);
-        av_freep(&avctx->slice_offset);
-    }
-
-    av_freep(&avctx);
+    free_avctx(avctx);
     avcodec_free_frame(&ctx->pic);
+    sh->disp_shift = 0;
+#ifdef HAVE_PTHREADS
+    pthread_mutex_destroy(&ctx->dr_lock);
+#endif
     talloc_free(ctx);
 }
 
@@ -399,23 +559,39 @@ static void draw_slice(struct AVCodecContext *s,
 }
 
 
-static int init_vo(sh_video_t *sh, enum PixelFormat pix_fmt)
+static void get_vo_params(AVCodecContext *avctx, enum PixelFormat pix_fmt,
+                          struct vo_params *p)
+{
+    *p = (struct vo_params) {
+        .w = avctx->width,
+        .h = avctx->height,
+        .lowres = avctx->lowres,
+        .pix_fmt = pix_fmt,
+        .sample_aspect_ratio = avctx->sample_aspect_ratio,
+        .colorspace = avctx->colorspace,
+        .color_range = avctx->color_range,
+    };
+}
+
+static int init_vo_params(sh_video_t *sh, const struct vo_params *p)
 {
     vd_ffmpeg_ctx *ctx = sh->context;
-    AVCodecContext *avctx = ctx->avctx;
-    float aspect = av_q2d(avctx->sample_aspect_ratio) *
-                   avctx->width / avctx->height;
+    enum PixelFormat pix_fmt = p->pix_fmt;
+    float aspect = av_q2d(p->sample_aspect_ratio) * p->w / p->h;
     int width, height;
+    // Lowres decoding enabled by --video-degrade shouldn't change the size
+    // the video is displayed at.
+    int disp_shift = p->lowres - ctx->lowres;
 
-    width = avctx->width;
-    height = avctx->height;
+    width = p->w;
+    height = p->h;
 
     /* Reconfiguring filter/VO chain may invalidate direct rendering buffers
      * we have allocated for libavcodec (including the VDPAU HW decoding
      * case). Is it guaranteed that the code below only triggers in a situation
      * with no busy direct rendering buffers for reference frames?
      */
-    if (av_cmp_q(avctx->sample_aspect_ratio, ctx->last_sample_aspect_ratio) ||
+    if (av_cmp_q(p->sample_aspect_ratio, ctx->last_sample_aspect_ratio) ||
             width != sh->disp_w || height != sh->disp_h ||
             pix_fmt != ctx->pix_fmt || !ctx->vo_initialized) {
         ctx->vo_initialized = 0;
@@ -426,11 +602,15 @@ static int init_vo(sh_video_t *sh, enum PixelFormat pix_fmt)
         // But set it even if the sample aspect did not change, since a
         // resolution change can cause an aspect change even if the
         // _sample_ aspect is unchanged.
-        if (sh->aspect == 0 || ctx->last_sample_aspect_ratio.den)
+        // Keep it if only the --video-degrade lowres changed, as the reduced
+        // size is rounded.
+        if ((sh->aspect == 0 || ctx->last_sample_aspect_ratio.den) &&
+            disp_shift == sh->disp_shift)
             sh->aspect = aspect;
-        ctx->last_sample_aspect_ratio = avctx->sample_aspect_ratio;
+        ctx->last_sample_aspect_ratio = p->sample_aspect_ratio;
         sh->disp_w = width;
         sh->disp_h = height;
+        sh->disp_shift = disp_shift;
         ctx->pix_fmt = pix_fmt;
         ctx->best_csp = pixfmt2imgfmt(pix_fmt);
         const unsigned int *supported_fmts;
@@ -445,8 +625,8 @@ static int init_vo(sh_video_t *sh, enum PixelFormat pix_fmt)
         else
             supported_fmts = (const unsigned int[]){ctx->best_csp, 0xffffffff};
 
-        sh->colorspace = avcol_spc_to_mp_csp(avctx->colorspace);
-        sh->color_range = avcol_range_to_mp_csp_levels(avctx->color_range);
+        sh->colorspace = avcol_spc_to_mp_csp(p->colorspace);
+        sh->color_range = avcol_range_to_mp_csp_levels(p->color_range);
 
         if (!mpcodecs_config_vo(sh, sh->disp_w, sh->disp_h, supported_fmts,
                                 ctx->best_csp))
@@ -456,7 +636,48 @@ static int init_vo(sh_video_t *sh, enum PixelFormat pix_fmt)
     return 0;
 }
 
-static int get_buffer(AVCodecContext *avctx, AVFrame *pic)
+static int init_vo(sh_video_t *sh, enum PixelFormat pix_fmt)
+{
+    vd_ffmpeg_ctx *ctx = sh->context;
+    struct vo_params p;
+    get_vo_params(ctx->avctx, pix_fmt, &p);
+    return init_vo_params(sh, &p);
+}
+
+static void dr_lock(vd_ffmpeg_ctx *ctx)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&ctx->dr_lock);
+#endif
+}
+
+static void dr_unlock(vd_ffmpeg_ctx *ctx)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&ctx->dr_lock);
+#endif
+}
+
+// Lock the state shared with the --video-decode-ahead thread, if any.
+static void ahead_lock(vd_ffmpeg_ctx *ctx)
+{
+#ifdef HAVE_PTHREADS
+    if (ctx->ahead)
+        pthread_mutex_lock(&ctx->ahead->lock);
+#endif
+}
+
+static void ahead_unlock(vd_ffmpeg_ctx *ctx)
+{
+#ifdef HAVE_PTHREADS
+    if (ctx->ahead)
+        pthread_mutex_unlock(&ctx->ahead->lock);
+#endif
+}
+
+static void release_buffer_locked(struct AVCodecContext *avctx, AVFrame *pic);
+
+static int get_buffer_locked(AVCodecContext *avctx, AVFrame *pic)
 {
     sh_video_t *sh = avctx->opaque;
     vd_ffmpeg_ctx *ctx = sh->context;
@@ -488,6 +709,12 @@ static int get_buffer(AVCodecContext *avctx, AVFrame *pic)
         flags |= ctx->do_slices ? MP_IMGFLAG_DRAW_CALLBACK : 0;
         mp_msg(MSGT_DECVIDEO, MSGL_DBG2,
                type == MP_IMGTYPE_STATIC ? "using STATIC\n" : "using TEMP\n");
+    } else if (ctx->numbered_dr) {
+        // Frames are output with a delay, so in-place filters must not
+        // reuse the buffers of non-reference frames either.
+        flags |= MP_IMGFLAG_PRESERVE;
+        if (pic->reference)
+            flags |= MP_IMGFLAG_READABLE;
     } else {
         if (!pic->reference) {
             ctx->b_count++;
@@ -504,11 +731,13 @@ static int get_buffer(AVCodecContext *avctx, AVFrame *pic)
         avctx->get_buffer = avcodec_default_get_buffer;
         avctx->reget_buffer = avcodec_default_reget_buffer;
         if (pic->data[0])
-            release_buffer(avctx, pic);
+            release_buffer_locked(avctx, pic);
+        pic->opaque = NULL;
         return avctx->get_buffer(avctx, pic);
     }
 
-    if (IMGFMT_IS_HWACCEL(ctx->best_csp))
+    if (IMGFMT_IS_HWACCEL(ctx->best_csp) ||
+        (ctx->numbered_dr && !pic->buffer_hints))
         type =  MP_IMGTYPE_NUMBERED | (0xffff << 16);
     else if (!pic->buffer_hints) {
         if (ctx->b_count > 1 || ctx->ip_count > 2) {
@@ -518,7 +747,8 @@ static int get_buffer(AVCodecContext *avctx, AVFrame *pic)
             avctx->get_buffer = avcodec_default_get_buffer;
             avctx->reget_buffer = avcodec_default_reget_buffer;
             if (pic->data[0])
-                release_buffer(avctx, pic);
+                release_buffer_locked(avctx, pic);
+            pic->opaque = NULL;
             return avctx->get_buffer(avctx, pic);
         }
 
@@ -533,6 +763,13 @@ static int get_buffer(AVCodecContext *avctx, AVFrame *pic)
     if (ctx->best_csp == IMGFMT_RGB8 || ctx->best_csp == IMGFMT_BGR8)
         flags |= MP_IMGFLAG_RGB_PALETTE;
     mpi = mpcodecs_get_image(sh, type, flags, width, height);
+    if (!mpi && ctx->numbered_dr && !IMGFMT_IS_HWACCEL(ctx->best_csp)) {
+        // All numbered images are in use; decode this frame into a buffer
+        // allocated by libavcodec.
+        mp_msg(MSGT_DECVIDEO, MSGL_DBG2, "No free image, not using DR.\n");
+        pic->opaque = NULL;
+        return avcodec_default_get_buffer(avctx, pic);
+    }
     if (!mpi)
         return -1;
 
@@ -573,13 +810,23 @@ static int get_buffer(AVCodecContext *avctx, AVFrame *pic)
     return 0;
 }
 
-static void release_buffer(struct AVCodecContext *avctx, AVFrame *pic)
+static int get_buffer(AVCodecContext *avctx, AVFrame *pic)
+{
+    sh_video_t *sh = avctx->opaque;
+    vd_ffmpeg_ctx *ctx = sh->context;
+    dr_lock(ctx);
+    int res = get_buffer_locked(avctx, pic);
+    dr_unlock(ctx);
+    return res;
+}
+
+static void release_buffer_locked(struct AVCodecContext *avctx, AVFrame *pic)
 {
     mp_image_t *mpi = pic->opaque;
     sh_video_t *sh = avctx->opaque;
     vd_ffmpeg_ctx *ctx = sh->context;
 
-    if (ctx->ip_count <= 2 && ctx->b_count <= 1) {
+    if (mpi && !ctx->numbered_dr && ctx->ip_count <= 2 && ctx->b_count <= 1) {
         if (mpi->flags & MP_IMGFLAG_PRESERVE)
             ctx->ip_count--;
         else
@@ -604,6 +851,407 @@ static void release_buffer(struct AVCodecContext *avctx, AVFrame *pic)
         pic->data[i] = NULL;
 }
 
+static void release_buffer(struct AVCodecContext *avctx, AVFrame *pic)
+{
+    sh_video_t *sh = avctx->opaque;
+    vd_ffmpeg_ctx *ctx = sh->context;
+    dr_lock(ctx);
+    release_buffer_locked(avctx, pic);
+    dr_unlock(ctx);
+}
+
+// Switch to a new decoder instance with a different lowres setting. Only
+// done on keyframes, since the decoder loses its reference frames. The old
+// instance is closed only once the new one is open, so on failure decoding
+// just continues at the current resolution. Changes ctx->avctx.
+static void set_lowres(sh_video_t *sh, int lowres)
+{
+    vd_ffmpeg_ctx *ctx = sh->context;
+    AVCodecContext *old = ctx->avctx;
+    const AVCodec *codec = old->codec;
+
+    mp_msg(MSGT_DECVIDEO, MSGL_V, "[VD_FFMPEG] Reopening decoder with "
+           "lowres=%d.\n", lowres);
+    AVCodecContext *avctx = avcodec_alloc_context3(codec);
+    if (!avctx || avcodec_copy_context(avctx, old) < 0)
+        goto error;
+    avctx->lowres = lowres;
+    if (avcodec_open2(avctx, codec, NULL) < 0)
+        goto error;
+    ctx->avctx = avctx;
+    free_avctx(old);
+    return;
+
+error:
+    mp_msg(MSGT_DECVIDEO, MSGL_ERR, "[VD_FFMPEG] Could not reopen "
+           "decoder with lowres=%d.\n", lowres);
+    free_avctx(avctx);
+    ahead_lock(ctx);
+    ctx->max_degrade = VD_DEGRADE_SKIP_NONREF;
+    ahead_unlock(ctx);
+}
+
+// Apply a --video-degrade level and the keyframes-only mode to the decoder
+// settings. Called by whatever thread runs the decoder. Can replace
+// ctx->avctx (see set_lowres()).
+static void apply_degradation(sh_video_t *sh, int level, bool keyframes_only,
+                              bool keyframe)
+{
+    vd_ffmpeg_ctx *ctx = sh->context;
+    AVCodecContext *avctx = ctx->avctx;
+
+    avctx->skip_loop_filter = ctx->skip_loop_filter;
+    if (level >= VD_DEGRADE_SKIP_LOOP_FILTER)
+        avctx->skip_loop_filter = AVDISCARD_ALL;
+    ctx->cur_skip_frame = ctx->skip_frame;
+    if (level >= VD_DEGRADE_SKIP_NONREF)
+        ctx->cur_skip_frame = FFMAX(ctx->skip_frame, AVDISCARD_NONREF);
+    if (keyframes_only)
+        ctx->cur_skip_frame = FFMAX(ctx->cur_skip_frame, AVDISCARD_NONKEY);
+    int lowres = ctx->lowres;
+    if (level >= VD_DEGRADE_LOWRES)
+        lowres = FFMAX(lowres, 1);
+    if (lowres != avctx->lowres && keyframe)
+        set_lowres(sh, lowres);
+}
+
+#ifdef HAVE_PTHREADS
+// get_buffer callback used with --video-decode-ahead. It must not call into
+// the filter chain or VO, so planar YUV pictures are decoded into refcounted
+// mp_image memory, which can then be queued without copying.
+static int ahead_get_buffer(AVCodecContext *avctx, AVFrame *pic)
+{
+    int imgfmt = pixfmt2imgfmt(avctx->pix_fmt);
+    struct mp_image fmt = {0};
+    if (imgfmt && !IMGFMT_IS_HWACCEL(imgfmt))
+        mp_image_setfmt(&fmt, imgfmt);
+    if (pic->buffer_hints || fmt.num_planes < 3 ||
+        (fmt.flags & (MP_IMGFLAG_PLANAR | MP_IMGFLAG_YUV)) !=
+            (MP_IMGFLAG_PLANAR | MP_IMGFLAG_YUV))
+    {
+        pic->opaque = NULL;
+        return avcodec_default_get_buffer(avctx, pic);
+    }
+
+    int width = avctx->width;
+    int height = avctx->height;
+    avcodec_align_dimensions(avctx, &width, &height);
+    struct mp_image *mpi = alloc_mpi(width, height, imgfmt);
+    for (int i = 0; i < 4; i++) {
+        pic->data[i] = mpi->planes[i];
+        pic->linesize[i] = mpi->stride[i];
+    }
+    pic->opaque = mpi;
+    pic->type = FF_BUFFER_TYPE_USER;
+    // see get_buffer_locked()
+    pic->reordered_opaque = avctx->reordered_opaque;
+    return 0;
+}
+
+static void ahead_release_buffer(AVCodecContext *avctx, AVFrame *pic)
+{
+    if (pic->type != FF_BUFFER_TYPE_USER) {
+        avcodec_default_release_buffer(avctx, pic);
+        return;
+    }
+    free_mp_image(pic->opaque);
+    pic->opaque = NULL;
+    for (int i = 0; i < 4; i++)
+        pic->data[i] = NULL;
+}
+
+static void free_ahead_frame(struct ahead_frame *f)
+{
+    if (f->img)
+        free_mp_image(f->img);
+    talloc_free(f);
+}
+
+static void free_ahead_packet(struct ahead_packet *p)
+{
+    av_free_packet(&p->pkt);
+    talloc_free(p);
+}
+
+// Called on the decoding thread. p==NULL gets a delayed frame at the end of
+// the stream. Frees p.
+static struct ahead_frame *ahead_decode(sh_video_t *sh, struct ahead_packet *p)
+{
+    vd_ffmpeg_ctx *ctx = sh->context;
+    AVCodecContext *avctx = ctx->avctx;
+    AVFrame *pic = ctx->pic;
+    int got_picture = 0;
+    AVPacket pkt;
+
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    if (p) {
+        apply_degradation(sh, p->degrade_level, p->keyframes_only,
+                          p->pkt.flags & AV_PKT_FLAG_KEY);
+        avctx = ctx->avctx;
+    }
+    avctx->skip_frame = ctx->cur_skip_frame;
+    if (p) {
+        pkt = p->pkt;
+        if (p->flags & 2)
+            avctx->skip_frame = AVDISCARD_ALL;
+        else if (p->flags & 1)
+            avctx->skip_frame = p->keyframes_only ? AVDISCARD_NONKEY
+                                                  : AVDISCARD_NONREF;
+        avctx->reordered_opaque = (union pts){.d = p->pts}.i;
+    }
+    if (avcodec_decode_video2(avctx, pic, &got_picture, &pkt) < 0)
+        mp_msg(MSGT_DECVIDEO, MSGL_WARN, "Error while decoding frame!\n");
+    if (p)
+        free_ahead_packet(p);
+    if (!got_picture)
+        return NULL;
+
+    struct ahead_frame *f = talloc_zero(NULL, struct ahead_frame);
+    get_vo_params(avctx, avctx->pix_fmt, &f->params);
+    f->info = *pic;
+    f->info.qscale_table = NULL; // owned by the decoder
+    f->pts = (union pts){.i = pic->reordered_opaque}.d;
+    if (pic->type == FF_BUFFER_TYPE_USER && pic->opaque) {
+        f->img = mp_image_new_ref(pic->opaque);
+    } else {
+        int imgfmt = pixfmt2imgfmt(avctx->pix_fmt);
+        if (imgfmt && !IMGFMT_IS_HWACCEL(imgfmt)) {
+            struct mp_image *tmp = new_mp_image(avctx->width, avctx->height);
+            mp_image_setfmt(tmp, imgfmt);
+            if (imgfmt == IMGFMT_RGB8 || imgfmt == IMGFMT_BGR8)
+                tmp->flags |= MP_IMGFLAG_RGB_PALETTE;
+            for (int i = 0; i < 4; i++) {
+                tmp->planes[i] = pic->data[i];
+                tmp->stride[i] = pic->linesize[i];
+            }
+            f->img = mp_image_new_ref(tmp);
+            free_mp_image(tmp);
+        }
+    }
+    if (f->img)
+        f->bytes = (size_t)f->img->bpp * f->img->width * f->img->height / 8;
+    return f;
+}
+
+static void *ahead_thread(void *arg)
+{
+    sh_video_t *sh = arg;
+    vd_ffmpeg_ctx *ctx = sh->context;
+    struct decode_ahead *q = ctx->ahead;
+
+    pthread_mutex_lock(&q->lock);
+    while (!q->quit) {
+        struct ahead_packet *p = q->packets;
+        bool drain = !p && q->draining && !q->drained;
+        if ((!p && !drain) || q->frame_bytes >= q->max_bytes) {
+            pthread_cond_wait(&q->wakeup, &q->lock);
+            continue;
+        }
+        if (p) {
+            q->packets = p->next;
+            if (!q->packets)
+                q->packets_tail = &q->packets;
+            q->num_packets--;
+        }
+        q->busy = true;
+        pthread_mutex_unlock(&q->lock);
+
+        unsigned int t0 = GetTimer();
+        struct ahead_frame *f = ahead_decode(sh, p);
+        double decode_time = (GetTimer() - t0) * 1e-6;
+
+        pthread_mutex_lock(&q->lock);
+        q->busy = false;
+        if (p) {
+            ctx->stats.decode_time += decode_time;
+            ctx->stats.decoded_packets++;
+        }
+        if (f) {
+            *q->frames_tail = f;
+            q->frames_tail = &f->next;
+            q->num_frames++;
+            q->frame_bytes += f->bytes;
+        } else if (drain) {
+            q->drained = true;
+        }
+        AVCodecContext *avctx = ctx->avctx;
+        q->codec_delay = avctx->has_b_frames;
+        if (avctx->active_thread_type & FF_THREAD_FRAME)
+            q->codec_delay += avctx->thread_count - 1;
+        pthread_cond_broadcast(&q->wakeup);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+// Drop all queued packets and frames, and reset the decoder. Must be called
+// with q->lock held.
+static void ahead_flush_locked(sh_video_t *sh)
+{
+    vd_ffmpeg_ctx *ctx = sh->context;
+    struct decode_ahead *q = ctx->ahead;
+
+    while (q->packets) {
+        struct ahead_packet *p = q->packets;
+        q->packets = p->next;
+        free_ahead_packet(p);
+    }
+    q->packets_tail = &q->packets;
+    q->num_packets = 0;
+    // The thread doesn't pick up new work while we hold the lock, so the
+    // decoder can be flushed from here once it's idle.
+    while (q->busy)
+        pthread_cond_wait(&q->wakeup, &q->lock);
+    avcodec_flush_buffers(ctx->avctx);
+    while (q->frames) {
+        struct ahead_frame *f = q->frames;
+        q->frames = f->next;
+        free_ahead_frame(f);
+    }
+    q->frames_tail = &q->frames;
+    q->num_frames = 0;
+    q->frame_bytes = 0;
+    q->draining = q->drained = false;
+}
+
+static void start_decode_ahead(sh_video_t *sh)
+{
+    vd_ffmpeg_ctx *ctx = sh->context;
+    struct decode_ahead *q = talloc_zero(ctx, struct decode_ahead);
+
+    q->max_frames = sh->opts->video_decode_ahead;
+    q->max_bytes = sh->opts->video_decode_ahead_bytes;
+    q->packets_tail = &q->packets;
+    q->frames_tail = &q->frames;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->wakeup, NULL);
+    ctx->ahead = q;
+    if (pthread_create(&q->thread, NULL, ahead_thread, sh)) {
+        mp_msg(MSGT_DECVIDEO, MSGL_ERR, "[VD_FFMPEG] Could not create the "
+               "decoding thread, decoding synchronously.\n");
+        pthread_cond_destroy(&q->wakeup);
+        pthread_mutex_destroy(&q->lock);
+        ctx->ahead = NULL;
+        talloc_free(q);
+        return;
+    }
+    mp_msg(MSGT_DECVIDEO, MSGL_V, "[VD_FFMPEG] Decoding up to %d frames "
+           "ahead.\n", q->max_frames);
+}
+
+static void stop_decode_ahead(sh_video_t *sh)
+{
+    vd_ffmpeg_ctx *ctx = sh->context;
+    struct decode_ahead *q = ctx->ahead;
+
+    pthread_mutex_lock(&q->lock);
+    ahead_flush_locked(sh);
+    q->quit = true;
+    pthread_cond_broadcast(&q->wakeup);
+    pthread_mutex_unlock(&q->lock);
+    pthread_join(q->thread, NULL);
+    if (q->current)
+        free_mp_image(q->current);
+    pthread_cond_destroy(&q->wakeup);
+    pthread_mutex_destroy(&q->lock);
+    ctx->ahead = NULL;
+    talloc_free(q);
+}
+
+// decode() with --video-decode-ahead: queue the packet for the decoding
+// thread, and return the oldest frame once enough frames are buffered.
+static struct mp_image *decode_ahead(struct sh_video *sh,
+                                     struct demux_packet *packet,
+                                     void *data, int len, int flags,
+                                     double *reordered_pts)
+{
+    vd_ffmpeg_ctx *ctx = sh->context;
+    struct decode_ahead *q = ctx->ahead;
+    struct ahead_packet *p = NULL;
+
+    if (len > 0) {
+        p = talloc_zero(NULL, struct ahead_packet);
+        av_init_packet(&p->pkt);
+        p->pkt.data = data;
+        p->pkt.size = len;
+        if (packet && packet->keyframe)
+            p->pkt.flags |= AV_PKT_FLAG_KEY;
+        if (packet && packet->avpacket) {
+            p->pkt.side_data = packet->avpacket->side_data;
+            p->pkt.side_data_elems = packet->avpacket->side_data_elems;
+        }
+        // The demuxer packet is only valid until the next read, so make the
+        // packet own a copy of the data and side data.
+        if (av_dup_packet(&p->pkt) < 0) {
+            talloc_free(p);
+            return NULL;
+        }
+        p->flags = flags;
+        p->degrade_level = ctx->degrade_level;
+        p->keyframes_only = ctx->keyframes_only;
+        p->pts = *reordered_pts;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    if (p) {
+        *q->packets_tail = p;
+        q->packets_tail = &p->next;
+        q->num_packets++;
+        q->draining = q->drained = false;
+    } else if (!packet) {
+        q->draining = true;
+    }
+    pthread_cond_broadcast(&q->wakeup);
+
+    struct ahead_frame *f = NULL;
+    while (1) {
+        int queued = q->num_packets + q->num_frames + q->busy;
+        bool full = queued > q->max_frames || q->frame_bytes >= q->max_bytes;
+        if (q->frames && (full || q->draining)) {
+            f = q->frames;
+            q->frames = f->next;
+            if (!q->frames)
+                q->frames_tail = &q->frames;
+            q->num_frames--;
+            q->frame_bytes -= f->bytes;
+            pthread_cond_broadcast(&q->wakeup);
+            break;
+        }
+        if (q->draining ? q->drained : !full)
+            break;
+        pthread_cond_wait(&q->wakeup, &q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    if (!f)
+        return NULL;
+
+    struct mp_image *mpi = NULL;
+    if (f->img && init_vo_params(sh, &f->params) >= 0) {
+        q->params = f->params;
+        mpi = mpcodecs_get_image(sh, MP_IMGTYPE_EXPORT, MP_IMGFLAG_PRESERVE,
+                                 f->params.w, f->params.h);
+    }
+    if (mpi) {
+        for (int i = 0; i < 4; i++) {
+            mpi->planes[i] = f->img->planes[i];
+            mpi->stride[i] = f->img->stride[i];
+        }
+        // Keep the memory alive as long as the exported image may be used.
+        if (q->current)
+            free_mp_image(q->current);
+        q->current = f->img;
+        f->img = NULL;
+        *reordered_pts = f->pts;
+        mpi = set_image_info(sh, mpi, &f->info);
+    }
+    free_ahead_frame(f);
+    return mpi;
+}
+#endif
+
 static av_unused void swap_palette(void *pal)
 {
     int i;
@@ -626,15 +1274,25 @@ static struct mp_image *decode(struct sh_video *sh, struct demux_packet *packet,
     int dr1 = ctx->do_dr1;
     AVPacket pkt;
 
+#ifdef HAVE_PTHREADS
+    if (ctx->ahead)
+        return decode_ahead(sh, packet, data, len, flags, reordered_pts);
+#endif
+
     if (!dr1)
         avctx->draw_horiz_band = NULL;
 
+    apply_degradation(sh, ctx->degrade_level, ctx->keyframes_only,
+                      packet && packet->keyframe);
+    avctx = ctx->avctx;
+
     if (flags & 2)
         avctx->skip_frame = AVDISCARD_ALL;
     else if (flags & 1)
-        avctx->skip_frame = AVDISCARD_NONREF;
+        avctx->skip_frame = ctx->keyframes_only ? AVDISCARD_NONKEY
+                                                : AVDISCARD_NONREF;
     else
-        avctx->skip_frame = ctx->skip_frame;
+        avctx->skip_frame = ctx->cur_skip_frame;
 
     av_init_packet(&pkt);
     pkt.data = data;
@@ -647,10 +1305,11 @@ static struct mp_image *decode(struct sh_video *sh, struct demux_packet *packet,
         pkt.side_data = packet->avpacket->side_data;
         pkt.side_data_elems = packet->avpacket->side_data_elems;
     }
-    // The avcodec opaque field stupidly supports only int64_t type
-    union pts { int64_t i; double d; };
     avctx->reordered_opaque = (union pts){.d = *reordered_pts}.i;
+    unsigned int t0 = GetTimer();
     ret = avcodec_decode_video2(avctx, pic, &got_picture, &pkt);
+    ctx->stats.decode_time += (GetTimer() - t0) * 1e-6;
+    ctx->stats.decoded_packets++;
     *reordered_pts = (union pts){.i = pic->reordered_opaque}.d;
 
     dr1 = ctx->do_dr1;
@@ -738,7 +1397,9 @@ static struct mp_image *decode(struct sh_video *sh, struct demux_packet *packet,
     if (init_vo(sh, avctx->pix_fmt) < 0)
         return NULL;
 
-    if (dr1 && pic->opaque)
+    // Not set if get_buffer fell back to a libavcodec allocated buffer.
+    bool direct = dr1 && pic->opaque;
+    if (direct)
         mpi = (mp_image_t *)pic->opaque;
 
     if (!mpi)
@@ -750,7 +1411,7 @@ static struct mp_image *decode(struct sh_video *sh, struct demux_packet *packet,
         return NULL;
     }
 
-    if (!dr1) {
+    if (!direct) {
         mpi->planes[0] = pic->data[0];
         mpi->planes[1] = pic->data[1];
         mpi->planes[2] = pic->data[2];
@@ -761,6 +1422,15 @@ static struct mp_image *decode(struct sh_video *sh, struct demux_packet *packet,
         mpi->stride[3] = pic->linesize[3];
     }
 
+    return set_image_info(sh, mpi, pic);
+}
+
+// Set the properties of the image returned by decode() from the picture.
+static struct mp_image *set_image_info(struct sh_video *sh, mp_image_t *mpi,
+                                       const AVFrame *pic)
+{
+    vd_ffmpeg_ctx *ctx = sh->context;
+
     if (!mpi->planes[0])
         return NULL;
 
@@ -813,7 +1483,7 @@ static enum PixelFormat get_format(struct AVCodecContext *avctx,
 static int control(sh_video_t *sh, int cmd, void *arg)
 {
     vd_ffmpeg_ctx *ctx = sh->context;
-    AVCodecContext *avctx = ctx->avctx;
+    // With --video-decode-ahead, ctx->avctx belongs to the decoding thread.
     switch (cmd) {
     case VDCTRL_QUERY_FORMAT: {
         int format = (*((int *)arg));
@@ -834,17 +1504,63 @@ static int control(sh_video_t *sh, int cmd, void *arg)
         return CONTROL_FALSE;
     }
     case VDCTRL_RESYNC_STREAM:
-        avcodec_flush_buffers(avctx);
+#ifdef HAVE_PTHREADS
+        if (ctx->ahead) {
+            pthread_mutex_lock(&ctx->ahead->lock);
+            ahead_flush_locked(sh);
+            pthread_mutex_unlock(&ctx->ahead->lock);
+            return CONTROL_TRUE;
+        }
+#endif
+        avcodec_flush_buffers(ctx->avctx);
         return CONTROL_TRUE;
     case VDCTRL_QUERY_UNSEEN_FRAMES:;
-        int delay = avctx->has_b_frames;
-        if (avctx->active_thread_type & FF_THREAD_FRAME)
-            delay += avctx->thread_count - 1;
+#ifdef HAVE_PTHREADS
+        if (ctx->ahead) {
+            pthread_mutex_lock(&ctx->ahead->lock);
+            int delay = ctx->ahead->codec_delay + ctx->ahead->max_frames;
+            pthread_mutex_unlock(&ctx->ahead->lock);
+            return delay + 10;
+        }
+#endif
+        int delay = ctx->avctx->has_b_frames;
+        if (ctx->avctx->active_thread_type & FF_THREAD_FRAME)
+            delay += ctx->avctx->thread_count - 1;
         return delay + 10;
+    case VDCTRL_QUERY_DECODE_STATS:
+#ifdef HAVE_PTHREADS
+        if (ctx->ahead) {
+            pthread_mutex_lock(&ctx->ahead->lock);
+            *(struct vd_decode_stats *)arg = ctx->stats;
+            pthread_mutex_unlock(&ctx->ahead->lock);
+            return CONTROL_TRUE;
+        }
+#endif
+        *(struct vd_decode_stats *)arg = ctx->stats;
+        return CONTROL_TRUE;
+    case VDCTRL_SET_DEGRADATION: {
+        int *level = arg;
+        ahead_lock(ctx);
+        *level = av_clip(*level, VD_DEGRADE_NONE, ctx->max_degrade);
+        ahead_unlock(ctx);
+        ctx->degrade_level = *level;
+        return CONTROL_TRUE;
+    }
+    case VDCTRL_SET_KEYFRAMES_ONLY:
+        ctx->keyframes_only = *(bool *)arg;
+        return CONTROL_TRUE;
     case VDCTRL_RESET_ASPECT:
         if (ctx->vo_initialized)
             ctx->vo_initialized = false;
-        init_vo(sh, avctx->pix_fmt);
+#ifdef HAVE_PTHREADS
+        // The decoder state belongs to the decoding thread.
+        if (ctx->ahead) {
+            if (ctx->ahead->params.w)
+                init_vo_params(sh, &ctx->ahead->params);
+            return true;
+        }
+#endif
+        init_vo(sh, ctx->avctx->pix_fmt);
         return true;
     }
     return CONTROL_UNKNOWN;
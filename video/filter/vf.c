@@ -198,9 +198,8 @@ mp_image_t *vf_get_image(vf_instance_t *vf, unsigned int outfmt,
 
     if (vf->put_image == vf_next_put_image) {
         // passthru mode, if the filter uses the fallback/default put_image()
-        mpi = vf_get_image(vf->next,outfmt,mp_imgtype,mp_imgflag,w,h);
-        mpi->usage_count++;
-        return mpi;
+        // (the usage count was already incremented by the next filter)
+        return vf_get_image(vf->next,outfmt,mp_imgtype,mp_imgflag,w,h);
     }
 
     // Note: we should call libvo first to check if it supports direct rendering
@@ -269,12 +268,7 @@ mp_image_t *vf_get_image(vf_instance_t *vf, unsigned int outfmt,
             if (mpi->flags & MP_IMGFLAG_ALLOCATED) {
                 if (mpi->width < w2 || mpi->height < h || missing_palette) {
                     // need to re-allocate buffer memory:
-                    av_free(mpi->planes[0]);
-                    if (mpi->flags & MP_IMGFLAG_RGB_PALETTE)
-                        av_free(mpi->planes[1]);
-                    for (int n = 0; n < MP_MAX_PLANES; n++)
-                        mpi->planes[n] = NULL;
-                    mpi->flags &= ~MP_IMGFLAG_ALLOCATED;
+                    mp_image_free_planes(mpi);
                     mp_msg(MSGT_VFILTER, MSGL_V,
                            "vf.c: have to REALLOCATE buffer memory :(\n");
                 }
@@ -288,6 +282,17 @@ mp_image_t *vf_get_image(vf_instance_t *vf, unsigned int outfmt,
         }
         if (!mpi->bpp)
             mp_image_setfmt(mpi, outfmt);
+        // If a reference to the previous contents was kept (see
+        // mp_image_new_ref()), give the image new memory instead of
+        // overwriting them. STATIC images are only partially updated by the
+        // codec, so their contents are carried over.
+        struct mp_image *old_contents = NULL;
+        if ((mpi->flags & MP_IMGFLAG_ALLOCATED) &&
+                !mp_image_is_writeable(mpi)) {
+            if ((mp_imgtype & 0xff) == MP_IMGTYPE_STATIC)
+                old_contents = mp_image_new_ref(mpi);
+            mp_image_free_planes(mpi);
+        }
         if (!(mpi->flags & MP_IMGFLAG_ALLOCATED) &&
                 mpi->type > MP_IMGTYPE_EXPORT) {
             // check libvo first!
@@ -328,9 +333,16 @@ mp_image_t *vf_get_image(vf_instance_t *vf, unsigned int outfmt,
                 }
 
                 mp_image_alloc_planes(mpi);
-                vf_mpi_clear(mpi, 0, 0, mpi->width, mpi->height);
+                if (!old_contents)
+                    vf_mpi_clear(mpi, 0, 0, mpi->width, mpi->height);
             }
         }
+        if (old_contents) {
+            copy_mpi(mpi, old_contents);
+            if (mpi->flags & old_contents->flags & MP_IMGFLAG_RGB_PALETTE)
+                memcpy(mpi->planes[1], old_contents->planes[1], 1024);
+            free_mp_image(old_contents);
+        }
         if (mpi->flags & MP_IMGFLAG_DRAW_CALLBACK)
             if (vf->start_slice)
                 vf->start_slice(vf, mpi);
@@ -21,6 +21,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <assert.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 #include "talloc.h"
 
@@ -32,15 +37,139 @@
 #include "libavutil/mem.h"
 #include "libavutil/common.h"
 
+// Plane memory is reference counted, so that several images can share it
+// (see mp_image_new_ref()). Unreferenced buffers are recycled through a free
+// list, because allocating and page faulting in new memory for every frame is
+// measurable with large video sizes. Buffers are only reused for requests of
+// exactly the same size, which is the normal case while the video format
+// doesn't change; the oldest buffers are dropped first.
+#define POOL_MAX_BUFFERS 16
+#define POOL_MAX_BYTES (128 * 1024 * 1024)
+
+struct mp_image_buffer {
+    struct mp_image_buffer *next; // in the free list
+    int refcount;
+    size_t size;
+    uint8_t *data;
+};
+
+static struct buffer_pool {
+#ifdef HAVE_PTHREADS
+    pthread_mutex_t lock;
+#endif
+    struct mp_image_buffer *buffers; // unused buffers, most recent first
+    int num_buffers;
+    size_t bytes;
+} pool = {
+#ifdef HAVE_PTHREADS
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+static void pool_lock(void)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&pool.lock);
+#endif
+}
+
+static void pool_unlock(void)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&pool.lock);
+#endif
+}
+
+static struct mp_image_buffer *buffer_alloc(size_t size)
+{
+    struct mp_image_buffer *buf = NULL;
+    pool_lock();
+    for (struct mp_image_buffer **p = &pool.buffers; *p; p = &(*p)->next) {
+        if ((*p)->size == size) {
+            buf = *p;
+            *p = buf->next;
+            pool.num_buffers--;
+            pool.bytes -= size;
+            break;
+        }
+    }
+    pool_unlock();
+    if (!buf) {
+        buf = malloc(sizeof(*buf));
+        if (!buf)
+            abort(); //out of memory
+        buf->data = av_malloc(size);
+        if (!buf->data)
+            abort(); //out of memory
+        buf->size = size;
+    }
+    buf->next = NULL;
+    buf->refcount = 1;
+    return buf;
+}
+
+static void buffer_ref(struct mp_image_buffer *buf)
+{
+    pool_lock();
+    assert(buf->refcount > 0);
+    buf->refcount++;
+    pool_unlock();
+}
+
+static void buffer_unref(struct mp_image_buffer *buf)
+{
+    struct mp_image_buffer *dropped = NULL;
+    pool_lock();
+    assert(buf->refcount > 0);
+    buf->refcount--;
+    if (!buf->refcount) {
+        if (buf->size <= POOL_MAX_BYTES) {
+            buf->next = pool.buffers;
+            pool.buffers = buf;
+            pool.num_buffers++;
+            pool.bytes += buf->size;
+        } else {
+            dropped = buf;
+        }
+        // Cut off the oldest buffers at the end of the list.
+        struct mp_image_buffer **p = &pool.buffers;
+        int num = 0;
+        size_t bytes = 0;
+        while (*p) {
+            num++;
+            bytes += (*p)->size;
+            if (num > POOL_MAX_BUFFERS || bytes > POOL_MAX_BYTES) {
+                struct mp_image_buffer *tail = *p;
+                *p = NULL;
+                while (tail) {
+                    struct mp_image_buffer *next = tail->next;
+                    pool.num_buffers--;
+                    pool.bytes -= tail->size;
+                    tail->next = dropped;
+                    dropped = tail;
+                    tail = next;
+                }
+                break;
+            }
+            p = &(*p)->next;
+        }
+    }
+    pool_unlock();
+    while (dropped) {
+        struct mp_image_buffer *next = dropped->next;
+        av_free(dropped->data);
+        free(dropped);
+        dropped = next;
+    }
+}
+
 void mp_image_alloc_planes(mp_image_t *mpi) {
+  size_t size = mpi->bpp*mpi->width*(mpi->height+2)/8;
   // IF09 - allocate space for 4. plane delta info - unused
-  if (mpi->imgfmt == IMGFMT_IF09) {
-    mpi->planes[0]=av_malloc(mpi->bpp*mpi->width*(mpi->height+2)/8+
-                            mpi->chroma_width*mpi->chroma_height);
-  } else
-    mpi->planes[0]=av_malloc(mpi->bpp*mpi->width*(mpi->height+2)/8);
-  if (!mpi->planes[0])
-    abort(); //out of memory
+  if (mpi->imgfmt == IMGFMT_IF09)
+    size += mpi->chroma_width*mpi->chroma_height;
+  mpi->buffer = buffer_alloc(size);
+  mpi->planes[0] = mpi->buffer->data;
   if (mpi->flags&MP_IMGFLAG_PLANAR) {
     // FIXME this code only supports same bpp for all planes, and bpp divisible
     // by 8. Currently the case for all planar formats.
@@ -227,17 +356,24 @@ void mp_image_setfmt(mp_image_t* mpi,unsigned int out_fmt){
     mpi->bpp=0;
 }
 
-static int mp_image_destructor(void *ptr)
+// Drop the image's reference to its plane memory (if allocated).
+void mp_image_free_planes(mp_image_t *mpi)
 {
-    mp_image_t *mpi = ptr;
-
-    if(mpi->flags&MP_IMGFLAG_ALLOCATED){
+    if (mpi->flags & MP_IMGFLAG_ALLOCATED) {
         /* because we allocate the whole image at once */
-        av_free(mpi->planes[0]);
+        buffer_unref(mpi->buffer);
         if (mpi->flags & MP_IMGFLAG_RGB_PALETTE)
             av_free(mpi->planes[1]);
+        for (int n = 0; n < MP_MAX_PLANES; n++)
+            mpi->planes[n] = NULL;
+        mpi->buffer = NULL;
+        mpi->flags &= ~MP_IMGFLAG_ALLOCATED;
     }
+}
 
+static int mp_image_destructor(void *ptr)
+{
+    mp_image_free_planes(ptr);
     return 0;
 }
 
@@ -253,6 +389,57 @@ void free_mp_image(mp_image_t* mpi){
     talloc_free(mpi);
 }
 
+// Return a new image with the same contents as img. If img owns its plane
+// memory, the new image references the same memory and nothing is copied,
+// otherwise (e.g. for exported decoder buffers) the data is copied. Both
+// images must be treated as read-only while the memory is shared (see
+// mp_image_is_writeable()). Free the result with free_mp_image().
+struct mp_image *mp_image_new_ref(struct mp_image *img)
+{
+    struct mp_image *new;
+    if (img->flags & MP_IMGFLAG_ALLOCATED) {
+        new = new_mp_image(img->w, img->h);
+        *new = *img;
+        buffer_ref(new->buffer);
+        if (img->flags & MP_IMGFLAG_RGB_PALETTE) {
+            new->planes[1] = av_malloc(1024);
+            memcpy(new->planes[1], img->planes[1], 1024);
+        }
+    } else {
+        new = alloc_mpi(img->w, img->h, img->imgfmt);
+        copy_mpi(new, img);
+        if (img->flags & MP_IMGFLAG_RGB_PALETTE) {
+            new->planes[1] = av_malloc(1024);
+            memcpy(new->planes[1], img->planes[1], 1024);
+            new->flags |= MP_IMGFLAG_RGB_PALETTE;
+        }
+        new->pict_type = img->pict_type;
+        new->fields = img->fields;
+        new->qscale_type = img->qscale_type;
+        new->display_w = img->display_w;
+        new->display_h = img->display_h;
+        new->colorspace = img->colorspace;
+        new->levels = img->levels;
+    }
+    // Not owned by the new image; the decoder frees it.
+    new->qscale = NULL;
+    new->usage_count = 0;
+    new->priv = NULL;
+    return new;
+}
+
+// Return whether the image data can be modified without affecting other
+// images, i.e. the image owns its plane memory and doesn't share it.
+bool mp_image_is_writeable(struct mp_image *img)
+{
+    if (!(img->flags & MP_IMGFLAG_ALLOCATED))
+        return false;
+    pool_lock();
+    bool res = img->buffer->refcount == 1;
+    pool_unlock();
+    return res;
+}
+
 enum mp_csp mp_image_csp(struct mp_image *img)
 {
     if (img->colorspace != MP_CSP_AUTO)
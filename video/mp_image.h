@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include "core/mp_msg.h"
 #include "csputils.h"
@@ -108,6 +109,8 @@
 #define MP_IMGFIELD_BOTTOM 0x10
 #define MP_IMGFIELD_INTERLACED 0x20
 
+struct mp_image_buffer;
+
 typedef struct mp_image {
     unsigned int flags;
     unsigned char type;
@@ -135,6 +138,9 @@ typedef struct mp_image {
     int usage_count;
     /* for private use by filter or vo driver (to store buffer id or dmpi) */
     void* priv;
+    // Refcounted plane memory, set if MP_IMGFLAG_ALLOCATED is set. Can be
+    // shared with other images created by mp_image_new_ref().
+    struct mp_image_buffer *buffer;
 } mp_image_t;
 
 void mp_image_setfmt(mp_image_t* mpi,unsigned int out_fmt);
@@ -143,8 +149,12 @@ void free_mp_image(mp_image_t* mpi);
 
 mp_image_t* alloc_mpi(int w, int h, unsigned long int fmt);
 void mp_image_alloc_planes(mp_image_t *mpi);
+void mp_image_free_planes(mp_image_t *mpi);
 void copy_mpi(mp_image_t *dmpi, mp_image_t *mpi);
 
+struct mp_image *mp_image_new_ref(struct mp_image *img);
+bool mp_image_is_writeable(struct mp_image *img);
+
 enum mp_csp mp_image_csp(struct mp_image *img);
 enum mp_csp_levels mp_image_levels(struct mp_image *img);
 
@@ -416,6 +416,7 @@ static int config(struct vo *vo, uint32_t width, uint32_t height,
         return -1;
     }
 
+    free_mp_image(vc->ssmpi);
     vc->ssmpi = alloc_mpi(width, height, format);
 
     resize(vo, d_width, d_height);
@@ -887,8 +888,12 @@ static void draw_image(struct vo *vo, mp_image_t *mpi, double pts)
         SDL_SetTextureColorMod(vc->tex, color_mod, color_mod, color_mod);
         SDL_RenderCopy(vc->renderer, vc->tex, &src, &dst);
     }
-    if (mpi)
-        copy_mpi(vc->ssmpi, mpi);
+    if (mpi) {
+        // Keep the frame for screenshots. This copies only if the image
+        // doesn't own refcounted memory.
+        free_mp_image(vc->ssmpi);
+        vc->ssmpi = mp_image_new_ref(mpi);
+    }
 }
 
 static void update_screeninfo(struct vo *vo)
@@ -908,10 +913,7 @@ static void update_screeninfo(struct vo *vo)
 static struct mp_image *get_screenshot(struct vo *vo)
 {
     struct priv *vc = vo->priv;
-    mp_image_t *image = alloc_mpi(vc->ssmpi->width, vc->ssmpi->height,
-                                  vc->ssmpi->imgfmt);
-    copy_mpi(image, vc->ssmpi);
-    return image;
+    return mp_image_new_ref(vc->ssmpi);
 }
 
 static struct mp_image *get_window_screenshot(struct vo *vo)